@@ -0,0 +1,153 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "ct_adapt.h"
+#include "ct_common.h"
+#include "tlog.h"
+
+// adaptive concurrency module, see ct_adapt.h
+//
+// request latency depends on the transfer size, so it is normalized to
+// seconds per MB (plus one MB for the fixed cost of a request) before it
+// is averaged, the short and long term averages then compare like with like
+
+#define CT_ADAPT_UNIT (1024 * 1024)
+// smoothing of the recent and long term latency
+#define CT_ADAPT_ALPHA_SHORT 0.2
+#define CT_ADAPT_ALPHA_LONG 0.01
+
+static struct ct_adapt_params adapt_params;
+static ct_adapt_apply_fn      adapt_apply;
+static bool                   adapt_enabled;
+static int                    adapt_limit;
+
+// current interval
+static double                 adapt_interval_start;
+static int                    adapt_total;
+static int                    adapt_errors;
+static int                    adapt_throttled;
+
+static double                 adapt_latency_short;
+static double                 adapt_latency_long;
+
+static pthread_mutex_t        adapt_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int ct_adapt_init(const struct ct_adapt_params *params, ct_adapt_apply_fn apply)
+{
+    assert(params && apply);
+
+    if (params->min <= 0 || params->max < params->min || params->tolerance <= 1.0) {
+        tlog_error("invalid adaptive concurrency min %d max %d tolerance %f",
+                   params->min, params->max, params->tolerance);
+        return -EINVAL;
+    }
+
+    adapt_params = *params;
+    adapt_apply = apply;
+    adapt_limit = params->max;
+    adapt_interval_start = ct_now();
+    adapt_enabled = true;
+
+    tlog_info("adaptive concurrency between %d and %d actions, latency tolerance %.2f",
+              adapt_params.min, adapt_params.max, adapt_params.tolerance);
+    return 0;
+}
+
+bool ct_adapt_enabled(void)
+{
+    return adapt_enabled;
+}
+
+int ct_adapt_limit(void)
+{
+    return __atomic_load_n(&adapt_limit, __ATOMIC_RELAXED);
+}
+
+static bool ct_adapt_is_throttle(S3Status status)
+{
+    switch (status) {
+    case S3StatusErrorSlowDown:
+    case S3StatusErrorServiceUnavailable:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// end of an interval, returns the new limit
+// must hold adapt_mutex
+static int ct_adapt_update(void)
+{
+    int limit = adapt_limit;
+    const char *reason = NULL;
+
+    if (adapt_throttled)
+        reason = "throttled";
+    else if (adapt_errors > adapt_total * CT_ADAPT_ERROR_RATIO)
+        reason = "errors";
+    else if (adapt_latency_long > 0 &&
+             adapt_latency_short > adapt_latency_long * adapt_params.tolerance)
+        reason = "latency";
+
+    if (reason) {
+        limit = limit * CT_ADAPT_BACKOFF;
+        if (limit < adapt_params.min)
+            limit = adapt_params.min;
+        if (limit != adapt_limit)
+            tlog_warn("decrease concurrency to %d (%s, %d throttled, %d errors of "
+                      "%d requests, latency %f/%f s/MB)", limit, reason,
+                      adapt_throttled, adapt_errors, adapt_total,
+                      adapt_latency_short, adapt_latency_long);
+    } else if (limit < adapt_params.max) {
+        limit++;
+        tlog_debug("increase concurrency to %d", limit);
+    }
+
+    return limit;
+}
+
+void ct_adapt_observe(S3Status status, uint64_t bytes, double latency)
+{
+    if (!adapt_enabled)
+        return;
+
+    pthread_mutex_lock(&adapt_mutex);
+
+    adapt_total++;
+    if (ct_adapt_is_throttle(status)) {
+        adapt_throttled++;
+    } else if (status != S3StatusOK) {
+        adapt_errors++;
+    } else {
+        double sample = latency / (1.0 + (double)bytes / CT_ADAPT_UNIT);
+        if (adapt_latency_long == 0) {
+            adapt_latency_short = sample;
+            adapt_latency_long = sample;
+        } else {
+            adapt_latency_short += CT_ADAPT_ALPHA_SHORT * (sample - adapt_latency_short);
+            adapt_latency_long += CT_ADAPT_ALPHA_LONG * (sample - adapt_latency_long);
+        }
+    }
+
+    double now = ct_now();
+    if ((now - adapt_interval_start) * 1000 >= CT_ADAPT_INTERVAL_MS) {
+        int new_limit = ct_adapt_update();
+        if (new_limit != adapt_limit) {
+            __atomic_store_n(&adapt_limit, new_limit, __ATOMIC_RELAXED);
+            // under adapt_mutex, so limits are applied in order
+            adapt_apply(new_limit);
+        }
+        adapt_interval_start = now;
+        adapt_total = 0;
+        adapt_errors = 0;
+        adapt_throttled = 0;
+    }
+
+    pthread_mutex_unlock(&adapt_mutex);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libs3.h"
+
+// adaptive concurrency
+// an AIMD controller sets the number of HSM actions allowed to run at once
+// from what S3 requests see: every interval the limit grows by one while
+// requests succeed at a steady latency, and is cut by a factor as soon as
+// the endpoint throttles (SlowDown, ServiceUnavailable), requests fail or
+// time out, or the recent latency drifts away from the long term latency
+// max_requests is the ceiling of the limit
+
+#define CT_ADAPT_INTERVAL_MS 1000
+#define CT_ADAPT_TOLERANCE_DEFAULT 2.0
+// limit kept after a decrease
+#define CT_ADAPT_BACKOFF 0.75
+// error ratio of an interval that counts as overload
+#define CT_ADAPT_ERROR_RATIO 0.1
+
+typedef void (*ct_adapt_apply_fn)(int limit);
+
+struct ct_adapt_params {
+    int min;
+    int max;
+    // recent/long term latency ratio that counts as overload
+    double tolerance;
+};
+
+// start at params->max, apply is called with every new limit
+int ct_adapt_init(const struct ct_adapt_params *params, ct_adapt_apply_fn apply);
+
+bool ct_adapt_enabled(void);
+
+// account one finished S3 request of bytes bytes, called by the engine
+void ct_adapt_observe(S3Status status, uint64_t bytes, double latency);
+
+// current limit
+int ct_adapt_limit(void);
@@ -0,0 +1,200 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <string.h>
+#include <pthread.h>
+
+#include "ct_breaker.h"
+#include "ct_common.h"
+#include "tlog.h"
+
+// circuit breaker module, see ct_breaker.h
+
+enum ct_breaker_state {
+    CT_BREAKER_CLOSED = 0,
+    CT_BREAKER_OPEN,
+    CT_BREAKER_HALF_OPEN,
+};
+
+struct ct_breaker {
+    char host[S3_MAX_HOSTNAME_SIZE];
+    enum ct_breaker_state state;
+    int failures;
+    double open_until;
+    // half open only, a probe is in flight since probe_start
+    bool probing;
+    double probe_start;
+};
+
+static int               breaker_failures = CT_BREAKER_FAILURES_DEFAULT;
+static double            breaker_open_time = CT_BREAKER_OPEN_MS_DEFAULT / 1000.0;
+static struct ct_breaker breakers[CT_BREAKER_MAX];
+static int               breaker_count;
+static pthread_mutex_t   breaker_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void ct_breaker_setup(int failures, int open_ms)
+{
+    breaker_failures = failures;
+    breaker_open_time = open_ms / 1000.0;
+
+    if (failures)
+        tlog_info("circuit breaker opens after %d failures for %d ms", failures, open_ms);
+    else
+        tlog_info("circuit breaker disabled");
+}
+
+// must hold breaker_mutex
+static struct ct_breaker *ct_breaker_find(const char *host)
+{
+    for (int i = 0; i < breaker_count; i++) {
+        if (strcmp(breakers[i].host, host) == 0)
+            return &breakers[i];
+    }
+
+    if (breaker_count == CT_BREAKER_MAX)
+        return NULL;
+
+    struct ct_breaker *breaker = &breakers[breaker_count++];
+    memset(breaker, 0, sizeof(*breaker));
+    strncpy(breaker->host, host, sizeof(breaker->host) - 1);
+    return breaker;
+}
+
+static bool ct_breaker_is_outage(S3Status status)
+{
+    switch (status) {
+    case S3StatusNameLookupError:
+    case S3StatusFailedToConnect:
+    case S3StatusConnectionFailed:
+    case S3StatusErrorInternalError:
+    case S3StatusErrorRequestTimeout:
+    case S3StatusErrorServiceUnavailable:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// must hold breaker_mutex
+static void ct_breaker_open(struct ct_breaker *breaker, double now)
+{
+    breaker->state = CT_BREAKER_OPEN;
+    breaker->open_until = now + breaker_open_time;
+    breaker->probing = false;
+}
+
+bool ct_breaker_allow(const char *host)
+{
+    bool allow = true;
+
+    if (breaker_failures == 0 || host == NULL)
+        return true;
+
+    pthread_mutex_lock(&breaker_mutex);
+    struct ct_breaker *breaker = ct_breaker_find(host);
+    double now = ct_now();
+
+    if (breaker && breaker->state == CT_BREAKER_OPEN) {
+        if (now < breaker->open_until) {
+            allow = false;
+        } else {
+            breaker->state = CT_BREAKER_HALF_OPEN;
+            breaker->probing = true;
+            breaker->probe_start = now;
+            tlog_info("circuit breaker of '%s' half open, probing", host);
+        }
+    } else if (breaker && breaker->state == CT_BREAKER_HALF_OPEN) {
+        // a probe that never reported back does not block forever
+        if (breaker->probing && now - breaker->probe_start < breaker_open_time) {
+            allow = false;
+        } else {
+            breaker->probing = true;
+            breaker->probe_start = now;
+        }
+    }
+    pthread_mutex_unlock(&breaker_mutex);
+
+    return allow;
+}
+
+void ct_breaker_record(const char *host, S3Status status)
+{
+    // rejected by the breaker itself
+    if (breaker_failures == 0 || host == NULL || status == S3StatusInterrupted)
+        return;
+
+    bool outage = ct_breaker_is_outage(status);
+
+    pthread_mutex_lock(&breaker_mutex);
+    struct ct_breaker *breaker = ct_breaker_find(host);
+    double now = ct_now();
+
+    if (breaker == NULL) {
+        pthread_mutex_unlock(&breaker_mutex);
+        return;
+    }
+
+    switch (breaker->state) {
+    case CT_BREAKER_CLOSED:
+        if (!outage) {
+            breaker->failures = 0;
+        } else if (++breaker->failures >= breaker_failures) {
+            ct_breaker_open(breaker, now);
+            tlog_error("circuit breaker of '%s' open after %d failures, last %s",
+                       host, breaker->failures, S3_get_status_name(status));
+        }
+        break;
+    case CT_BREAKER_HALF_OPEN:
+        if (outage) {
+            ct_breaker_open(breaker, now);
+            tlog_warn("circuit breaker of '%s' probe failed with %s, open again",
+                      host, S3_get_status_name(status));
+        } else {
+            breaker->state = CT_BREAKER_CLOSED;
+            breaker->failures = 0;
+            breaker->probing = false;
+            tlog_info("circuit breaker of '%s' closed, endpoint recovered", host);
+        }
+        break;
+    case CT_BREAKER_OPEN:
+        // requests sent before it opened, the probe decides
+        break;
+    }
+    pthread_mutex_unlock(&breaker_mutex);
+}
+
+bool ct_breaker_rejecting(const char *host)
+{
+    bool rejecting = false;
+
+    if (breaker_failures == 0 || host == NULL)
+        return false;
+
+    pthread_mutex_lock(&breaker_mutex);
+    struct ct_breaker *breaker = ct_breaker_find(host);
+    double now = ct_now();
+    if (breaker && breaker->state == CT_BREAKER_OPEN)
+        rejecting = now < breaker->open_until;
+    else if (breaker && breaker->state == CT_BREAKER_HALF_OPEN)
+        rejecting = breaker->probing && now - breaker->probe_start < breaker_open_time;
+    pthread_mutex_unlock(&breaker_mutex);
+
+    return rejecting;
+}
+
+bool ct_breaker_closed(const char *host)
+{
+    bool closed = true;
+
+    if (breaker_failures == 0 || host == NULL)
+        return true;
+
+    pthread_mutex_lock(&breaker_mutex);
+    struct ct_breaker *breaker = ct_breaker_find(host);
+    if (breaker)
+        closed = (breaker->state == CT_BREAKER_CLOSED);
+    pthread_mutex_unlock(&breaker_mutex);
+
+    return closed;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+
+#include "libs3.h"
+
+// per endpoint circuit breaker
+// closed: requests flow, a run of consecutive outage failures (cannot
+//   connect, timeout, internal error, service unavailable) opens it
+// open: every request to the endpoint fails at once with
+//   S3StatusInterrupted without touching the network, new actions are
+//   handed back to the coordinator with HP_FLAG_RETRY
+// half open: after the open time one request is let through as a probe,
+//   it closes the breaker when it succeeds and opens it again otherwise
+
+#define CT_BREAKER_FAILURES_DEFAULT 10
+#define CT_BREAKER_OPEN_MS_DEFAULT 5000
+// endpoints tracked at most
+#define CT_BREAKER_MAX 32
+
+// failures in a row opening a breaker, 0 disables breakers
+void ct_breaker_setup(int failures, int open_ms);
+
+// may a request be sent to host now, a request let through while the
+// breaker is half open is the probe and must be recorded
+bool ct_breaker_allow(const char *host);
+
+// account the outcome of a request sent to host
+void ct_breaker_record(const char *host, S3Status status);
+
+// true when requests to host are currently rejected, new actions should
+// not start
+bool ct_breaker_rejecting(const char *host);
+
+// true unless the breaker of host is open or half open
+bool ct_breaker_closed(const char *host);
@@ -0,0 +1,100 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+
+#include "ct_cancel.h"
+#include "ct_s3_engine.h"
+#include "tlog.h"
+
+// action cancellation module, see ct_cancel.h
+
+#define CT_CANCEL_BUCKETS 256
+// cookies cancelled while their action was still queued
+#define CT_CANCEL_EARLY 64
+
+static struct ct_cancel_entry  *cancel_buckets[CT_CANCEL_BUCKETS];
+static pthread_mutex_t          cancel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t                 cancel_early[CT_CANCEL_EARLY];
+static unsigned int             cancel_early_next;
+static __thread struct ct_cancel_entry *cancel_current;
+
+static unsigned int ct_cancel_bucket(uint64_t cookie)
+{
+    return (cookie ^ (cookie >> 32)) % CT_CANCEL_BUCKETS;
+}
+
+void ct_cancel_register(struct ct_cancel_entry *entry,
+                        const struct hsm_action_item *hai)
+{
+    entry->cookie = hai->hai_cookie;
+    entry->fid = hai->hai_fid;
+    entry->cancelled = false;
+
+    pthread_mutex_lock(&cancel_mutex);
+    for (int i = 0; i < CT_CANCEL_EARLY; i++) {
+        if (cancel_early[i] == entry->cookie && entry->cookie != 0) {
+            cancel_early[i] = 0;
+            entry->cancelled = true;
+            tlog_info("action of " DFID " cancelled before it started, cookie=%#jx",
+                      PFID(&entry->fid), (uintmax_t)entry->cookie);
+        }
+    }
+    struct ct_cancel_entry **head = &cancel_buckets[ct_cancel_bucket(entry->cookie)];
+    entry->next = *head;
+    *head = entry;
+    pthread_mutex_unlock(&cancel_mutex);
+
+    cancel_current = entry;
+}
+
+void ct_cancel_unregister(struct ct_cancel_entry *entry)
+{
+    pthread_mutex_lock(&cancel_mutex);
+    struct ct_cancel_entry **pos = &cancel_buckets[ct_cancel_bucket(entry->cookie)];
+    while (*pos && *pos != entry)
+        pos = &(*pos)->next;
+    if (*pos)
+        *pos = entry->next;
+    pthread_mutex_unlock(&cancel_mutex);
+
+    if (cancel_current == entry)
+        cancel_current = NULL;
+}
+
+bool ct_cancel_request(uint64_t cookie)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&cancel_mutex);
+    for (struct ct_cancel_entry *entry = cancel_buckets[ct_cancel_bucket(cookie)];
+         entry; entry = entry->next) {
+        if (entry->cookie != cookie)
+            continue;
+        __atomic_store_n(&entry->cancelled, true, __ATOMIC_RELAXED);
+        tlog_info("cancel action of " DFID ", cookie=%#jx", PFID(&entry->fid),
+                  (uintmax_t)cookie);
+        found = true;
+    }
+    // may still wait in the worker pool
+    if (!found)
+        cancel_early[cancel_early_next++ % CT_CANCEL_EARLY] = cookie;
+    pthread_mutex_unlock(&cancel_mutex);
+
+    // requests waiting for a retry are failed by the engines
+    if (found)
+        ct_s3_engine_kick();
+
+    return found;
+}
+
+bool ct_cancel_requested(void)
+{
+    return cancel_current && ct_cancel_flag_set(&cancel_current->cancelled);
+}
+
+const bool *ct_cancel_flag(void)
+{
+    return cancel_current ? &cancel_current->cancelled : NULL;
+}
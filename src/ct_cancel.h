@@ -0,0 +1,47 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/lustre/lustre_fid.h>
+#include <lustre/lustreapi.h>
+
+// cancellation of running actions
+// a worker registers the action it runs under its cookie, HSMA_CANCEL of
+// the cookie sets the flag of the action, every S3 request the worker
+// prepares carries the flag, the engine aborts an issued request once it
+// is set (checked by the curl progress callback at least once a second)
+// and the data callbacks stop feeding it, requests not issued yet fail
+// at once, retries and waits for a slot give up
+// the action then ends with -ECANCELED and releases what it holds
+
+struct ct_cancel_entry {
+    uint64_t cookie;
+    struct lu_fid fid;
+    bool cancelled;
+    struct ct_cancel_entry *next;
+};
+
+// the calling thread runs the action of hai until ct_cancel_unregister
+void ct_cancel_register(struct ct_cancel_entry *entry,
+                        const struct hsm_action_item *hai);
+void ct_cancel_unregister(struct ct_cancel_entry *entry);
+
+// cancel the action running under cookie, false when none is, the last
+// cookies not found are remembered and cancel their action once it starts
+bool ct_cancel_request(uint64_t cookie);
+
+// the action of the calling thread was cancelled
+bool ct_cancel_requested(void);
+
+// flag of the action of the calling thread, NULL outside an action
+const bool *ct_cancel_flag(void);
+
+// a flag returned by ct_cancel_flag is set
+static inline bool ct_cancel_flag_set(const bool *flag)
+{
+    return flag && __atomic_load_n(flag, __ATOMIC_RELAXED);
+}
@@ -47,17 +47,21 @@
 
 #include "ct_common.h"
 #include "tlog.h"
+#include "ct_pool.h"
+#include "ct_retry.h"
+#include "ct_fid_cache.h"
+#include "ct_cancel.h"
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <signal.h>
 #include <assert.h>
 #include <sys/xattr.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <linux/lustre/lustre_fid.h>
 #include <lustre/lustreapi.h>
 
@@ -76,11 +80,23 @@ const double SLOW_IO_TIME = 30.0;
 
 // max concurrent requests can handle
 const unsigned int MAX_HSM_REQUESTS = 100;
-sem_t hsm_req_sem;
 int  max_requests;
 
-// terminate flag for copytool main thread
-bool stop_it = false;
+// restore scheduling, see ct_pool.h
+int  restore_reserve = -1;
+int  restore_weight = 0;
+int  queue_depth = 0;
+
+// max concurrent archives of files bigger than MAX_OBJ_SIZE_LEVEL
+int  large_max_requests = 0;
+
+// admission limits of the worker pool, 0 for none
+long long admit_bytes = 0;
+long long admit_memory = 0;
+int  admit_transfers = 0;
+
+// terminate flag for copytool main thread, set from the signal handler
+static volatile sig_atomic_t stop_it = 0;
 
 int err_major;
 
@@ -97,16 +113,6 @@ struct ct_options ct_opt = {
     .o_config = "config.cfg",
 };
 
-int should_retry(int *retry_count) {
-    if ((*retry_count)--) {
-        int time_sleep = rand() % 5000;
-        usleep(time_sleep);
-        return 1;
-    }
-
-    return 0;
-}
-
 double ct_now(void) {
     struct timeval tv;
     gettimeofday(&tv, NULL);
@@ -149,8 +155,39 @@ int ct_path_archive(char *buf, int sz, const lustre_fid *fid) {
                     version);
 }
 
+uint64_t ct_fid_hash(const lustre_fid *fid) {
+    uint64_t h = fid->f_seq * 0x9e3779b97f4a7c15ULL ^
+                 ((uint64_t)fid->f_oid << 32 | fid->f_ver);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
 bool ct_is_retryable(int err) { return err == -ETIMEDOUT; }
 
+int ct_mkdir_p(const char *dir) {
+    char path[PATH_MAX];
+    char *p;
+
+    if (strlen(dir) >= sizeof(path))
+        return -ENAMETOOLONG;
+    strcpy(path, dir);
+
+    for (p = path + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(path, 0700) < 0 && errno != EEXIST)
+            return -errno;
+        *p = '/';
+    }
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+        return -errno;
+
+    return 0;
+}
+
 int ct_action_done(struct hsm_copyaction_private **phcp,
                    const struct hsm_action_item *hai, int hp_flags, int ct_rc) {
     struct hsm_copyaction_private *hcp;
@@ -174,8 +211,8 @@ int ct_action_done(struct hsm_copyaction_private **phcp,
         phcp = &hcp;
     }
 
-    const uint max_retry = 5;
-    int retrys = max_retry;
+    struct ct_retry retry;
+    ct_retry_init(&retry);
 msg_resend:
     rc = llapi_hsm_action_end(phcp, &hai->hai_extent, hp_flags, abs(ct_rc));
     if (rc == -ECANCELED)
@@ -184,12 +221,8 @@ msg_resend:
                  lstr, (uintmax_t)hai->hai_cookie, PFID(&hai->hai_fid));
     else if (rc)
     {
-        if (retrys >= 0)
-        {
-            sleep(rand() % max_retry);
-            retrys--;
+        if (ct_retry_should_errno(&retry, rc))
             goto msg_resend;
-        }
         tlog_error("llapi_hsm_action_end() on '%s' failed  (rc=%d)", lstr, rc);
     }
     else
@@ -198,32 +231,34 @@ msg_resend:
     return rc;
 }
 
+// only runs on the main thread, the others block the signals, the main
+// loop sees the flag once the receive is interrupted
 void handler(int signal) {
-    if (signal == SIGTERM || signal == SIGINT) {
-        tlog_info("get SIGTERM signal, exting...");
-    }
+    stop_it = 1;
+}
 
-    if (!stop_it) {
-        stop_it = true;
-    }
+void ct_signals_block(void) {
+    sigset_t set;
 
-    while (true) {
-        int working_threads = 0;
-        if (sem_getvalue(&hsm_req_sem, &working_threads)) {
-            tlog_error("failed to get semaphore value with error %s", strerror(errno));
-            assert(0);
-        }
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
 
-        // get terminate signal
-        // there still have working threads, must wait
-        if (working_threads < max_requests) {
-            tlog_info("still have %d working threads running, wait ......",
-            max_requests - working_threads);
-            sleep(1);
-            continue;
-        }
-        exit(0);
-    }
+static void ct_signals_unblock(void) {
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+}
+
+// action not started before the stop, the coordinator gives it to another
+// copytool or to this one once restarted
+static int ct_pool_giveback(struct hsm_action_item *hai, long hal_flags) {
+    return ct_action_done(NULL, hai, HP_FLAG_RETRY, -ESHUTDOWN);
 }
 
 int ct_begin_restore(struct hsm_copyaction_private **phcp,
@@ -289,8 +324,9 @@ int ct_process_item(struct hsm_action_item *hai, const long hal_flags) {
     int rc = 0;
     assert(hai);
 
-    // only support archive/restore action in HSM 1.0
-    if ( (hai->hai_action != HSMA_ARCHIVE) && (hai->hai_action != HSMA_RESTORE) )
+    // archive, restore, remove and cancel of them
+    if ( (hai->hai_action != HSMA_ARCHIVE) && (hai->hai_action != HSMA_RESTORE) &&
+         (hai->hai_action != HSMA_REMOVE) && (hai->hai_action != HSMA_CANCEL) )
     {
         tlog_error("unsupport action '%d : %s'", hai->hai_action,
                     hsm_copytool_action2name(hai->hai_action));
@@ -299,28 +335,36 @@ int ct_process_item(struct hsm_action_item *hai, const long hal_flags) {
     }
 
     char file_path[PATH_MAX];
-    if (ct_opt.o_verbose >= LLAPI_MSG_INFO || ct_opt.o_dry_run) {
-        /* Print the original path */
-        char fid[128];
-        long long recno = -1;
-        int linkno = 0;
+    char fid[128];
 
-        sprintf(fid, DFID, PFID(&hai->hai_fid));
+    sprintf(fid, DFID, PFID(&hai->hai_fid));
+    if (ct_opt.o_verbose >= LLAPI_MSG_INFO || ct_opt.o_dry_run) {
         tlog_info("'%s' action %s reclen %d, cookie=%#jx", fid,
                  hsm_copytool_action2name(hai->hai_action), hai->hai_len,
                  (uintmax_t)hai->hai_cookie);
+    }
 
-        // get file posix path from file identifier
-        rc = llapi_fid2path(ct_opt.o_mnt, fid, file_path, sizeof(file_path), &recno, &linkno);
-        if (rc < 0) {
-            // copytool must get object/file name from path
-            // failed to get path means failed to exec HSM command
-            tlog_error("cannot get path of FID %s", fid);
-            goto stop_it;
-        } else {
-            tlog_info("processing file '%s' with fid %s", file_path, fid);
-        }
+    // get file posix path from file identifier
+    if (ct_needs_path(hai)) {
+        rc = ct_fid2path(ct_opt.o_mnt, &hai->hai_fid, file_path, sizeof(file_path));
+    } else {
+        strncpy(file_path, fid, sizeof(file_path));
+        rc = 0;
     }
+    if (rc < 0) {
+        // copytool must get object/file name from path
+        // failed to get path means failed to exec HSM command
+        tlog_error("cannot get path of FID %s", fid);
+        ct_action_done(NULL, hai, 0, rc);
+        goto stop_it;
+    } else {
+        tlog_info("processing file '%s' with fid %s", file_path, fid);
+    }
+
+    // HSMA_CANCEL of the cookie aborts the action
+    struct ct_cancel_entry cancel_entry;
+    if (hai->hai_action != HSMA_CANCEL)
+        ct_cancel_register(&cancel_entry, hai);
 
     switch (hai->hai_action) {
     /* set err_major, minor inside these functions */
@@ -364,102 +408,61 @@ int ct_process_item(struct hsm_action_item *hai, const long hal_flags) {
         ct_action_done(NULL, hai, 0, rc);
     }
 
+    if (hai->hai_action != HSMA_CANCEL)
+        ct_cancel_unregister(&cancel_entry);
+
 stop_it:
     return rc;
 }
 
-void *ct_thread(void *data) {
-    struct ct_th_data *cttd = data;
+static int ct_pool_process(struct hsm_action_item *hai, long hal_flags) {
     int rc;
 
-    rc = ct_process_item(cttd->hai, cttd->hal_flags);
+    rc = ct_process_item(hai, hal_flags);
 
-    free(cttd->hai);
-    free(cttd);
-    sem_post(&hsm_req_sem);
-    pthread_exit((void *)(intptr_t)rc);
+    return rc;
 }
 
-int ct_process_item_async(const struct hsm_action_item *hai, long hal_flags) {
-    pthread_attr_t attr;
-    pthread_t thread;
-    struct ct_th_data *data;
-    int rc;
-    assert(hai);
+// file size of an archive or restore request, picks the lane of an
+// archive in the worker pool and sizes the admission of both
+static size_t ct_action_size(const struct hsm_action_item *hai) {
+    char path[PATH_MAX];
+    struct stat st;
 
-    data = malloc(sizeof(*data));
-    if (data == NULL)
-        return -ENOMEM;
+    if (hai->hai_action != HSMA_ARCHIVE && hai->hai_action != HSMA_RESTORE)
+        return 0;
 
-    data->hai = malloc(hai->hai_len);
-    if (data->hai == NULL) {
-        free(data);
-        return -ENOMEM;
-    }
-
-    memcpy(data->hai, hai, hai->hai_len);
-    data->hal_flags = hal_flags;
+    // a partial restore moves its extent only
+    if (hai->hai_action == HSMA_RESTORE && hai->hai_extent.length != (__u64)-1)
+        return hai->hai_extent.length;
 
-    rc = pthread_attr_init(&attr);
-    if (rc != 0) {
-        tlog_error("pthread_attr_init failed for '%s' service", ct_opt.o_mnt);
-        free(data->hai);
-        free(data);
-        return -rc;
+    ct_path_lustre(path, sizeof(path), ct_opt.o_mnt, &hai->hai_fid);
+    if (stat(path, &st) < 0) {
+        // let the worker report the error, schedule it as a small file
+        tlog_warn("cannot stat '%s' for scheduling: %s", path, strerror(errno));
+        return 0;
     }
 
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-    rc = pthread_create(&thread, &attr, ct_thread, data);
-    if (rc != 0)
-        tlog_error("cannot create thread for '%s' service", ct_opt.o_mnt);
-
-    pthread_attr_destroy(&attr);
-    return rc;
+    return st.st_size;
 }
 
-static void ct_request_ctl()
-{
-    if (stop_it)
-        return;
-
-    // requests concurrency control
-    while (true) {
-        // use sem_timedwait, instead of sem_wait
-        // because we want to check stop_it flag for quit copytool
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 1;
-        errno = 0;
-
-        int rc_sem = sem_timedwait(&hsm_req_sem, &ts);
-        if (!rc_sem && !stop_it) {
-            // not reach max hsm requests limit, can process new request
-            break;
-        }
+int ct_process_item_async(const struct hsm_action_item *hai, long hal_flags) {
+    int rc;
+    assert(hai);
 
-        if (stop_it) {
-            if (!rc_sem) {
-                // adjust semphore before check its value for check working threads
-                sem_post(&hsm_req_sem);
-            }
+    // not behind the actions it cancels
+    if (hai->hai_action == HSMA_CANCEL)
+        return ct_cancel(hai, hal_flags);
 
-            int working_threads = 0;
-            if (sem_getvalue(&hsm_req_sem, &working_threads)) {
-                tlog_error("failed to get semaphore value with error %s", strerror(errno));
-                assert(0);
-            }
+    struct ct_pool_cost cost;
+    size_t size = ct_action_size(hai);
+    ct_action_cost(hai, size, &cost);
 
-            // get terminate signal
-            // there still have working threads, must wait
-            if (working_threads < max_requests) {
-                tlog_info("still have %d working threads running, wait ......", max_requests - working_threads);
-                sleep(1);
-                continue;
-            }
-            break;
-        }
-    }
+    rc = ct_pool_submit(hai, hal_flags, size, &cost);
+    if (rc != 0)
+        tlog_error("cannot queue action for '%s' service", ct_opt.o_mnt);
+
+    return rc;
 }
 
 /* Daemon waits for messages from the kernel; run it in the background. */
@@ -500,17 +503,34 @@ int ct_run(void) {
         goto cleanup;
     }
 
-    memset( &hsm_req_sem, 0, sizeof( sem_t ) );
-    rc = sem_init(&hsm_req_sem, 0, max_requests);
-    if ( rc != 0)
+    struct ct_pool_params pool_params = {
+        .nworkers = max_requests,
+        .depth = queue_depth > 0 ? queue_depth : 4 * max_requests,
+        // keep about a tenth of the workers for restores by default
+        .restore_reserve = restore_reserve >= 0 ? restore_reserve :
+                           (max_requests + 9) / 10,
+        .restore_weight = restore_weight,
+        .large_size = MAX_OBJ_SIZE_LEVEL,
+        .large_max = large_max_requests > 0 ? large_max_requests :
+                     (max_requests + 3) / 4,
+        .buffer_size = CT_BOUNCE_BUFFER_SIZE,
+        .admit_bytes = admit_bytes,
+        .admit_memory = admit_memory,
+        .admit_transfers = admit_transfers,
+    };
+
+    tlog_info("max_requests setting is %d", max_requests);
+
+    rc = ct_pool_init(&pool_params, ct_pool_process);
+    if (rc != 0)
     {
-        tlog_error("cannot call sem_init");
+        tlog_error("cannot start worker pool");
         goto cleanup;
     }
 
-    int sem_init_val = 0;
-    sem_getvalue(&hsm_req_sem, &sem_init_val);
-    tlog_info("max_requests setting is %d", sem_init_val);
+    // every thread is started, the signals interrupt the receive below
+    ct_signals_unblock();
+
     tlog_info("waiting for message from kernel");
 
     while (1) {
@@ -521,9 +541,14 @@ int ct_run(void) {
 
         tlog_info("waiting for message from kernel");
 
+        if (stop_it)
+            break;
+
         rc = llapi_hsm_copytool_recv(ctdata, &hal, &msgsize);
 
-        if (rc == -ESHUTDOWN) {
+        if (stop_it) {
+            break;
+        } else if (rc == -ESHUTDOWN) {
             tlog_info("shutting down");
             break;
         } else if (rc < 0) {
@@ -558,12 +583,12 @@ int ct_run(void) {
                 break;
             }
 
-            ct_request_ctl();
+            if (stop_it)
+                break;
 
             rc = ct_process_item_async(hai, hal->hal_flags);
             if (rc) {
                 tlog_error("'%s' item %d process", ct_opt.o_mnt, i);
-                sem_post(&hsm_req_sem);
             }
 
             if (ct_opt.o_abort_on_error && err_major)
@@ -576,7 +601,15 @@ int ct_run(void) {
         if (ct_opt.o_abort_on_error && err_major)
             break;
     }
-    sem_destroy(&hsm_req_sem);
+
+    if (stop_it) {
+        tlog_info("stop signal received, finish the running actions, "
+                  "give the queued ones back");
+        rc = 0;
+        ct_pool_drop_queued(ct_pool_giveback);
+    }
+    ct_pool_destroy();
+    ct_deferred_flush();
 
     int rc1;
 cleanup:
@@ -596,19 +629,13 @@ int llapi_hsm_action_progress_ex(struct hsm_copyaction_private *hcp,
                                  const struct hsm_extent *he, __u64 total,
                                  int hp_flags)
 {
-    const uint max_retry = 5;
-    int retrys = max_retry;
+    struct ct_retry retry;
     int rc;
-msg_resend:
 
-    rc = llapi_hsm_action_progress(hcp, he, total, hp_flags);
-    if (rc) {
-        if (retrys >= 0) {
-            sleep(rand() % max_retry);
-            retrys--;
-            goto msg_resend;
-        }
-    }
+    ct_retry_init(&retry);
+    do {
+        rc = llapi_hsm_action_progress(hcp, he, total, hp_flags);
+    } while (ct_retry_should_errno(&retry, rc));
 
     return rc;
 }
@@ -619,19 +646,13 @@ int llapi_hsm_action_begin_ex(struct hsm_copyaction_private **phcp,
               int restore_mdt_index, int restore_open_flags,
               bool is_error)
 {
-    const uint max_retry = 5;
-    int retrys = max_retry;
+    struct ct_retry retry;
     int rc;
-msg_resend:
 
-    rc = llapi_hsm_action_begin(phcp, ct, hai, restore_mdt_index, restore_open_flags, is_error);
-    if (rc) {
-        if (retrys >= 0) {
-            sleep(rand() % max_retry);
-            retrys--;
-            goto msg_resend;
-        }
-    }
+    ct_retry_init(&retry);
+    do {
+        rc = llapi_hsm_action_begin(phcp, ct, hai, restore_mdt_index, restore_open_flags, is_error);
+    } while (ct_retry_should_errno(&retry, rc));
 
     return rc;
 }
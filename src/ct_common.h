@@ -47,6 +47,7 @@
 #endif
 
 #include <errno.h>
+#include <stdint.h>
 #include <sys/syscall.h>
 #include <string.h>
 #include <linux/lustre/lustre_fid.h>
@@ -55,6 +56,8 @@
 #define ONE_MB 0x100000
 
 #define MD5_ASCII 32 + 1
+// multipart ETags add -<parts> to the MD5
+#define ETAG_ASCII 72
 
 extern char cmd_name[PATH_MAX];
 extern char fs_name[MAX_OBD_NAME + 1];
@@ -71,6 +74,13 @@ extern const int TIMEOUT_MS;
 extern const double SLOW_IO_TIME;
 extern const unsigned int MAX_HSM_REQUESTS;
 extern int  max_requests;
+extern int  restore_reserve;
+extern int  restore_weight;
+extern int  queue_depth;
+extern int  large_max_requests;
+extern long long admit_bytes;
+extern long long admit_memory;
+extern int  admit_transfers;
 
 /* Progress reporting period */
 #define REPORT_INTERVAL_DEFAULT 30
@@ -89,11 +99,6 @@ struct ct_options {
     int o_mnt_fd;
 };
 
-struct ct_th_data {
-    struct hsm_action_item *hai;
-    long hal_flags;
-};
-
 /*
  * Basic struct to store a file's stripe size and stripe count
  */
@@ -119,7 +124,27 @@ int ct_restore(const struct hsm_action_item *hai, const long hal_flags, char *pa
 int ct_remove(const struct hsm_action_item *hai, const long hal_flags, char *object_name);
 int ct_cancel(const struct hsm_action_item *hai, const long hal_flags);
 
-int should_retry(int *retry_count);
+/*
+ * complete every action the user of libct accepted but did not complete
+ * yet, e.g. archives waiting in an aggregate, called on exit once the
+ * workers are done and before the copytool unregisters, the actions refer
+ * to it
+ */
+void ct_deferred_flush(void);
+
+/*
+ * resources the action will hold while it runs, size is the file size or 0
+ * when unknown, the worker pool admits actions by it
+ */
+struct ct_pool_cost;
+void ct_action_cost(const struct hsm_action_item *hai, size_t size,
+                    struct ct_pool_cost *cost);
+
+/*
+ * whether the action needs the posix path of its file, when it does not the
+ * path argument of the action carries the FID and fid2path is spared
+ */
+bool ct_needs_path(const struct hsm_action_item *hai);
 
 /*
  * Return current time in sec since epoch
@@ -134,8 +159,18 @@ int ct_save_stripe(int src_fd, const char *src, strippingInfo *params);
 
 int ct_path_lustre(char *buf, int sz, const char *mnt, const lustre_fid *fid);
 int ct_path_archive(char *buf, int sz, const lustre_fid *fid);
+/*
+ * stable 64 bit hash of a FID, objects are placed by it so it must never
+ * change
+ */
+uint64_t ct_fid_hash(const lustre_fid *fid);
 bool ct_is_retryable(int err);
 
+/*
+ * mkdir -p of a state directory, mode 0700
+ */
+int ct_mkdir_p(const char *dir);
+
 /*
  * Notify the coordinator that an action was completed
  */
@@ -157,14 +192,19 @@ int ct_begin_restore(struct hsm_copyaction_private **phcp,
  */
 void handler(int signal);
 
+/*
+ * Block SIGINT and SIGTERM in the calling thread, called first thing in
+ * main so every thread created afterwards inherits the mask, ct_run takes
+ * them back on the main thread only
+ */
+void ct_signals_block(void);
+
 int ct_setup(void);
 
 int ct_cleanup(void);
 
 int ct_process_item(struct hsm_action_item *hai, const long hal_flags);
 
-void *ct_thread(void *data);
-
 int ct_process_item_async(const struct hsm_action_item *hai, long hal_flags);
 
 /* Daemon waits for messages from the kernel; run it in the background. */
@@ -0,0 +1,579 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "ct_delete_queue.h"
+#include "ct_common.h"
+#include "ct_s3_engine.h"
+#include "ct_retry.h"
+#include "ct_endpoint.h"
+#include "ct_obj_index.h"
+#include "hsm_s3_utils.h"
+#include "tlog.h"
+
+// deferred deletion module, see ct_delete_queue.h
+//
+// a segment file <seq>.del is a sequence of records, a header followed by
+// the bucket and the key, both NUL terminated, a record cut by a crash is
+// dropped when the segment is read
+
+#define CT_DELETE_REC_MAGIC 0x44454c51
+#define CT_DELETE_SEG_SUFFIX ".del"
+
+struct ct_delete_rec {
+    uint32_t magic;
+    uint16_t bucket_len;
+    uint16_t key_len;
+    struct lu_fid fid;
+    // spool time, seconds since epoch
+    uint64_t queued;
+};
+
+struct ct_delete_seg {
+    char path[PATH_MAX];
+    struct ct_delete_seg *next;
+};
+
+// one key of the batch in progress
+struct ct_delete_entry {
+    struct ct_delete_rec rec;
+    // point into the segment buffer
+    const char *bucket;
+    const char *key;
+    S3Status status;
+    del_object_callback_data data;
+    struct ct_s3_req req;
+    struct ct_retry retry;
+};
+
+static char                  delete_dir[PATH_MAX];
+static int                   delete_batch = CT_DELETE_BATCH_DEFAULT;
+static int                   delete_window = CT_DELETE_WINDOW_DEFAULT;
+static S3BucketContext       delete_bucket;
+static bool                  delete_enabled;
+static bool                  delete_stop;
+static pthread_t             delete_thread;
+static pthread_mutex_t       delete_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t        delete_cond = PTHREAD_COND_INITIALIZER;
+
+// segment taking new records
+static int                   open_fd = -1;
+static char                  open_path[PATH_MAX];
+static int                   open_count;
+static off_t                 open_size;
+static time_t                open_time;
+static uint64_t              segment_seq;
+
+// full segments waiting for the queue thread, oldest first
+static struct ct_delete_seg *sealed_head;
+static struct ct_delete_seg *sealed_tail;
+static long                  delete_pending;
+
+// must hold delete_mutex
+static int ct_delete_seg_open(void)
+{
+    snprintf(open_path, sizeof(open_path), "%s/%016llx" CT_DELETE_SEG_SUFFIX,
+             delete_dir, (unsigned long long)segment_seq++);
+    open_fd = open(open_path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+    if (open_fd < 0) {
+        int rc = -errno;
+        tlog_error("cannot create delete spool segment '%s': %s", open_path,
+                   strerror(errno));
+        return rc;
+    }
+
+    open_count = 0;
+    open_size = 0;
+    open_time = time(NULL);
+    return 0;
+}
+
+// hand the open segment to the queue thread
+// must hold delete_mutex
+static void ct_delete_seg_seal(void)
+{
+    if (open_fd < 0)
+        return;
+
+    close(open_fd);
+    open_fd = -1;
+
+    if (open_count == 0) {
+        unlink(open_path);
+        return;
+    }
+
+    struct ct_delete_seg *seg = calloc(1, sizeof(*seg));
+    if (seg == NULL) {
+        // read again by the next start
+        tlog_error("cannot queue delete spool segment '%s'", open_path);
+        return;
+    }
+    strncpy(seg->path, open_path, sizeof(seg->path) - 1);
+
+    if (sealed_tail)
+        sealed_tail->next = seg;
+    else
+        sealed_head = seg;
+    sealed_tail = seg;
+
+    pthread_cond_broadcast(&delete_cond);
+}
+
+// append one record to the open segment and sync it
+static int ct_delete_append(const struct lu_fid *fid, const char *bucket,
+                            const char *key, uint64_t queued)
+{
+    size_t bucket_len = strlen(bucket) + 1;
+    size_t key_len = strlen(key) + 1;
+    struct ct_delete_rec rec;
+    int rc = 0;
+
+    if (bucket_len > UINT16_MAX || key_len > UINT16_MAX)
+        return -ENAMETOOLONG;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = CT_DELETE_REC_MAGIC;
+    rec.bucket_len = bucket_len;
+    rec.key_len = key_len;
+    rec.fid = *fid;
+    rec.queued = queued;
+
+    size_t size = sizeof(rec) + bucket_len + key_len;
+    char *buf = malloc(size);
+    if (buf == NULL)
+        return -ENOMEM;
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), bucket, bucket_len);
+    memcpy(buf + sizeof(rec) + bucket_len, key, key_len);
+
+    pthread_mutex_lock(&delete_mutex);
+    if (open_fd < 0)
+        rc = ct_delete_seg_open();
+
+    if (rc == 0) {
+        if (write(open_fd, buf, size) != (ssize_t)size || fdatasync(open_fd) < 0) {
+            rc = -errno;
+            tlog_error("cannot append to delete spool segment '%s': %s", open_path,
+                       strerror(errno));
+            // no partial record in the middle of a segment
+            if (ftruncate(open_fd, open_size) < 0)
+                tlog_warn("cannot truncate delete spool segment '%s'", open_path);
+        } else {
+            open_size += size;
+            open_count++;
+            __atomic_add_fetch(&delete_pending, 1, __ATOMIC_SEQ_CST);
+            if (open_count >= delete_batch)
+                ct_delete_seg_seal();
+        }
+    }
+    pthread_mutex_unlock(&delete_mutex);
+
+    free(buf);
+    return rc;
+}
+
+// read the records of a segment, *pbuf holds the strings of the entries
+static int ct_delete_seg_read(const char *path, char **pbuf,
+                              struct ct_delete_entry **pentries, int *pcount)
+{
+    struct stat st;
+    int fd;
+    int rc = 0;
+
+    *pbuf = NULL;
+    *pentries = NULL;
+    *pcount = 0;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        rc = -errno;
+        tlog_error("cannot open delete spool segment '%s': %s", path, strerror(errno));
+        goto out;
+    }
+
+    char *buf = malloc(st.st_size + 1);
+    if (buf == NULL) {
+        rc = -ENOMEM;
+        goto out;
+    }
+    if (read(fd, buf, st.st_size) != st.st_size) {
+        rc = -EIO;
+        tlog_error("cannot read delete spool segment '%s'", path);
+        free(buf);
+        goto out;
+    }
+
+    // a record is at least a header and two empty strings
+    int max = st.st_size / (sizeof(struct ct_delete_rec) + 2) + 1;
+    struct ct_delete_entry *entries = calloc(max, sizeof(*entries));
+    if (entries == NULL) {
+        rc = -ENOMEM;
+        free(buf);
+        goto out;
+    }
+
+    off_t off = 0;
+    int count = 0;
+    while (off + (off_t)sizeof(struct ct_delete_rec) <= st.st_size) {
+        struct ct_delete_entry *entry = &entries[count];
+        memcpy(&entry->rec, buf + off, sizeof(entry->rec));
+        off_t end = off + sizeof(entry->rec) + entry->rec.bucket_len + entry->rec.key_len;
+        if (entry->rec.magic != CT_DELETE_REC_MAGIC || end > st.st_size)
+            break;
+
+        entry->bucket = buf + off + sizeof(entry->rec);
+        entry->key = entry->bucket + entry->rec.bucket_len;
+        if (entry->rec.bucket_len == 0 || entry->rec.key_len == 0 ||
+            entry->bucket[entry->rec.bucket_len - 1] != '\0' ||
+            entry->key[entry->rec.key_len - 1] != '\0')
+            break;
+
+        count++;
+        off = end;
+    }
+
+    if (off != st.st_size)
+        tlog_warn("delete spool segment '%s' ends with %ld bytes of a partial record, "
+                  "ignored", path, (long)(st.st_size - off));
+
+    *pbuf = buf;
+    *pentries = entries;
+    *pcount = count;
+
+out:
+    if (fd >= 0)
+        close(fd);
+    return rc;
+}
+
+// engine completion of a delete, retried on its own
+static bool ct_delete_done(struct ct_s3_req *req)
+{
+    struct ct_delete_entry *entry = req->arg;
+
+    // already gone is as good as deleted
+    if (req->status == S3StatusOK || req->status == S3StatusErrorNoSuchKey) {
+        entry->status = S3StatusOK;
+        return true;
+    }
+
+    int delay_ms = __atomic_load_n(&delete_stop, __ATOMIC_RELAXED) ? -1 :
+                   ct_retry_next(&entry->retry, req->status, req->retry_after_ms);
+    if (delay_ms >= 0) {
+        entry->data.status = S3StatusOK;
+        ct_s3_engine_submit_delayed(req, delay_ms);
+        return false;
+    }
+
+    entry->status = req->status;
+    return true;
+}
+
+// archived again after it was removed
+static bool ct_delete_superseded(const struct ct_delete_entry *entry)
+{
+    struct ct_obj_rec rec;
+
+    if (!ct_obj_index_lookup(&entry->rec.fid, &rec))
+        return false;
+
+    return rec.state == CT_OBJ_LIVE && rec.mtime >= entry->rec.queued &&
+           strcmp(rec.key, entry->key) == 0;
+}
+
+// delete the keys of a segment and unlink it
+static void ct_delete_seg_flush(struct ct_delete_seg *seg)
+{
+    struct ct_delete_entry *entries;
+    char *buf;
+    int count;
+    int deleted = 0, skipped = 0, requeued = 0, dropped = 0;
+    double start = ct_now();
+
+    if (ct_delete_seg_read(seg->path, &buf, &entries, &count) < 0) {
+        // left for the next start
+        free(seg);
+        return;
+    }
+
+    struct ct_s3_group group;
+    ct_s3_group_init(&group);
+
+    for (int i = 0; i < count; i++) {
+        struct ct_delete_entry *entry = &entries[i];
+
+        if (ct_delete_superseded(entry)) {
+            entry->status = S3StatusOK;
+            skipped++;
+            continue;
+        }
+
+        S3BucketContext bucket = delete_bucket;
+        bucket.bucketName = entry->bucket;
+        ct_retry_init(&entry->retry);
+        ct_s3_req_init(&entry->req, CT_S3_DELETE, &bucket, entry->key,
+                       &deleteResponseHandler, &entry->data);
+        entry->data.req = &entry->req;
+        entry->req.done = ct_delete_done;
+        entry->req.arg = entry;
+
+        ct_s3_group_wait(&group, CT_DELETE_INFLIGHT - 1);
+        ct_s3_group_add(&group, &entry->req);
+        ct_s3_engine_submit(&entry->req);
+    }
+
+    ct_s3_group_wait(&group, 0);
+    ct_s3_group_destroy(&group);
+
+    for (int i = 0; i < count; i++) {
+        struct ct_delete_entry *entry = &entries[i];
+
+        if (entry->status == S3StatusOK) {
+            deleted++;
+            continue;
+        }
+
+        // an endpoint down or a retry budget spent, try again later
+        if (entry->status == S3StatusInterrupted ||
+            ct_retry_classify(entry->status) != CT_RETRY_FATAL) {
+            if (ct_delete_append(&entry->rec.fid, entry->bucket, entry->key,
+                                 entry->rec.queued) == 0) {
+                requeued++;
+                continue;
+            }
+        }
+
+        tlog_error("cannot delete '%s' from bucket '%s', S3Error %s, dropped",
+                   entry->key, entry->bucket, S3_get_status_name(entry->status));
+        dropped++;
+    }
+    deleted -= skipped;
+
+    if (unlink(seg->path) < 0)
+        tlog_warn("cannot unlink delete spool segment '%s': %s", seg->path,
+                  strerror(errno));
+    __atomic_sub_fetch(&delete_pending, count, __ATOMIC_SEQ_CST);
+
+    tlog_info("delete batch '%s' of %d keys took %fs: %d deleted, %d archived again, "
+              "%d requeued, %d dropped", seg->path, count, ct_now() - start,
+              deleted, skipped, requeued, dropped);
+
+    free(entries);
+    free(buf);
+    free(seg);
+}
+
+static void *ct_delete_thread_fn(void *data)
+{
+    pthread_mutex_lock(&delete_mutex);
+    while (!delete_stop) {
+        if (open_fd >= 0 && difftime(time(NULL), open_time) >= delete_window)
+            ct_delete_seg_seal();
+
+        // deletes would only be rejected
+        if (sealed_head && !ct_endpoint_rejecting()) {
+            struct ct_delete_seg *seg = sealed_head;
+            sealed_head = seg->next;
+            if (sealed_head == NULL)
+                sealed_tail = NULL;
+            pthread_mutex_unlock(&delete_mutex);
+
+            ct_delete_seg_flush(seg);
+
+            pthread_mutex_lock(&delete_mutex);
+            continue;
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&delete_cond, &delete_mutex, &ts);
+    }
+    pthread_mutex_unlock(&delete_mutex);
+
+    return NULL;
+}
+
+static int ct_delete_seg_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// queue the segments of the spool directory in order
+static int ct_delete_spool_load(void)
+{
+    DIR *dir = opendir(delete_dir);
+    struct dirent *dent;
+    char **names = NULL;
+    int count = 0, size = 0;
+
+    if (dir == NULL) {
+        tlog_error("cannot open delete spool '%s': %s", delete_dir, strerror(errno));
+        return -errno;
+    }
+
+    while ((dent = readdir(dir)) != NULL) {
+        size_t len = strlen(dent->d_name);
+        size_t suffix = strlen(CT_DELETE_SEG_SUFFIX);
+        if (len <= suffix || strcmp(dent->d_name + len - suffix, CT_DELETE_SEG_SUFFIX))
+            continue;
+
+        if (count == size) {
+            size = size ? size * 2 : 64;
+            char **grown = realloc(names, size * sizeof(*names));
+            if (grown == NULL)
+                break;
+            names = grown;
+        }
+        names[count] = strdup(dent->d_name);
+        if (names[count])
+            count++;
+
+        unsigned long long seq = strtoull(dent->d_name, NULL, 16);
+        if (seq >= segment_seq)
+            segment_seq = seq + 1;
+    }
+    closedir(dir);
+
+    qsort(names, count, sizeof(*names), ct_delete_seg_cmp);
+
+    for (int i = 0; i < count; i++) {
+        struct ct_delete_seg *seg = calloc(1, sizeof(*seg));
+        struct ct_delete_entry *entries;
+        char *buf;
+        int nkeys;
+
+        if (seg == NULL)
+            break;
+        snprintf(seg->path, sizeof(seg->path), "%s/%s", delete_dir, names[i]);
+        if (ct_delete_seg_read(seg->path, &buf, &entries, &nkeys) == 0) {
+            delete_pending += nkeys;
+            free(entries);
+            free(buf);
+        }
+
+        if (sealed_tail)
+            sealed_tail->next = seg;
+        else
+            sealed_head = seg;
+        sealed_tail = seg;
+    }
+
+    for (int i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+
+    if (delete_pending)
+        tlog_info("%ld deletes of %d segments left in spool '%s'", delete_pending,
+                  count, delete_dir);
+    return 0;
+}
+
+int ct_delete_queue_init(const char *dir, int batch_size, int window,
+                         const S3BucketContext *bucket)
+{
+    int rc;
+
+    if (dir == NULL || dir[0] == '\0') {
+        tlog_info("delete queue disabled, removes are synchronous");
+        return 0;
+    }
+
+    // without the index a spooled key archived again cannot be told apart
+    // from a removed one, the new object would be deleted
+    if (!ct_obj_index_enabled()) {
+        tlog_error("delete spool '%s' needs the object index", dir);
+        return -EINVAL;
+    }
+
+    if (batch_size <= 0 || batch_size > CT_DELETE_BATCH_MAX || window <= 0) {
+        tlog_error("invalid delete batch size %d or window %d", batch_size, window);
+        return -EINVAL;
+    }
+
+    rc = ct_mkdir_p(dir);
+    if (rc) {
+        tlog_error("cannot create delete spool '%s': %s", dir, strerror(-rc));
+        return rc;
+    }
+
+    strncpy(delete_dir, dir, sizeof(delete_dir) - 1);
+    delete_batch = batch_size;
+    delete_window = window;
+    delete_bucket = *bucket;
+
+    rc = ct_delete_spool_load();
+    if (rc)
+        return rc;
+
+    delete_stop = false;
+    rc = pthread_create(&delete_thread, NULL, ct_delete_thread_fn, NULL);
+    if (rc != 0) {
+        tlog_error("cannot create delete queue thread: %s", strerror(rc));
+        return -rc;
+    }
+
+    delete_enabled = true;
+    tlog_info("deletes spooled in '%s', batches of %d keys, window %ds", delete_dir,
+              delete_batch, delete_window);
+    return 0;
+}
+
+void ct_delete_queue_destroy(void)
+{
+    if (!delete_enabled)
+        return;
+
+    pthread_mutex_lock(&delete_mutex);
+    delete_enabled = false;
+    __atomic_store_n(&delete_stop, true, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&delete_cond);
+    pthread_mutex_unlock(&delete_mutex);
+
+    pthread_join(delete_thread, NULL);
+
+    pthread_mutex_lock(&delete_mutex);
+    ct_delete_seg_seal();
+    while (sealed_head) {
+        struct ct_delete_seg *seg = sealed_head;
+        sealed_head = seg->next;
+        free(seg);
+    }
+    sealed_tail = NULL;
+    pthread_mutex_unlock(&delete_mutex);
+
+    if (delete_pending)
+        tlog_info("%ld deletes left in spool '%s'", delete_pending, delete_dir);
+}
+
+bool ct_delete_queue_enabled(void)
+{
+    return delete_enabled;
+}
+
+int ct_delete_queue_add(const struct lu_fid *fid, const char *bucket,
+                        const char *key)
+{
+    if (!delete_enabled)
+        return -EINVAL;
+
+    return ct_delete_append(fid, bucket, key, time(NULL));
+}
+
+long ct_delete_queue_pending(void)
+{
+    return __atomic_load_n(&delete_pending, __ATOMIC_SEQ_CST);
+}
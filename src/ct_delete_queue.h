@@ -0,0 +1,49 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <linux/lustre/lustre_fid.h>
+#include <lustre/lustreapi.h>
+
+#include "libs3.h"
+
+// deferred deletion of archived objects
+// a remove action only appends (bucket, key) to a spool segment, syncs it
+// and is completed, a queue thread deletes the keys of a segment once it
+// holds batch_size keys or is window seconds old
+// a segment is one batch, its keys are deleted concurrently through the
+// engine and each key is retried on its own, a key failing for good is
+// logged and dropped, a key still failing transiently goes back to the
+// spool, the segment file is unlinked once its batch is settled
+// segments left by a restart are deleted first
+// a key archived again after its remove (LIVE in the object index) is
+// not deleted
+
+#define CT_DELETE_QUEUE_DIR_DEFAULT "/var/lib/estuary/delete"
+#define CT_DELETE_BATCH_DEFAULT 1000
+// DeleteObjects takes at most 1000 keys, kept as the batch bound
+#define CT_DELETE_BATCH_MAX 1000
+#define CT_DELETE_WINDOW_DEFAULT 5
+// deletes of a batch in flight at once
+#define CT_DELETE_INFLIGHT 64
+
+// empty dir disables the queue, removes are then synchronous
+// call after ct_obj_index_init, the queue needs the object index
+int ct_delete_queue_init(const char *dir, int batch_size, int window,
+                         const S3BucketContext *bucket);
+
+// finish the batch in progress and stop, queued keys stay in the spool
+void ct_delete_queue_destroy(void);
+
+bool ct_delete_queue_enabled(void);
+
+// spool the delete of key in bucket, the object of fid is gone for the
+// caller once this returns 0
+int ct_delete_queue_add(const struct lu_fid *fid, const char *bucket,
+                        const char *key);
+
+// keys spooled and not deleted yet
+long ct_delete_queue_pending(void);
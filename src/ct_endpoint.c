@@ -0,0 +1,117 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include "ct_endpoint.h"
+#include "ct_breaker.h"
+#include "tlog.h"
+
+// endpoint selection module, see ct_endpoint.h
+// endpoints are registered at startup before the engine runs, the table is
+// read only afterwards and only the outstanding counters change
+
+struct ct_endpoint {
+    char host[S3_MAX_HOSTNAME_SIZE];
+    int weight;
+    // requests issued and not completed
+    int outstanding;
+};
+
+static struct ct_endpoint endpoints[CT_ENDPOINT_MAX];
+static int                endpoint_count;
+static unsigned int       endpoint_next;
+
+int ct_endpoint_add(const char *host, int weight)
+{
+    if (endpoint_count == CT_ENDPOINT_MAX) {
+        tlog_error("too many S3 endpoints, %d at most", CT_ENDPOINT_MAX);
+        return -EINVAL;
+    }
+
+    if (host == NULL || *host == '\0' || strlen(host) >= S3_MAX_HOSTNAME_SIZE ||
+        weight <= 0) {
+        tlog_error("invalid S3 endpoint '%s' of weight %d", host ? host : "", weight);
+        return -EINVAL;
+    }
+
+    struct ct_endpoint *endpoint = &endpoints[endpoint_count++];
+    strncpy(endpoint->host, host, sizeof(endpoint->host) - 1);
+    endpoint->weight = weight;
+    endpoint->outstanding = 0;
+
+    tlog_info("S3 endpoint '%s' of weight %d", host, weight);
+    return 0;
+}
+
+int ct_endpoint_count(void)
+{
+    return endpoint_count;
+}
+
+const char *ct_endpoint_first(void)
+{
+    return endpoint_count ? endpoints[0].host : NULL;
+}
+
+int ct_endpoint_pick(const char **host)
+{
+    int best = -1;
+    bool best_healthy = false;
+    double best_load = 0;
+
+    if (endpoint_count == 0)
+        return -1;
+
+    // rotate the start, so ties do not always go to the same endpoint
+    unsigned int start = __atomic_fetch_add(&endpoint_next, 1, __ATOMIC_RELAXED);
+
+    for (int n = 0; n < endpoint_count; n++) {
+        int i = (start + n) % endpoint_count;
+        struct ct_endpoint *endpoint = &endpoints[i];
+        bool healthy = !ct_breaker_rejecting(endpoint->host);
+        double load = (__atomic_load_n(&endpoint->outstanding, __ATOMIC_RELAXED) + 1.0) /
+                      endpoint->weight;
+
+        // a healthy endpoint beats any rejecting one, when all reject the
+        // breaker fails the request at once anyway
+        if (best < 0 || (healthy && !best_healthy) ||
+            (healthy == best_healthy && load < best_load)) {
+            best = i;
+            best_healthy = healthy;
+            best_load = load;
+        }
+    }
+
+    __atomic_add_fetch(&endpoints[best].outstanding, 1, __ATOMIC_RELAXED);
+    *host = endpoints[best].host;
+    return best;
+}
+
+void ct_endpoint_done(int idx)
+{
+    if (idx >= 0 && idx < endpoint_count)
+        __atomic_sub_fetch(&endpoints[idx].outstanding, 1, __ATOMIC_RELAXED);
+}
+
+bool ct_endpoint_rejecting(void)
+{
+    for (int i = 0; i < endpoint_count; i++) {
+        if (!ct_breaker_rejecting(endpoints[i].host))
+            return false;
+    }
+
+    return endpoint_count > 0;
+}
+
+bool ct_endpoint_degraded(void)
+{
+    for (int i = 0; i < endpoint_count; i++) {
+        if (!ct_breaker_closed(endpoints[i].host))
+            return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+
+#include "libs3.h"
+
+// S3 endpoints, several gateways serving the same buckets
+// every request picks its endpoint when the engine issues it, so the parts
+// of an upload and the ranges of a restore spread over the gateways, and a
+// retry may land on another one
+// the endpoint with the fewest outstanding requests relative to its weight
+// is picked among the ones whose circuit breaker accepts requests, ties go
+// round robin
+// with no endpoint registered requests keep the host they were built with
+
+// endpoints at most, as many as circuit breakers
+#define CT_ENDPOINT_MAX 32
+
+// register an endpoint, weight is its share of requests relative to others
+int ct_endpoint_add(const char *host, int weight);
+
+int ct_endpoint_count(void);
+
+// host of the first endpoint, NULL when none
+const char *ct_endpoint_first(void);
+
+// endpoint for a request about to be issued, its index is returned and
+// *host points at its name, -1 when no endpoint is registered
+int ct_endpoint_pick(const char **host);
+
+// the request issued on endpoint idx completed
+void ct_endpoint_done(int idx);
+
+// true when every endpoint currently rejects requests
+bool ct_endpoint_rejecting(void);
+
+// true when the breaker of any endpoint is open or half open
+bool ct_endpoint_degraded(void);
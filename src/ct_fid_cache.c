@@ -0,0 +1,295 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "ct_fid_cache.h"
+#include "ct_common.h"
+#include "tlog.h"
+
+// FID to path cache module, see ct_fid_cache.h
+
+#define CT_FID_CACHE_SHARDS 64
+// hash chains per shard
+#define CT_FID_CACHE_BUCKETS 1024
+
+struct ct_fid_entry {
+    struct lu_fid fid;
+    // NULL for a negative entry, then rc is the error to return
+    char *path;
+    int rc;
+    double expires;
+    // hash chain
+    struct ct_fid_entry *next;
+    // LRU list, most recently used at the head
+    struct ct_fid_entry *lru_prev;
+    struct ct_fid_entry *lru_next;
+};
+
+struct ct_fid_shard {
+    pthread_mutex_t mutex;
+    struct ct_fid_entry *buckets[CT_FID_CACHE_BUCKETS];
+    struct ct_fid_entry *lru_head;
+    struct ct_fid_entry *lru_tail;
+    size_t count;
+    // statistics
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stale;
+};
+
+static struct ct_fid_shard *fid_shards;
+static size_t               fid_shard_size;
+static double               fid_ttl = CT_FID_CACHE_TTL_DEFAULT;
+static double               fid_negative_ttl = CT_FID_CACHE_NEGATIVE_TTL_DEFAULT;
+
+int ct_fid_cache_init(size_t size, int ttl, int negative_ttl)
+{
+    if (size == 0) {
+        tlog_info("FID to path cache disabled");
+        return 0;
+    }
+
+    fid_shards = calloc(CT_FID_CACHE_SHARDS, sizeof(*fid_shards));
+    if (fid_shards == NULL)
+        return -ENOMEM;
+
+    for (int i = 0; i < CT_FID_CACHE_SHARDS; i++)
+        pthread_mutex_init(&fid_shards[i].mutex, NULL);
+
+    fid_shard_size = (size + CT_FID_CACHE_SHARDS - 1) / CT_FID_CACHE_SHARDS;
+    fid_ttl = ttl;
+    fid_negative_ttl = negative_ttl;
+
+    tlog_info("FID to path cache of %zu entries, ttl %d s, negative ttl %d s",
+              fid_shard_size * CT_FID_CACHE_SHARDS, ttl, negative_ttl);
+    return 0;
+}
+
+void ct_fid_cache_destroy(void)
+{
+    uint64_t hits = 0, misses = 0, stale = 0;
+
+    if (fid_shards == NULL)
+        return;
+
+    for (int i = 0; i < CT_FID_CACHE_SHARDS; i++) {
+        struct ct_fid_shard *shard = &fid_shards[i];
+        struct ct_fid_entry *entry = shard->lru_head;
+        while (entry) {
+            struct ct_fid_entry *next = entry->lru_next;
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        hits += shard->hits;
+        misses += shard->misses;
+        stale += shard->stale;
+        pthread_mutex_destroy(&shard->mutex);
+    }
+
+    tlog_info("FID to path cache: %lu hits, %lu misses, %lu stale", hits, misses,
+              stale);
+
+    free(fid_shards);
+    fid_shards = NULL;
+}
+
+static bool ct_fid_equal(const struct lu_fid *a, const struct lu_fid *b)
+{
+    return a->f_seq == b->f_seq && a->f_oid == b->f_oid && a->f_ver == b->f_ver;
+}
+
+static struct ct_fid_shard *ct_fid_shard(uint64_t hash)
+{
+    return &fid_shards[hash % CT_FID_CACHE_SHARDS];
+}
+
+// must hold the shard mutex
+static struct ct_fid_entry **ct_fid_find(struct ct_fid_shard *shard, uint64_t hash,
+                                         const struct lu_fid *fid)
+{
+    struct ct_fid_entry **pos = &shard->buckets[(hash / CT_FID_CACHE_SHARDS) %
+                                                CT_FID_CACHE_BUCKETS];
+
+    while (*pos && !ct_fid_equal(&(*pos)->fid, fid))
+        pos = &(*pos)->next;
+    return pos;
+}
+
+// must hold the shard mutex
+static void ct_fid_lru_unlink(struct ct_fid_shard *shard, struct ct_fid_entry *entry)
+{
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        shard->lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        shard->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+// must hold the shard mutex
+static void ct_fid_lru_push(struct ct_fid_shard *shard, struct ct_fid_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head)
+        shard->lru_head->lru_prev = entry;
+    shard->lru_head = entry;
+    if (shard->lru_tail == NULL)
+        shard->lru_tail = entry;
+}
+
+// must hold the shard mutex
+static void ct_fid_remove(struct ct_fid_shard *shard, uint64_t hash,
+                          struct ct_fid_entry *entry)
+{
+    struct ct_fid_entry **pos = ct_fid_find(shard, hash, &entry->fid);
+
+    *pos = entry->next;
+    ct_fid_lru_unlink(shard, entry);
+    shard->count--;
+    free(entry->path);
+    free(entry);
+}
+
+static void ct_fid_insert(const struct lu_fid *fid, const char *path, int rc)
+{
+    uint64_t hash = ct_fid_hash(fid);
+    struct ct_fid_shard *shard = ct_fid_shard(hash);
+    struct ct_fid_entry *entry = calloc(1, sizeof(*entry));
+
+    if (entry == NULL)
+        return;
+
+    entry->fid = *fid;
+    entry->rc = rc;
+    entry->expires = ct_now() + (path ? fid_ttl : fid_negative_ttl);
+    if (path) {
+        entry->path = strdup(path);
+        if (entry->path == NULL) {
+            free(entry);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    struct ct_fid_entry **pos = ct_fid_find(shard, hash, fid);
+    if (*pos)
+        ct_fid_remove(shard, hash, *pos);
+
+    while (shard->count >= fid_shard_size && shard->lru_tail) {
+        struct ct_fid_entry *victim = shard->lru_tail;
+        ct_fid_remove(shard, ct_fid_hash(&victim->fid), victim);
+    }
+
+    pos = ct_fid_find(shard, hash, fid);
+    *pos = entry;
+    ct_fid_lru_push(shard, entry);
+    shard->count++;
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void ct_fid_cache_invalidate(const struct lu_fid *fid)
+{
+    if (fid_shards == NULL)
+        return;
+
+    uint64_t hash = ct_fid_hash(fid);
+    struct ct_fid_shard *shard = ct_fid_shard(hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    struct ct_fid_entry **pos = ct_fid_find(shard, hash, fid);
+    if (*pos)
+        ct_fid_remove(shard, hash, *pos);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+// cached path of fid into path, 1 on a hit, 0 on a miss, or the cached
+// negative error
+static int ct_fid_lookup(const struct lu_fid *fid, char *path, size_t size)
+{
+    uint64_t hash = ct_fid_hash(fid);
+    struct ct_fid_shard *shard = ct_fid_shard(hash);
+    int rc = 0;
+
+    pthread_mutex_lock(&shard->mutex);
+    struct ct_fid_entry *entry = *ct_fid_find(shard, hash, fid);
+    if (entry && entry->expires < ct_now()) {
+        ct_fid_remove(shard, hash, entry);
+        entry = NULL;
+    }
+
+    if (entry == NULL) {
+        shard->misses++;
+    } else if (entry->path == NULL) {
+        shard->hits++;
+        rc = entry->rc;
+    } else if (strlen(entry->path) < size) {
+        shard->hits++;
+        strcpy(path, entry->path);
+        ct_fid_lru_unlink(shard, entry);
+        ct_fid_lru_push(shard, entry);
+        rc = 1;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    return rc;
+}
+
+// a cached path still names fid
+static bool ct_fid_valid(const char *mnt, const struct lu_fid *fid, const char *path)
+{
+    char full_path[PATH_MAX];
+    struct lu_fid got;
+
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", mnt, path) >= sizeof(full_path))
+        return false;
+
+    return llapi_path2fid(full_path, &got) == 0 && ct_fid_equal(&got, fid);
+}
+
+int ct_fid2path(const char *mnt, const struct lu_fid *fid, char *path, size_t size)
+{
+    char strfid[FID_NOBRACE_LEN + 1];
+    long long recno = -1;
+    int linkno = 0;
+    int rc;
+
+    if (fid_shards) {
+        rc = ct_fid_lookup(fid, path, size);
+        if (rc < 0)
+            return rc;
+        if (rc == 1) {
+            if (ct_fid_valid(mnt, fid, path))
+                return 0;
+            // renamed or unlinked since it was cached
+            tlog_debug("cached path '%s' of "DFID" is stale", path, PFID(fid));
+            __atomic_add_fetch(&ct_fid_shard(ct_fid_hash(fid))->stale, 1,
+                               __ATOMIC_RELAXED);
+            ct_fid_cache_invalidate(fid);
+        }
+    }
+
+    snprintf(strfid, sizeof(strfid), DFID_NOBRACE, PFID(fid));
+    rc = llapi_fid2path(mnt, strfid, path, size, &recno, &linkno);
+
+    if (fid_shards) {
+        if (rc == 0)
+            ct_fid_insert(fid, path, 0);
+        else if (rc == -ENOENT)
+            ct_fid_insert(fid, NULL, rc);
+    }
+
+    return rc;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+#include <linux/lustre/lustre_fid.h>
+#include <lustre/lustreapi.h>
+
+// FID to path cache
+// llapi_fid2path is a synchronous MDS round trip, the cache keeps its
+// results in shards of LRU lists, each under its own lock
+// - a cached path is checked on use with llapi_path2fid, a path walk served
+//   by the client's dentry cache in the common case, so a renamed or
+//   unlinked file is resolved again instead of returning a stale path
+// - FIDs that do not resolve (ENOENT) are cached as negative entries for a
+//   short time
+// - entries expire after a TTL whatever the check says, and the number of
+//   entries is bounded
+
+#define CT_FID_CACHE_SIZE_DEFAULT 65536
+#define CT_FID_CACHE_TTL_DEFAULT 300
+#define CT_FID_CACHE_NEGATIVE_TTL_DEFAULT 10
+
+// size 0 disables the cache, ttls in seconds
+int ct_fid_cache_init(size_t size, int ttl, int negative_ttl);
+void ct_fid_cache_destroy(void);
+
+// path of fid relative to the mount point mnt, like llapi_fid2path
+int ct_fid2path(const char *mnt, const struct lu_fid *fid, char *path, size_t size);
+
+// forget fid, its path is known to have changed
+void ct_fid_cache_invalidate(const struct lu_fid *fid);
@@ -0,0 +1,119 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ct_hedge.h"
+#include "tlog.h"
+
+// hedged GET module, see ct_hedge.h
+
+// the percentile is computed again after this many new samples
+#define CT_HEDGE_REFRESH 32
+
+static int             hedge_percentile = CT_HEDGE_PERCENTILE_DEFAULT;
+static double          hedge_earn = CT_HEDGE_BUDGET_PERCENT_DEFAULT / 100.0;
+static double          hedge_tokens = CT_HEDGE_BURST;
+
+// ring of the latest latency samples
+static double          hedge_samples[CT_HEDGE_SAMPLES];
+static int             hedge_nsamples;
+static int             hedge_next;
+static int             hedge_fresh;
+// current percentile, 0 until enough samples
+static double          hedge_threshold;
+
+static pthread_mutex_t hedge_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int ct_hedge_setup(int percentile, int budget_percent)
+{
+    if (percentile < 0 || percentile >= 100 || budget_percent <= 0 ||
+        budget_percent > 100) {
+        tlog_error("invalid hedge percentile %d or budget %d%%", percentile,
+                   budget_percent);
+        return -EINVAL;
+    }
+
+    hedge_percentile = percentile;
+    hedge_earn = budget_percent / 100.0;
+
+    if (percentile)
+        tlog_info("hedge range GETs slower than p%d, budget %d%% of GETs",
+                  percentile, budget_percent);
+    return 0;
+}
+
+bool ct_hedge_enabled(void)
+{
+    return hedge_percentile > 0;
+}
+
+static int ct_hedge_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// must hold hedge_mutex
+static void ct_hedge_refresh(void)
+{
+    double sorted[CT_HEDGE_SAMPLES];
+
+    memcpy(sorted, hedge_samples, hedge_nsamples * sizeof(double));
+    qsort(sorted, hedge_nsamples, sizeof(double), ct_hedge_cmp);
+    hedge_threshold = sorted[(hedge_nsamples - 1) * hedge_percentile / 100];
+    hedge_fresh = 0;
+
+    tlog_debug("hedge threshold p%d of %d samples is %fs", hedge_percentile,
+               hedge_nsamples, hedge_threshold);
+}
+
+int ct_hedge_delay_ms(void)
+{
+    int delay_ms = -1;
+
+    if (!ct_hedge_enabled())
+        return -1;
+
+    pthread_mutex_lock(&hedge_mutex);
+    if (hedge_threshold > 0 && hedge_tokens >= 1) {
+        hedge_tokens -= 1;
+        delay_ms = hedge_threshold * 1000 + 1;
+    }
+    pthread_mutex_unlock(&hedge_mutex);
+
+    return delay_ms;
+}
+
+void ct_hedge_refund(void)
+{
+    pthread_mutex_lock(&hedge_mutex);
+    if (hedge_tokens + 1 <= CT_HEDGE_BURST)
+        hedge_tokens += 1;
+    pthread_mutex_unlock(&hedge_mutex);
+}
+
+void ct_hedge_observe(double latency)
+{
+    if (!ct_hedge_enabled())
+        return;
+
+    pthread_mutex_lock(&hedge_mutex);
+    hedge_samples[hedge_next] = latency;
+    hedge_next = (hedge_next + 1) % CT_HEDGE_SAMPLES;
+    if (hedge_nsamples < CT_HEDGE_SAMPLES)
+        hedge_nsamples++;
+
+    if (hedge_nsamples >= CT_HEDGE_MIN_SAMPLES &&
+        (hedge_threshold == 0 || ++hedge_fresh >= CT_HEDGE_REFRESH))
+        ct_hedge_refresh();
+
+    hedge_tokens += hedge_earn;
+    if (hedge_tokens > CT_HEDGE_BURST)
+        hedge_tokens = CT_HEDGE_BURST;
+    pthread_mutex_unlock(&hedge_mutex);
+}
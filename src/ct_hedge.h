@@ -0,0 +1,39 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+
+// hedged range GETs of a parallel restore
+// the latency of successful range GETs is sampled, and a range still
+// running past the chosen percentile of that latency gets a duplicate
+// request on another engine context (another connection), whichever
+// completes first wins and the other one is cancelled
+// hedges are paid from a token bucket earning budget_percent of a token per
+// range GET, so they add at most that share of extra requests
+
+// off by default
+#define CT_HEDGE_PERCENTILE_DEFAULT 0
+#define CT_HEDGE_BUDGET_PERCENT_DEFAULT 5
+// latency samples kept, and needed before the first hedge
+#define CT_HEDGE_SAMPLES 256
+#define CT_HEDGE_MIN_SAMPLES 20
+// hedges that may fire back to back
+#define CT_HEDGE_BURST 10
+
+// percentile 0 disables hedging
+int ct_hedge_setup(int percentile, int budget_percent);
+
+bool ct_hedge_enabled(void);
+
+// delay in ms after which a range GET issued now should be hedged, takes a
+// token from the budget, -1 when it should not be hedged
+int ct_hedge_delay_ms(void);
+
+// give back the token of a hedge cancelled before it was sent
+void ct_hedge_refund(void);
+
+// account a successful range GET of a full chunk and its latency
+void ct_hedge_observe(double latency);
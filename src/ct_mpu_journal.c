@@ -0,0 +1,283 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "ct_mpu_journal.h"
+#include "ct_common.h"
+#include "tlog.h"
+
+// journal file layout, see ct_mpu_journal.h
+// struct ct_mpu_header, then any number of struct ct_mpu_part_rec
+
+#define CT_MPU_JOURNAL_MAGIC 0x4d50554a
+#define CT_MPU_PART_MAGIC 0x50415254
+
+struct ct_mpu_part_rec {
+    uint32_t magic;
+    uint32_t seq;
+    char etag[CT_MPU_ETAG_MAX];
+};
+
+static char journal_dir[PATH_MAX];
+
+int ct_mpu_journal_init(const char *dir)
+{
+    int rc;
+
+    if (dir == NULL || dir[0] == '\0') {
+        tlog_info("multipart upload journal disabled");
+        return 0;
+    }
+
+    rc = ct_mkdir_p(dir);
+    if (rc) {
+        tlog_error("cannot create multipart upload journal directory '%s': %s",
+                   dir, strerror(-rc));
+        return rc;
+    }
+
+    strncpy(journal_dir, dir, sizeof(journal_dir) - 1);
+    tlog_info("multipart upload journal in '%s'", journal_dir);
+    return 0;
+}
+
+bool ct_mpu_journal_enabled(void)
+{
+    return journal_dir[0] != '\0';
+}
+
+static int ct_mpu_write(struct ct_mpu_journal *journal, const void *buf, size_t size)
+{
+    if (write(journal->fd, buf, size) != (ssize_t)size) {
+        tlog_error("cannot write multipart upload journal '%s': %s",
+                   journal->path, strerror(errno));
+        return -EIO;
+    }
+
+    if (fdatasync(journal->fd) < 0) {
+        tlog_error("cannot sync multipart upload journal '%s': %s",
+                   journal->path, strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
+// load the parts of a matching journal, returns the number of parts found
+static int ct_mpu_journal_load(struct ct_mpu_journal *journal,
+                               const struct ct_mpu_header *hdr, char **etags)
+{
+    struct ct_mpu_part_rec rec;
+    int count = 0;
+
+    while (read(journal->fd, &rec, sizeof(rec)) == sizeof(rec)) {
+        if (rec.magic != CT_MPU_PART_MAGIC || rec.seq == 0 ||
+            rec.seq > hdr->parts_total) {
+            tlog_warn("bad record in multipart upload journal '%s', ignored",
+                      journal->path);
+            break;
+        }
+        rec.etag[CT_MPU_ETAG_MAX - 1] = '\0';
+        if (etags[rec.seq - 1] == NULL)
+            count++;
+        free(etags[rec.seq - 1]);
+        etags[rec.seq - 1] = strdup(rec.etag);
+    }
+
+    return count;
+}
+
+int ct_mpu_journal_open(struct ct_mpu_journal *journal, const struct lu_fid *fid,
+                        const struct ct_mpu_header *hdr, char **upload_id,
+                        char **etags)
+{
+    struct ct_mpu_header old;
+    int rc;
+
+    journal->fd = -1;
+    pthread_mutex_init(&journal->mutex, NULL);
+
+    rc = snprintf(journal->path, sizeof(journal->path), "%s/"DFID_NOBRACE".mpu",
+                  journal_dir, PFID(fid));
+    if (rc >= sizeof(journal->path))
+        return -ENAMETOOLONG;
+
+    journal->fd = open(journal->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (journal->fd < 0) {
+        rc = -errno;
+        tlog_error("cannot open multipart upload journal '%s': %s",
+                   journal->path, strerror(errno));
+        return rc;
+    }
+
+    if (read(journal->fd, &old, sizeof(old)) == sizeof(old) &&
+        old.magic == CT_MPU_JOURNAL_MAGIC &&
+        old.data_version == hdr->data_version &&
+        old.size == hdr->size &&
+        old.chunk_size == hdr->chunk_size &&
+        old.parts_total == hdr->parts_total &&
+        strncmp(old.object_name, hdr->object_name, sizeof(old.object_name)) == 0) {
+        old.upload_id[CT_MPU_UPLOAD_ID_MAX - 1] = '\0';
+        *upload_id = strdup(old.upload_id);
+        if (*upload_id == NULL)
+            return -ENOMEM;
+
+        int parts = ct_mpu_journal_load(journal, hdr, etags);
+        tlog_info("resume multipart upload %s of '%s', %d of %u parts done",
+                  *upload_id, hdr->object_name, parts, hdr->parts_total);
+        return 1;
+    }
+
+    // nothing, a torn header, or an upload of another file version
+    if (lseek(journal->fd, 0, SEEK_END) > 0)
+        tlog_info("discard multipart upload journal '%s' of another version",
+                  journal->path);
+    if (ftruncate(journal->fd, 0) < 0) {
+        rc = -errno;
+        tlog_error("cannot truncate multipart upload journal '%s': %s",
+                   journal->path, strerror(errno));
+        return rc;
+    }
+
+    return 0;
+}
+
+int ct_mpu_journal_begin(struct ct_mpu_journal *journal,
+                         const struct ct_mpu_header *hdr)
+{
+    struct ct_mpu_header rec = *hdr;
+
+    rec.magic = CT_MPU_JOURNAL_MAGIC;
+
+    pthread_mutex_lock(&journal->mutex);
+    int rc = ct_mpu_write(journal, &rec, sizeof(rec));
+    pthread_mutex_unlock(&journal->mutex);
+
+    return rc;
+}
+
+int ct_mpu_journal_part(struct ct_mpu_journal *journal, int seq, const char *etag)
+{
+    struct ct_mpu_part_rec rec;
+
+    if (strlen(etag) >= sizeof(rec.etag)) {
+        tlog_warn("etag of part %d too long for journal '%s'", seq, journal->path);
+        return -ENAMETOOLONG;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = CT_MPU_PART_MAGIC;
+    rec.seq = seq;
+    strcpy(rec.etag, etag);
+
+    pthread_mutex_lock(&journal->mutex);
+    int rc = ct_mpu_write(journal, &rec, sizeof(rec));
+    pthread_mutex_unlock(&journal->mutex);
+
+    return rc;
+}
+
+static int ct_mpu_id_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int ct_mpu_journal_live(int max_age, char ***upload_ids)
+{
+    char **ids = NULL;
+    int count = 0, size = 0;
+    struct dirent *dent;
+    time_t now = time(NULL);
+
+    *upload_ids = NULL;
+    if (!ct_mpu_journal_enabled())
+        return 0;
+
+    DIR *dir = opendir(journal_dir);
+    if (dir == NULL) {
+        tlog_error("cannot open multipart upload journal directory '%s': %s",
+                   journal_dir, strerror(errno));
+        return -errno;
+    }
+
+    while ((dent = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        struct ct_mpu_header hdr;
+        struct stat st;
+
+        size_t len = strlen(dent->d_name);
+        if (len <= 4 || strcmp(dent->d_name + len - 4, ".mpu") != 0)
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", journal_dir, dent->d_name) >=
+            (int)sizeof(path))
+            continue;
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        bool ok = fstat(fd, &st) == 0 &&
+                  read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+                  hdr.magic == CT_MPU_JOURNAL_MAGIC;
+        close(fd);
+
+        if (ok && difftime(now, st.st_mtime) > max_age) {
+            tlog_info("multipart upload journal '%s' untouched for %.0f s, expired",
+                      path, difftime(now, st.st_mtime));
+            unlink(path);
+            continue;
+        }
+        if (!ok)
+            continue;
+
+        if (count == size) {
+            size = size ? size * 2 : 64;
+            char **grown = realloc(ids, size * sizeof(*ids));
+            if (grown == NULL) {
+                ct_mpu_journal_live_free(ids, count);
+                closedir(dir);
+                return -ENOMEM;
+            }
+            ids = grown;
+        }
+        hdr.upload_id[CT_MPU_UPLOAD_ID_MAX - 1] = '\0';
+        ids[count] = strdup(hdr.upload_id);
+        if (ids[count])
+            count++;
+    }
+    closedir(dir);
+
+    if (count)
+        qsort(ids, count, sizeof(*ids), ct_mpu_id_cmp);
+    *upload_ids = ids;
+    return count;
+}
+
+void ct_mpu_journal_live_free(char **upload_ids, int count)
+{
+    for (int i = 0; i < count; i++)
+        free(upload_ids[i]);
+    free(upload_ids);
+}
+
+void ct_mpu_journal_close(struct ct_mpu_journal *journal, bool discard)
+{
+    if (journal->fd >= 0) {
+        close(journal->fd);
+        journal->fd = -1;
+        if (discard && unlink(journal->path) < 0 && errno != ENOENT)
+            tlog_warn("cannot remove multipart upload journal '%s': %s",
+                      journal->path, strerror(errno));
+    }
+
+    pthread_mutex_destroy(&journal->mutex);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <linux/lustre/lustre_fid.h>
+#include <lustre/lustreapi.h>
+
+// journal of multipart uploads in progress
+// every multipart upload has a journal file <FID>.mpu in the journal
+// directory, made of a header written once the upload is initiated and one
+// record per finished part, each record is synced before the part counts
+// as done, so after a crash or restart an archive of the same FID and data
+// version continues with the first missing part of the same upload
+
+#define CT_MPU_JOURNAL_DIR_DEFAULT "/var/lib/estuary/mpu"
+
+#define CT_MPU_UPLOAD_ID_MAX 512
+#define CT_MPU_ETAG_MAX 128
+
+// what must not change for an upload to be resumed
+struct ct_mpu_header {
+    uint32_t magic;
+    uint32_t parts_total;
+    uint64_t data_version;
+    uint64_t size;
+    uint64_t chunk_size;
+    char upload_id[CT_MPU_UPLOAD_ID_MAX];
+    char object_name[PATH_MAX];
+};
+
+struct ct_mpu_journal {
+    int fd;
+    char path[PATH_MAX];
+    // parts finish on engine threads concurrently
+    pthread_mutex_t mutex;
+};
+
+// create the journal directory, NULL or empty dir disables the journal
+int ct_mpu_journal_init(const char *dir);
+
+bool ct_mpu_journal_enabled(void);
+
+// open the journal of fid
+// when it holds an upload matching hdr (every field but upload_id), the
+// upload id is returned in *upload_id and the etags of its finished parts
+// in etags[seq - 1], both malloc'ed, and 1 is returned
+// a journal of another upload is discarded and 0 is returned
+int ct_mpu_journal_open(struct ct_mpu_journal *journal, const struct lu_fid *fid,
+                        const struct ct_mpu_header *hdr, char **upload_id,
+                        char **etags);
+
+// record a newly initiated upload, hdr->upload_id must be set
+int ct_mpu_journal_begin(struct ct_mpu_journal *journal,
+                         const struct ct_mpu_header *hdr);
+
+// record a finished part, may be called from any thread
+int ct_mpu_journal_part(struct ct_mpu_journal *journal, int seq, const char *etag);
+
+// close the journal, discard removes it (upload committed or unusable)
+void ct_mpu_journal_close(struct ct_mpu_journal *journal, bool discard);
+
+// upload ids of the journals written to in the last max_age seconds,
+// sorted, in *upload_ids, returns their number or a negative errno
+// older journals are removed, their upload is not resumed any more
+int ct_mpu_journal_live(int max_age, char ***upload_ids);
+
+void ct_mpu_journal_live_free(char **upload_ids, int count);
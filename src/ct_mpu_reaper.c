@@ -0,0 +1,326 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ct_mpu_reaper.h"
+#include "ct_mpu_journal.h"
+#include "ct_endpoint.h"
+#include "ct_s3_engine.h"
+#include "hsm_s3_utils.h"
+#include "tlog.h"
+
+// multipart upload reaper, see ct_mpu_reaper.h
+
+struct ct_reap_upload {
+    char *key;
+    char *upload_id;
+};
+
+// one list page
+struct ct_reap_page {
+    S3Status status;
+    time_t cutoff;
+    char **live;
+    int live_count;
+    struct ct_reap_upload *uploads;
+    int count;
+    int size;
+    int truncated;
+    char next_key[S3_MAX_KEY_SIZE];
+    char next_upload_id[CT_MPU_UPLOAD_ID_MAX];
+    struct ct_s3_req *req;
+};
+
+static int                   reap_age;
+static int                   reap_interval = CT_MPU_REAP_INTERVAL_DEFAULT;
+static int                   reap_rate = CT_MPU_REAP_RATE_DEFAULT;
+static S3BucketContext       reap_bucket;
+static char                **reap_buckets;
+static int                   reap_nbuckets;
+static bool                  reap_running;
+static bool                  reap_stop;
+static pthread_t             reap_thread;
+static pthread_mutex_t       reap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t        reap_cond = PTHREAD_COND_INITIALIZER;
+
+bool ct_mpu_abort(const S3BucketContext *bucket, const char *key,
+                  const char *upload_id)
+{
+    del_object_callback_data data;
+    struct ct_s3_req req;
+
+    memset(&data, 0, sizeof(data));
+    ct_s3_req_init(&req, CT_S3_MPU_ABORT, bucket, key, &abortMultipartHandler,
+                   &data);
+    req.upload_id = upload_id;
+    // the cleanup of a cancelled action goes on
+    req.abort = NULL;
+    data.req = &req;
+    ct_s3_engine_run(&req);
+
+    S3Status status = data.status;
+    if (status == S3StatusOK || status == S3StatusErrorNoSuchUpload) {
+        tlog_info("aborted multipart upload %s of '%s'", upload_id, key);
+        return true;
+    }
+
+    tlog_warn("cannot abort multipart upload %s of '%s': %s", upload_id, key,
+              S3_get_status_name(status));
+    return false;
+}
+
+static int ct_reap_id_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static S3Status ct_reap_list_callback(int is_truncated, const char *next_key,
+                                      const char *next_upload_id, int uploads_count,
+                                      const S3ListMultipartUpload *uploads,
+                                      int common_prefixes_count,
+                                      const char **common_prefixes, void *data)
+{
+    struct ct_reap_page *page = data;
+
+    page->truncated = is_truncated;
+    snprintf(page->next_key, sizeof(page->next_key), "%s", next_key ? next_key : "");
+    snprintf(page->next_upload_id, sizeof(page->next_upload_id), "%s",
+             next_upload_id ? next_upload_id : "");
+
+    for (int i = 0; i < uploads_count; i++) {
+        const S3ListMultipartUpload *up = &uploads[i];
+
+        if (up->key == NULL || up->uploadId == NULL || up->initiated > page->cutoff)
+            continue;
+        if (page->live_count &&
+            bsearch(&up->uploadId, page->live, page->live_count, sizeof(*page->live),
+                    ct_reap_id_cmp))
+            continue;
+
+        if (page->count == page->size) {
+            int size = page->size ? page->size * 2 : CT_MPU_REAP_PAGE;
+            struct ct_reap_upload *grown = realloc(page->uploads,
+                                                   size * sizeof(*grown));
+            if (grown == NULL)
+                return S3StatusOutOfMemory;
+            page->uploads = grown;
+            page->size = size;
+        }
+        page->uploads[page->count].key = strdup(up->key);
+        page->uploads[page->count].upload_id = strdup(up->uploadId);
+        page->count++;
+    }
+
+    return S3StatusOK;
+}
+
+static S3Status ct_reap_properties_callback(const S3ResponseProperties *properties,
+                                            void *data)
+{
+    return S3StatusOK;
+}
+
+static void ct_reap_complete_callback(S3Status status, const S3ErrorDetails *error,
+                                      void *data)
+{
+    struct ct_reap_page *page = data;
+
+    page->status = status;
+    ct_s3_req_complete(page->req, status, error);
+}
+
+static S3ListMultipartUploadsHandler reap_list_handler = {
+    {
+        &ct_reap_properties_callback,
+        &ct_reap_complete_callback
+    },
+    &ct_reap_list_callback
+};
+
+static void ct_reap_page_reset(struct ct_reap_page *page)
+{
+    for (int i = 0; i < page->count; i++) {
+        free(page->uploads[i].key);
+        free(page->uploads[i].upload_id);
+    }
+    page->count = 0;
+}
+
+// wait seconds unless stopped, true when stopped
+static bool ct_reap_wait(double seconds)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long ns = ts.tv_nsec + (long long)(seconds * 1e9);
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+
+    pthread_mutex_lock(&reap_mutex);
+    while (!reap_stop) {
+        if (pthread_cond_timedwait(&reap_cond, &reap_mutex, &ts) == ETIMEDOUT)
+            break;
+    }
+    bool stopped = reap_stop;
+    pthread_mutex_unlock(&reap_mutex);
+
+    return stopped;
+}
+
+// list the uploads of one bucket and abort the stale ones, false when stopped
+static bool ct_reap_bucket(const char *name, struct ct_reap_page *page, int *reaped)
+{
+    S3BucketContext ctx = reap_bucket;
+    char key_marker[S3_MAX_KEY_SIZE] = "";
+    char upload_id_marker[CT_MPU_UPLOAD_ID_MAX] = "";
+
+    ctx.bucketName = name;
+    do {
+        if (ct_endpoint_rejecting()) {
+            tlog_info("endpoint rejecting requests, multipart upload reaping of "
+                      "'%s' put off", name);
+            return true;
+        }
+
+        struct ct_s3_req req;
+        ct_s3_req_init(&req, CT_S3_MPU_LIST, &ctx, NULL, &reap_list_handler, page);
+        req.marker = key_marker[0] ? key_marker : NULL;
+        req.upload_id = upload_id_marker[0] ? upload_id_marker : NULL;
+        req.max_keys = CT_MPU_REAP_PAGE;
+        page->status = S3StatusOK;
+        page->truncated = 0;
+        page->req = &req;
+        ct_s3_engine_run(&req);
+        page->req = NULL;
+        if (page->status != S3StatusOK) {
+            tlog_warn("cannot list multipart uploads of '%s': %s", name,
+                      S3_get_status_name(page->status));
+            ct_reap_page_reset(page);
+            return true;
+        }
+
+        for (int i = 0; i < page->count; i++) {
+            if (page->uploads[i].key == NULL || page->uploads[i].upload_id == NULL)
+                continue;
+            tlog_info("multipart upload %s of '%s' in '%s' older than %d s, abort it",
+                      page->uploads[i].upload_id, page->uploads[i].key, name,
+                      reap_age);
+            if (ct_mpu_abort(&ctx, page->uploads[i].key, page->uploads[i].upload_id))
+                (*reaped)++;
+            if (ct_reap_wait(1.0 / reap_rate)) {
+                ct_reap_page_reset(page);
+                return false;
+            }
+        }
+        ct_reap_page_reset(page);
+
+        strncpy(key_marker, page->next_key, sizeof(key_marker) - 1);
+        strncpy(upload_id_marker, page->next_upload_id, sizeof(upload_id_marker) - 1);
+    } while (page->truncated && (key_marker[0] || upload_id_marker[0]));
+
+    return true;
+}
+
+static void *ct_reap_thread_fn(void *data)
+{
+    while (!ct_reap_wait(reap_interval)) {
+        struct ct_reap_page page = { 0 };
+        int reaped = 0;
+
+        // taken before the list, an upload initiated since has a younger
+        // journal or is not reaped by age anyway
+        int rc = ct_mpu_journal_live(reap_age, &page.live);
+        if (rc < 0)
+            continue;
+        page.live_count = rc;
+        page.cutoff = time(NULL) - reap_age;
+
+        for (int i = 0; i < reap_nbuckets; i++) {
+            if (!ct_reap_bucket(reap_buckets[i], &page, &reaped))
+                break;
+        }
+
+        free(page.uploads);
+        ct_mpu_journal_live_free(page.live, page.live_count);
+        if (reaped)
+            tlog_info("aborted %d stale multipart uploads", reaped);
+    }
+
+    return NULL;
+}
+
+int ct_mpu_reaper_init(int age, int interval, int rate,
+                       const S3BucketContext *bucket, const char *const *buckets,
+                       int nbuckets)
+{
+    int rc;
+
+    if (age <= 0) {
+        tlog_info("multipart upload reaper disabled");
+        return 0;
+    }
+
+    if (interval <= 0 || rate <= 0 || nbuckets <= 0) {
+        tlog_error("invalid multipart upload reaper interval %d or rate %d",
+                   interval, rate);
+        return -EINVAL;
+    }
+
+    reap_buckets = calloc(nbuckets, sizeof(*reap_buckets));
+    if (reap_buckets == NULL)
+        return -ENOMEM;
+    for (int i = 0; i < nbuckets; i++) {
+        reap_buckets[i] = strdup(buckets[i]);
+        if (reap_buckets[i] == NULL) {
+            reap_nbuckets = i;
+            ct_mpu_reaper_destroy();
+            return -ENOMEM;
+        }
+    }
+    reap_nbuckets = nbuckets;
+
+    reap_age = age;
+    reap_interval = interval;
+    reap_rate = rate;
+    reap_bucket = *bucket;
+
+    reap_stop = false;
+    rc = pthread_create(&reap_thread, NULL, ct_reap_thread_fn, NULL);
+    if (rc != 0) {
+        tlog_error("cannot create multipart upload reaper thread: %s", strerror(rc));
+        ct_mpu_reaper_destroy();
+        return -rc;
+    }
+    reap_running = true;
+
+    tlog_info("multipart uploads older than %d s reaped every %d s, %d aborts/s",
+              reap_age, reap_interval, reap_rate);
+    return 0;
+}
+
+void ct_mpu_reaper_destroy(void)
+{
+    if (reap_running) {
+        pthread_mutex_lock(&reap_mutex);
+        reap_stop = true;
+        pthread_cond_broadcast(&reap_cond);
+        pthread_mutex_unlock(&reap_mutex);
+
+        pthread_join(reap_thread, NULL);
+        reap_running = false;
+    }
+
+    for (int i = 0; i < reap_nbuckets; i++)
+        free(reap_buckets[i]);
+    free(reap_buckets);
+    reap_buckets = NULL;
+    reap_nbuckets = 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+
+#include "libs3.h"
+
+// multipart uploads left behind
+// a failed upload is aborted at once unless its journal keeps it for a
+// resume, a reaper thread lists the uploads of the buckets every interval
+// seconds and aborts the ones initiated more than age seconds ago that no
+// live journal resumes, at most rate aborts a second, nothing is listed
+// while the endpoint is rejecting requests
+// age must exceed the longest archive of every copytool sharing the
+// buckets, their uploads in progress are not known here
+
+#define CT_MPU_REAP_AGE_DEFAULT (2 * 24 * 3600)
+#define CT_MPU_REAP_INTERVAL_DEFAULT 3600
+#define CT_MPU_REAP_RATE_DEFAULT 10
+// uploads asked per list page
+#define CT_MPU_REAP_PAGE 100
+
+// abort upload_id of key through the S3 engine, true when it is gone
+bool ct_mpu_abort(const S3BucketContext *bucket, const char *key,
+                  const char *upload_id);
+
+// age of 0 disables the reaper, buckets are the names to list
+// call after ct_s3_engine_init, listings and aborts go through the engine
+int ct_mpu_reaper_init(int age, int interval, int rate,
+                       const S3BucketContext *bucket, const char *const *buckets,
+                       int nbuckets);
+
+void ct_mpu_reaper_destroy(void);
@@ -0,0 +1,285 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ct_obj_index.h"
+#include "ct_common.h"
+#include "tlog.h"
+
+// object index module, see ct_obj_index.h
+//
+// file layout: one page of header, then capacity records, linear probing
+// from the FID hash
+
+#define CT_OBJ_INDEX_MAGIC 0x4553544f424a4958ULL
+#define CT_OBJ_INDEX_VERSION 1
+#define CT_OBJ_INDEX_HEADER 4096
+// the table grows past this load, in percent
+#define CT_OBJ_INDEX_LOAD 70
+
+struct ct_obj_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t rec_size;
+    uint64_t capacity;
+    uint64_t count;
+};
+
+static char                  obj_path[PATH_MAX];
+static int                   obj_fd = -1;
+static void                 *obj_map;
+static size_t                obj_map_size;
+static struct ct_obj_header *obj_header;
+static struct ct_obj_rec    *obj_recs;
+static pthread_rwlock_t      obj_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static size_t ct_obj_index_size(uint64_t capacity)
+{
+    return CT_OBJ_INDEX_HEADER + capacity * sizeof(struct ct_obj_rec);
+}
+
+static bool ct_obj_fid_equal(const struct lu_fid *a, const struct lu_fid *b)
+{
+    return a->f_seq == b->f_seq && a->f_oid == b->f_oid && a->f_ver == b->f_ver;
+}
+
+// map the index file at path, a new or foreign file is set up empty with
+// capacity records
+static int ct_obj_index_map(const char *path, uint64_t capacity, int *fd_out,
+                            void **map_out, size_t *size_out)
+{
+    struct stat st;
+    int rc;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        rc = -errno;
+        tlog_error("cannot open object index '%s': %s", path, strerror(errno));
+        return rc;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        rc = -errno;
+        close(fd);
+        return rc;
+    }
+
+    struct ct_obj_header hdr;
+    bool fresh = true;
+    if (st.st_size >= CT_OBJ_INDEX_HEADER &&
+        pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        hdr.magic == CT_OBJ_INDEX_MAGIC && hdr.version == CT_OBJ_INDEX_VERSION &&
+        hdr.rec_size == sizeof(struct ct_obj_rec) && hdr.capacity > 0 &&
+        (uint64_t)st.st_size >= ct_obj_index_size(hdr.capacity)) {
+        capacity = hdr.capacity;
+        fresh = false;
+    } else if (st.st_size > 0) {
+        tlog_warn("object index '%s' is not usable, start a new one", path);
+    }
+
+    size_t size = ct_obj_index_size(capacity);
+    if (fresh && (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0)) {
+        rc = -errno;
+        tlog_error("cannot size object index '%s': %s", path, strerror(errno));
+        close(fd);
+        return rc;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        rc = -errno;
+        tlog_error("cannot map object index '%s': %s", path, strerror(errno));
+        close(fd);
+        return rc;
+    }
+
+    if (fresh) {
+        struct ct_obj_header *header = map;
+        header->magic = CT_OBJ_INDEX_MAGIC;
+        header->version = CT_OBJ_INDEX_VERSION;
+        header->rec_size = sizeof(struct ct_obj_rec);
+        header->capacity = capacity;
+        header->count = 0;
+    }
+
+    *fd_out = fd;
+    *map_out = map;
+    *size_out = size;
+    return 0;
+}
+
+static void ct_obj_index_unmap(void)
+{
+    if (obj_map) {
+        msync(obj_map, obj_map_size, MS_SYNC);
+        munmap(obj_map, obj_map_size);
+    }
+    if (obj_fd >= 0)
+        close(obj_fd);
+
+    obj_map = NULL;
+    obj_header = NULL;
+    obj_recs = NULL;
+    obj_fd = -1;
+}
+
+int ct_obj_index_init(const char *path, uint64_t capacity)
+{
+    if (path == NULL || path[0] == '\0') {
+        tlog_info("object index disabled");
+        return 0;
+    }
+
+    strncpy(obj_path, path, sizeof(obj_path) - 1);
+    int rc = ct_obj_index_map(obj_path, capacity, &obj_fd, &obj_map, &obj_map_size);
+    if (rc)
+        return rc;
+
+    obj_header = obj_map;
+    obj_recs = (struct ct_obj_rec *)((char *)obj_map + CT_OBJ_INDEX_HEADER);
+
+    tlog_info("object index '%s' of %lu records, %lu used", obj_path,
+              obj_header->capacity, obj_header->count);
+    return 0;
+}
+
+void ct_obj_index_destroy(void)
+{
+    pthread_rwlock_wrlock(&obj_lock);
+    ct_obj_index_unmap();
+    pthread_rwlock_unlock(&obj_lock);
+}
+
+bool ct_obj_index_enabled(void)
+{
+    return obj_map != NULL;
+}
+
+// slot of fid, or the empty slot ending its probe sequence
+// must hold obj_lock
+static struct ct_obj_rec *ct_obj_find(struct ct_obj_rec *recs, uint64_t capacity,
+                                      const struct lu_fid *fid)
+{
+    uint64_t i = ct_fid_hash(fid) % capacity;
+
+    // the table is never full, a probe always ends
+    while (recs[i].state != CT_OBJ_EMPTY && !ct_obj_fid_equal(&recs[i].fid, fid))
+        i = (i + 1) % capacity;
+
+    return &recs[i];
+}
+
+// double the table into a new file renamed over the old one
+// must hold obj_lock for write
+static int ct_obj_index_grow(void)
+{
+    char tmp_path[PATH_MAX + 8];
+    uint64_t capacity = obj_header->capacity * 2;
+    int fd;
+    void *map;
+    size_t size;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.grow", obj_path);
+    unlink(tmp_path);
+    int rc = ct_obj_index_map(tmp_path, capacity, &fd, &map, &size);
+    if (rc)
+        return rc;
+
+    struct ct_obj_header *header = map;
+    struct ct_obj_rec *recs = (struct ct_obj_rec *)((char *)map + CT_OBJ_INDEX_HEADER);
+    for (uint64_t i = 0; i < obj_header->capacity; i++) {
+        if (obj_recs[i].state == CT_OBJ_EMPTY)
+            continue;
+        *ct_obj_find(recs, capacity, &obj_recs[i].fid) = obj_recs[i];
+        header->count++;
+    }
+
+    if (msync(map, size, MS_SYNC) < 0 || rename(tmp_path, obj_path) < 0) {
+        rc = -errno;
+        tlog_error("cannot replace object index '%s': %s", obj_path, strerror(errno));
+        munmap(map, size);
+        close(fd);
+        unlink(tmp_path);
+        return rc;
+    }
+
+    ct_obj_index_unmap();
+    obj_fd = fd;
+    obj_map = map;
+    obj_map_size = size;
+    obj_header = header;
+    obj_recs = recs;
+
+    tlog_info("object index '%s' grown to %lu records", obj_path, capacity);
+    return 0;
+}
+
+bool ct_obj_index_lookup(const struct lu_fid *fid, struct ct_obj_rec *rec)
+{
+    bool found = false;
+
+    pthread_rwlock_rdlock(&obj_lock);
+    if (obj_map) {
+        struct ct_obj_rec *slot = ct_obj_find(obj_recs, obj_header->capacity, fid);
+        if (slot->state != CT_OBJ_EMPTY) {
+            *rec = *slot;
+            found = true;
+        }
+    }
+    pthread_rwlock_unlock(&obj_lock);
+
+    return found;
+}
+
+int ct_obj_index_put(const struct ct_obj_rec *rec)
+{
+    int rc = 0;
+
+    pthread_rwlock_wrlock(&obj_lock);
+    if (obj_map == NULL)
+        goto out;
+
+    if ((obj_header->count + 1) * 100 >= obj_header->capacity * CT_OBJ_INDEX_LOAD) {
+        rc = ct_obj_index_grow();
+        // a full table must not take more records
+        if (rc && (obj_header->count + 1) >= obj_header->capacity)
+            goto out;
+        rc = 0;
+    }
+
+    struct ct_obj_rec *slot = ct_obj_find(obj_recs, obj_header->capacity, &rec->fid);
+    if (slot->state == CT_OBJ_EMPTY)
+        obj_header->count++;
+
+    // a slot never goes back to empty, probe sequences of other FIDs run
+    // through it
+    *slot = *rec;
+    if (slot->state == CT_OBJ_EMPTY)
+        slot->state = CT_OBJ_LIVE;
+
+out:
+    pthread_rwlock_unlock(&obj_lock);
+    return rc;
+}
+
+void ct_obj_index_remove(const struct lu_fid *fid)
+{
+    pthread_rwlock_wrlock(&obj_lock);
+    if (obj_map) {
+        struct ct_obj_rec *slot = ct_obj_find(obj_recs, obj_header->capacity, fid);
+        if (slot->state != CT_OBJ_EMPTY)
+            slot->state = CT_OBJ_REMOVED;
+    }
+    pthread_rwlock_unlock(&obj_lock);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/lustre/lustre_fid.h>
+#include <lustre/lustreapi.h>
+
+// local index of archived objects
+// a memory mapped file holds an open addressing hash table of one record
+// per archived FID: object key, size, ETag and lustre data version, so
+// restore plans its ranges without asking S3 for the size, remove skips
+// objects it already removed, and archive knows what it stored last
+// records are written after every successful archive and survive a crash
+// of the copytool in the page cache, the index is advisory: restore checks
+// the ETag of the first GET against it and a record lost on power failure
+// only costs the lookup it would have spared
+// the table doubles when it gets full, removed objects keep a record
+
+#define CT_OBJ_INDEX_PATH_DEFAULT "/var/lib/estuary/objects.idx"
+#define CT_OBJ_INDEX_CAPACITY_DEFAULT (256 * 1024)
+
+#define CT_OBJ_KEY_MAX 256
+#define CT_OBJ_ETAG_MAX 72
+
+enum ct_obj_state {
+    CT_OBJ_EMPTY = 0,
+    CT_OBJ_LIVE,
+    CT_OBJ_REMOVED,
+};
+
+struct ct_obj_rec {
+    struct lu_fid fid;
+    uint32_t state;
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t data_version;
+    // archive time, seconds since epoch
+    uint64_t mtime;
+    // without quotes, empty when unknown
+    char etag[CT_OBJ_ETAG_MAX];
+    char key[CT_OBJ_KEY_MAX];
+};
+
+// empty path disables the index
+int ct_obj_index_init(const char *path, uint64_t capacity);
+void ct_obj_index_destroy(void);
+
+bool ct_obj_index_enabled(void);
+
+// record of fid into rec, false when there is none
+bool ct_obj_index_lookup(const struct lu_fid *fid, struct ct_obj_rec *rec);
+
+// add or replace the record of rec->fid
+int ct_obj_index_put(const struct ct_obj_rec *rec);
+
+// the object of fid was removed
+void ct_obj_index_remove(const struct lu_fid *fid);
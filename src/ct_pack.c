@@ -0,0 +1,870 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "ct_pack.h"
+#include "ct_common.h"
+#include "ct_s3_engine.h"
+#include "ct_retry.h"
+#include "growbuffer.h"
+#include "hsm_s3_utils.h"
+#include "mem_quota.h"
+#include "tlog.h"
+
+// small file packing module, see ct_pack.h
+//
+// workers reserve a range of the open pack under pack_mutex and copy the
+// file into it without the lock, the pack thread stores a sealed pack once
+// every copy into it is finished
+//
+// the records of a pack are stored as an index object under
+// <prefix>idx/ before its actions complete, as is every tombstone, so the
+// local index can be rebuilt from the bucket and other agents find the
+// packs they did not write
+
+#define CT_PACK_INDEX_BUCKETS (1 << 16)
+// at most one sync of the index objects this often, in seconds
+#define CT_PACK_SYNC_INTERVAL 10
+// index objects are named after the stamp of their records, a sync lists
+// from this many seconds before the newest stamp it knows, for index
+// objects stored late or by an agent whose clock is behind
+#define CT_PACK_SYNC_SLACK 3600
+#define CT_PACK_LIST_MAX 1000
+
+// archive action waiting for its pack
+struct ct_pack_entry {
+    struct hsm_copyaction_private *hcp;
+    struct hsm_action_item *hai;
+    uint64_t offset;
+    uint64_t length;
+    struct ct_pack_entry *next;
+};
+
+struct ct_pack {
+    char key[CT_PACK_KEY_MAX];
+    char *buf;
+    size_t len;
+    time_t opened;
+    // copies into buf still running
+    int writers;
+    struct ct_pack_entry *entries;
+    struct ct_pack *next;
+};
+
+struct ct_pack_node {
+    struct ct_pack_rec rec;
+    struct ct_pack_node *next;
+};
+
+static struct ct_pack_params pack_params;
+static S3BucketContext       pack_bucket;
+static bool                  pack_enabled;
+
+static struct ct_pack       *pack_open;
+// sealed packs waiting to be stored, oldest first
+static struct ct_pack       *pack_sealed_head;
+static struct ct_pack       *pack_sealed_tail;
+static unsigned int          pack_seq;
+static bool                  pack_stop;
+static pthread_t             pack_thread;
+static pthread_mutex_t       pack_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t        pack_cond = PTHREAD_COND_INITIALIZER;
+
+static struct ct_pack_node **index_buckets;
+static int                   index_fd = -1;
+// size of the index file up to its last complete record
+static off_t                 index_size;
+static pthread_rwlock_t      index_lock = PTHREAD_RWLOCK_INITIALIZER;
+// newest record stamp applied, under index_lock
+static uint64_t              index_stamp;
+static unsigned int          index_seq;
+
+static pthread_mutex_t       sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static double                sync_last;
+
+static size_t ct_pack_fid_hash(const struct lu_fid *fid)
+{
+    uint64_t h = fid->f_seq * 0x9e3779b97f4a7c15ULL;
+    h ^= ((uint64_t)fid->f_oid << 32 | fid->f_ver) * 0xc2b2ae3d27d4eb4fULL;
+    return (h ^ (h >> 29)) & (CT_PACK_INDEX_BUCKETS - 1);
+}
+
+static bool ct_pack_rec_valid(const struct ct_pack_rec *rec)
+{
+    return rec->magic == CT_PACK_REC_MAGIC && !(rec->flags & ~CT_PACK_REC_FLAGS) &&
+           memchr(rec->key, '\0', sizeof(rec->key)) != NULL;
+}
+
+// insert or replace the in-memory entry of rec unless the entry is newer,
+// a tombstone stays in memory so an older record synced later does not
+// bring the FID back
+// must hold index_lock for write
+static int ct_pack_index_apply(const struct ct_pack_rec *rec)
+{
+    struct ct_pack_node **pnode = &index_buckets[ct_pack_fid_hash(&rec->fid)];
+
+    while (*pnode && !lu_fid_eq(&(*pnode)->rec.fid, &rec->fid))
+        pnode = &(*pnode)->next;
+
+    if (*pnode && (*pnode)->rec.stamp > rec->stamp)
+        return 0;
+
+    if (*pnode == NULL) {
+        *pnode = calloc(1, sizeof(struct ct_pack_node));
+        if (*pnode == NULL)
+            return -ENOMEM;
+    }
+    (*pnode)->rec = *rec;
+    if (rec->stamp > index_stamp)
+        index_stamp = rec->stamp;
+
+    return 0;
+}
+
+// append records to the index file and apply them
+static int ct_pack_index_append(const struct ct_pack_rec *recs, int count)
+{
+    int rc = 0;
+    size_t size = count * sizeof(struct ct_pack_rec);
+
+    pthread_rwlock_wrlock(&index_lock);
+    ssize_t rc_write = write(index_fd, recs, size);
+    if (rc_write != (ssize_t)size || fdatasync(index_fd) < 0) {
+        rc = (rc_write < 0 || rc_write == (ssize_t)size) ? -errno : -EIO;
+        tlog_error("cannot append to pack index '%s': %s",
+                   pack_params.index_path, strerror(-rc));
+        // no partial record in the middle of the index
+        if (ftruncate(index_fd, index_size) < 0)
+            tlog_warn("cannot truncate pack index '%s'", pack_params.index_path);
+    } else {
+        index_size += size;
+    }
+
+    for (int i = 0; i < count && rc == 0; i++)
+        rc = ct_pack_index_apply(&recs[i]);
+    pthread_rwlock_unlock(&index_lock);
+
+    return rc;
+}
+
+static int ct_pack_index_load(void)
+{
+    struct ct_pack_rec rec;
+    ssize_t rc_read;
+    size_t count = 0;
+
+    index_fd = open(pack_params.index_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (index_fd < 0) {
+        tlog_error("cannot open pack index '%s': %s", pack_params.index_path,
+                   strerror(errno));
+        return -errno;
+    }
+
+    size_t invalid = 0;
+    index_size = 0;
+    while ((rc_read = read(index_fd, &rec, sizeof(rec))) == sizeof(rec)) {
+        index_size += sizeof(rec);
+        if (!ct_pack_rec_valid(&rec)) {
+            invalid++;
+            continue;
+        }
+        int rc = ct_pack_index_apply(&rec);
+        if (rc)
+            return rc;
+        count++;
+    }
+
+    if (invalid)
+        tlog_warn("pack index '%s' has %zu invalid records, ignored",
+                  pack_params.index_path, invalid);
+
+    if (rc_read != 0) {
+        tlog_warn("pack index '%s' ends with a partial record, dropped",
+                  pack_params.index_path);
+        if (ftruncate(index_fd, index_size) < 0) {
+            tlog_error("cannot truncate pack index '%s': %s",
+                       pack_params.index_path, strerror(errno));
+            return -errno;
+        }
+    }
+
+    tlog_info("loaded %zu records from pack index '%s'", count,
+              pack_params.index_path);
+    return 0;
+}
+
+static struct ct_pack *ct_pack_new(void)
+{
+    struct ct_pack *pack = calloc(1, sizeof(*pack));
+    if (pack == NULL)
+        return NULL;
+
+    #ifdef CT_MEM_QUOTA_ENABLED
+    pack->buf = quota_mem_alloc(pack_params.pack_size);
+    #else
+    pack->buf = malloc(pack_params.pack_size);
+    #endif
+    if (pack->buf == NULL) {
+        free(pack);
+        return NULL;
+    }
+
+    pack->opened = time(NULL);
+    snprintf(pack->key, sizeof(pack->key), "%spack_%lx_%x_%08x",
+             pack_params.prefix, (long)pack->opened, getpid(),
+             __atomic_fetch_add(&pack_seq, 1, __ATOMIC_RELAXED));
+
+    return pack;
+}
+
+static void ct_pack_free(struct ct_pack *pack)
+{
+    #ifdef CT_MEM_QUOTA_ENABLED
+    quota_mem_free(pack->buf, pack_params.pack_size);
+    #else
+    free(pack->buf);
+    #endif
+    free(pack);
+}
+
+// move the open pack to the sealed list
+// must hold pack_mutex
+static void ct_pack_seal(void)
+{
+    if (pack_open == NULL)
+        return;
+
+    if (pack_open->entries == NULL && pack_open->writers == 0) {
+        if (pack_stop) {
+            ct_pack_free(pack_open);
+            pack_open = NULL;
+            return;
+        }
+        // nothing was packed, at most holes of failed copies, start over
+        pack_open->len = 0;
+        pack_open->opened = time(NULL);
+        return;
+    }
+
+    if (pack_sealed_tail)
+        pack_sealed_tail->next = pack_open;
+    else
+        pack_sealed_head = pack_open;
+    pack_sealed_tail = pack_open;
+    pack_open = NULL;
+
+    pthread_cond_broadcast(&pack_cond);
+}
+
+static int ct_pack_put(const char *key, char *buf, size_t len)
+{
+    S3PutProperties putProperties;
+    memset(&putProperties, 0, sizeof(putProperties));
+    putProperties.contentType = "binary/octet-stream";
+    putProperties.expires = -1;
+
+    S3PutObjectHandler putObjectHandler = { putResponseHandler,
+                                            &put_objectdata_callback };
+
+    put_object_callback_data data;
+    memset(&data, 0, sizeof(data));
+    data.buffer = buf;
+    data.file_name = (char *)key;
+
+    double before_s3_put = ct_now();
+    struct ct_retry retry;
+    ct_retry_init(&retry);
+    do {
+        data.buffer_offset = 0;
+        data.contentLength = len;
+
+        struct ct_s3_req req;
+        ct_s3_req_init(&req, CT_S3_PUT, &pack_bucket, key,
+                       &putObjectHandler, &data);
+        req.byte_count = len;
+        req.put_properties = &putProperties;
+        data.req = &req;
+        ct_s3_engine_run(&req);
+        data.req = NULL;
+    } while (ct_retry_should(&retry, data.status));
+
+    if (data.status != S3StatusOK) {
+        tlog_error("failed to put '%s', S3Error %s", key,
+                   S3_get_status_name(data.status));
+        return -EIO;
+    }
+
+    tlog_info("put '%s' of %zu bytes took %fs", key, len,
+              ct_now() - before_s3_put);
+    return 0;
+}
+
+// store records as an index object, they all carry the same stamp
+static int ct_pack_index_put(struct ct_pack_rec *recs, int count)
+{
+    char key[CT_PACK_KEY_MAX + 32];
+
+    snprintf(key, sizeof(key), "%sidx/%016lx_%x_%08x", pack_params.prefix,
+             (unsigned long)recs[0].stamp, getpid(),
+             __atomic_fetch_add(&index_seq, 1, __ATOMIC_RELAXED));
+
+    return ct_pack_put(key, (char *)recs, count * sizeof(*recs));
+}
+
+// store a sealed pack, index it and complete its archive actions
+static void ct_pack_store(struct ct_pack *pack)
+{
+    struct ct_pack_entry *entry;
+    int count = 0;
+    int rc;
+
+    pthread_mutex_lock(&pack_mutex);
+    while (pack->writers)
+        pthread_cond_wait(&pack_cond, &pack_mutex);
+    pthread_mutex_unlock(&pack_mutex);
+
+    for (entry = pack->entries; entry; entry = entry->next)
+        count++;
+
+    rc = ct_pack_put(pack->key, pack->buf, pack->len);
+    if (rc == 0) {
+        struct ct_pack_rec *recs = calloc(count, sizeof(*recs));
+        if (recs == NULL) {
+            rc = -ENOMEM;
+        } else {
+            uint64_t stamp = time(NULL);
+            int i = 0;
+            for (entry = pack->entries; entry; entry = entry->next, i++) {
+                recs[i].magic = CT_PACK_REC_MAGIC;
+                recs[i].fid = entry->hai->hai_fid;
+                recs[i].offset = entry->offset;
+                recs[i].length = entry->length;
+                recs[i].stamp = stamp;
+                strncpy(recs[i].key, pack->key, sizeof(recs[i].key) - 1);
+            }
+            // a pack is restorable only once its index object is stored
+            rc = ct_pack_index_put(recs, count);
+            if (rc == 0)
+                rc = ct_pack_index_append(recs, count);
+            free(recs);
+        }
+    }
+
+    while ((entry = pack->entries) != NULL) {
+        pack->entries = entry->next;
+        ct_action_done(&entry->hcp, entry->hai, rc ? HP_FLAG_RETRY : 0, rc);
+        free(entry->hai);
+        free(entry);
+    }
+
+    ct_pack_free(pack);
+}
+
+static void *ct_pack_thread(void *data)
+{
+    pthread_mutex_lock(&pack_mutex);
+    while (true) {
+        if (pack_open && (pack_stop ||
+            difftime(time(NULL), pack_open->opened) >= pack_params.window))
+            ct_pack_seal();
+
+        if (pack_sealed_head) {
+            struct ct_pack *pack = pack_sealed_head;
+            pack_sealed_head = pack->next;
+            if (pack_sealed_head == NULL)
+                pack_sealed_tail = NULL;
+            pthread_mutex_unlock(&pack_mutex);
+
+            ct_pack_store(pack);
+
+            pthread_mutex_lock(&pack_mutex);
+            continue;
+        }
+
+        if (pack_stop && pack_open == NULL)
+            break;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&pack_cond, &pack_mutex, &ts);
+    }
+    pthread_mutex_unlock(&pack_mutex);
+
+    return NULL;
+}
+
+int ct_pack_init(const struct ct_pack_params *params,
+                 const S3BucketContext *bucket)
+{
+    int rc;
+
+    assert(params && bucket);
+
+    pack_params = *params;
+    pack_bucket = *bucket;
+
+    if (pack_params.pack_size < pack_params.threshold) {
+        tlog_error("pack size %zu is smaller than pack threshold %zu",
+                   pack_params.pack_size, pack_params.threshold);
+        return -EINVAL;
+    }
+
+    index_buckets = calloc(CT_PACK_INDEX_BUCKETS, sizeof(*index_buckets));
+    if (index_buckets == NULL)
+        return -ENOMEM;
+
+    rc = ct_pack_index_load();
+    if (rc)
+        return rc;
+
+    pack_stop = false;
+    rc = pthread_create(&pack_thread, NULL, ct_pack_thread, NULL);
+    if (rc != 0) {
+        tlog_error("cannot create pack thread: %s", strerror(rc));
+        return -rc;
+    }
+
+    pack_enabled = true;
+    tlog_info("packing files smaller than %zu bytes into packs of %zu bytes, "
+              "window %ds", pack_params.threshold, pack_params.pack_size,
+              pack_params.window);
+    return 0;
+}
+
+void ct_pack_destroy(void)
+{
+    if (!pack_enabled)
+        return;
+
+    pthread_mutex_lock(&pack_mutex);
+    pack_enabled = false;
+    pack_stop = true;
+    pthread_cond_broadcast(&pack_cond);
+    pthread_mutex_unlock(&pack_mutex);
+
+    pthread_join(pack_thread, NULL);
+
+    if (pack_open) {
+        // empty pack left open
+        ct_pack_free(pack_open);
+        pack_open = NULL;
+    }
+
+    pthread_rwlock_wrlock(&index_lock);
+    for (int i = 0; i < CT_PACK_INDEX_BUCKETS; i++) {
+        while (index_buckets[i]) {
+            struct ct_pack_node *node = index_buckets[i];
+            index_buckets[i] = node->next;
+            free(node);
+        }
+    }
+    free(index_buckets);
+    index_buckets = NULL;
+    close(index_fd);
+    index_fd = -1;
+    pthread_rwlock_unlock(&index_lock);
+}
+
+bool ct_pack_enabled(void)
+{
+    return pack_enabled;
+}
+
+size_t ct_pack_threshold(void)
+{
+    return pack_params.threshold;
+}
+
+int ct_pack_add(struct hsm_copyaction_private *hcp,
+                const struct hsm_action_item *hai, int src_fd, size_t size)
+{
+    struct ct_pack_entry *entry;
+    struct ct_pack *pack;
+    uint64_t offset;
+
+    if (!pack_enabled || size >= pack_params.threshold)
+        return -EINVAL;
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+        return -ENOMEM;
+    entry->hai = malloc(hai->hai_len);
+    if (entry->hai == NULL) {
+        free(entry);
+        return -ENOMEM;
+    }
+    memcpy(entry->hai, hai, hai->hai_len);
+    entry->hcp = hcp;
+    entry->length = size;
+
+    // reserve a range of the open pack
+    pthread_mutex_lock(&pack_mutex);
+    if (pack_open && pack_open->len + size > pack_params.pack_size)
+        ct_pack_seal();
+    if (pack_open == NULL) {
+        // may wait for the memory quota, that is the backpressure of packing
+        pthread_mutex_unlock(&pack_mutex);
+        struct ct_pack *new_pack = ct_pack_new();
+        pthread_mutex_lock(&pack_mutex);
+        if (new_pack == NULL) {
+            pthread_mutex_unlock(&pack_mutex);
+            free(entry->hai);
+            free(entry);
+            return -ENOMEM;
+        }
+        if (pack_open == NULL) {
+            pack_open = new_pack;
+        } else {
+            // another worker opened one meanwhile
+            ct_pack_free(new_pack);
+        }
+    }
+    // the pack in use may be one another worker filled meanwhile
+    if (pack_open->len + size > pack_params.pack_size) {
+        pthread_mutex_unlock(&pack_mutex);
+        free(entry->hai);
+        free(entry);
+        return -EAGAIN;
+    }
+    pack = pack_open;
+    offset = pack->len;
+    pack->len += size;
+    pack->writers++;
+    pthread_mutex_unlock(&pack_mutex);
+
+    ssize_t rc_read = pread(src_fd, pack->buf + offset, size, hai->hai_extent.offset);
+    int rc = (rc_read == (ssize_t)size) ? 0 : -EIO;
+    if (rc)
+        tlog_error("failed to read %zu bytes of "DFID" for packing, get size %ld",
+                   size, PFID(&hai->hai_fid), rc_read);
+
+    pthread_mutex_lock(&pack_mutex);
+    pack->writers--;
+    if (rc == 0) {
+        // the reserved range stays a hole in the pack on error
+        entry->offset = offset;
+        entry->next = pack->entries;
+        pack->entries = entry;
+    }
+    pthread_cond_broadcast(&pack_cond);
+    pthread_mutex_unlock(&pack_mutex);
+
+    if (rc) {
+        free(entry->hai);
+        free(entry);
+        return rc;
+    }
+
+    tlog_info("packed "DFID" (%zu bytes) into '%s' at offset %lu",
+              PFID(&hai->hai_fid), size, pack->key, offset);
+    return 0;
+}
+
+bool ct_pack_lookup(const struct lu_fid *fid, struct ct_pack_rec *rec)
+{
+    bool found = false;
+
+    if (index_buckets == NULL)
+        return false;
+
+    pthread_rwlock_rdlock(&index_lock);
+    struct ct_pack_node *node = index_buckets[ct_pack_fid_hash(fid)];
+    while (node && !lu_fid_eq(&node->rec.fid, fid))
+        node = node->next;
+    if (node && !(node->rec.flags & CT_PACK_REC_REMOVED)) {
+        *rec = node->rec;
+        found = true;
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    return found;
+}
+
+int ct_pack_remove(const struct lu_fid *fid)
+{
+    struct ct_pack_rec rec;
+
+    if (!ct_pack_lookup(fid, &rec))
+        return -ENOENT;
+
+    rec.flags |= CT_PACK_REC_REMOVED;
+    rec.stamp = time(NULL);
+    int rc = ct_pack_index_put(&rec, 1);
+    if (rc)
+        return rc;
+
+    return ct_pack_index_append(&rec, 1);
+}
+
+// listing of the index objects
+struct ct_pack_list {
+    S3Status status;
+    char **keys;
+    int count;
+    int size;
+    bool truncated;
+    struct ct_s3_req *req;
+};
+
+static S3Status ct_pack_properties(const S3ResponseProperties *properties,
+                                        void *callbackData)
+{
+    return S3StatusOK;
+}
+
+static void ct_pack_list_complete(S3Status status, const S3ErrorDetails *error,
+                                  void *callbackData)
+{
+    struct ct_pack_list *list = callbackData;
+
+    list->status = status;
+    ct_s3_req_complete(list->req, status, error);
+}
+
+static S3Status ct_pack_list_callback(int isTruncated, const char *nextMarker,
+                                      int contentsCount,
+                                      const S3ListBucketContent *contents,
+                                      int commonPrefixesCount,
+                                      const char **commonPrefixes,
+                                      void *callbackData)
+{
+    struct ct_pack_list *list = callbackData;
+
+    list->truncated = isTruncated;
+    for (int i = 0; i < contentsCount; i++) {
+        if (list->count == list->size) {
+            int size = list->size ? list->size * 2 : 64;
+            char **keys = realloc(list->keys, size * sizeof(*keys));
+            if (keys == NULL)
+                return S3StatusOutOfMemory;
+            list->keys = keys;
+            list->size = size;
+        }
+        list->keys[list->count] = strdup(contents[i].key);
+        if (list->keys[list->count] == NULL)
+            return S3StatusOutOfMemory;
+        list->count++;
+    }
+
+    return S3StatusOK;
+}
+
+static S3ListBucketHandler listHandler = {
+    { &ct_pack_properties, &ct_pack_list_complete },
+    &ct_pack_list_callback
+};
+
+// read of an index object
+struct ct_pack_get {
+    S3Status status;
+    growbuffer *gb;
+    struct ct_s3_req *req;
+};
+
+static void ct_pack_get_complete(S3Status status, const S3ErrorDetails *error,
+                                 void *callbackData)
+{
+    struct ct_pack_get *get = callbackData;
+
+    get->status = status;
+    ct_s3_req_complete(get->req, status, error);
+}
+
+static S3Status ct_pack_get_callback(int bufferSize, const char *buffer,
+                                     void *callbackData)
+{
+    struct ct_pack_get *get = callbackData;
+
+    if (!growbuffer_append(&get->gb, buffer, bufferSize))
+        return S3StatusOutOfMemory;
+
+    return S3StatusOK;
+}
+
+static S3GetObjectHandler indexGetHandler = {
+    { &ct_pack_properties, &ct_pack_get_complete },
+    &ct_pack_get_callback
+};
+
+// list the index objects after marker
+static int ct_pack_list_index(const char *marker, struct ct_pack_list *list)
+{
+    char prefix[CT_PACK_KEY_MAX + 8];
+    struct ct_retry retry;
+
+    snprintf(prefix, sizeof(prefix), "%sidx/", pack_params.prefix);
+
+    do {
+        int count = list->count;
+        const char *after = count ? list->keys[count - 1] : marker;
+
+        ct_retry_init(&retry);
+        do {
+            // a failed page may have delivered some of its keys
+            while (list->count > count)
+                free(list->keys[--list->count]);
+
+            struct ct_s3_req req;
+            ct_s3_req_init(&req, CT_S3_LIST, &pack_bucket, prefix,
+                           &listHandler, list);
+            req.marker = after;
+            req.max_keys = CT_PACK_LIST_MAX;
+            list->req = &req;
+            ct_s3_engine_run(&req);
+            list->req = NULL;
+        } while (ct_retry_should(&retry, list->status));
+
+        if (list->status != S3StatusOK) {
+            tlog_error("failed to list pack index objects, S3Error %s",
+                       S3_get_status_name(list->status));
+            return -EIO;
+        }
+    } while (list->truncated && list->count > 0);
+
+    return 0;
+}
+
+// the local index has rec or a newer record of its FID, a sync lists the
+// index objects of the slack again and again
+static bool ct_pack_index_known(const struct ct_pack_rec *rec)
+{
+    bool known;
+
+    pthread_rwlock_rdlock(&index_lock);
+    struct ct_pack_node *node = index_buckets[ct_pack_fid_hash(&rec->fid)];
+    while (node && !lu_fid_eq(&node->rec.fid, &rec->fid))
+        node = node->next;
+    known = node && node->rec.stamp >= rec->stamp;
+    pthread_rwlock_unlock(&index_lock);
+
+    return known;
+}
+
+// read an index object and apply its records, appending them to the
+// local index
+static int ct_pack_sync_object(const char *key)
+{
+    struct ct_pack_get get;
+    struct ct_retry retry;
+    int rc = 0;
+
+    memset(&get, 0, sizeof(get));
+    ct_retry_init(&retry);
+    do {
+        growbuffer_destroy(get.gb);
+        get.gb = NULL;
+
+        struct ct_s3_req req;
+        ct_s3_req_init(&req, CT_S3_GET, &pack_bucket, key, &indexGetHandler, &get);
+        get.req = &req;
+        ct_s3_engine_run(&req);
+        get.req = NULL;
+    } while (ct_retry_should(&retry, get.status));
+
+    if (get.status != S3StatusOK) {
+        tlog_error("failed to get pack index object '%s', S3Error %s", key,
+                   S3_get_status_name(get.status));
+        growbuffer_destroy(get.gb);
+        return -EIO;
+    }
+
+    struct ct_pack_rec rec;
+    struct ct_pack_rec *recs = NULL;
+    int count = 0, size = 0;
+    int got;
+    size_t invalid = 0;
+    while (get.gb) {
+        growbuffer_read(&get.gb, sizeof(rec), &got, (char *)&rec);
+        if (got != sizeof(rec)) {
+            // growbuffer_read stops at the end of a block, finish the record
+            int more = 0;
+            if (get.gb)
+                growbuffer_read(&get.gb, sizeof(rec) - got, &more,
+                                (char *)&rec + got);
+            if (got + more != sizeof(rec)) {
+                if (got + more > 0)
+                    invalid++;
+                break;
+            }
+        }
+        if (!ct_pack_rec_valid(&rec)) {
+            invalid++;
+            continue;
+        }
+        if (ct_pack_index_known(&rec))
+            continue;
+        if (count == size) {
+            size = size ? size * 2 : 256;
+            struct ct_pack_rec *more_recs = realloc(recs, size * sizeof(*recs));
+            if (more_recs == NULL) {
+                rc = -ENOMEM;
+                break;
+            }
+            recs = more_recs;
+        }
+        recs[count++] = rec;
+    }
+    growbuffer_destroy(get.gb);
+
+    if (rc == 0 && count > 0)
+        rc = ct_pack_index_append(recs, count);
+    free(recs);
+
+    if (invalid)
+        tlog_warn("pack index object '%s' has %zu invalid records, ignored",
+                  key, invalid);
+    return rc;
+}
+
+int ct_pack_sync(void)
+{
+    struct ct_pack_list list;
+    char marker[CT_PACK_KEY_MAX + 32];
+    int rc = 0;
+
+    if (index_buckets == NULL)
+        return -EINVAL;
+
+    pthread_mutex_lock(&sync_mutex);
+    if (sync_last > 0 && ct_now() - sync_last < CT_PACK_SYNC_INTERVAL) {
+        pthread_mutex_unlock(&sync_mutex);
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&index_lock);
+    uint64_t stamp = index_stamp;
+    pthread_rwlock_unlock(&index_lock);
+
+    // an empty index, a lost disk or a new agent, reads every index object
+    marker[0] = '\0';
+    if (stamp > CT_PACK_SYNC_SLACK)
+        snprintf(marker, sizeof(marker), "%sidx/%016lx", pack_params.prefix,
+                 (unsigned long)(stamp - CT_PACK_SYNC_SLACK));
+
+    memset(&list, 0, sizeof(list));
+    rc = ct_pack_list_index(marker[0] ? marker : NULL, &list);
+    for (int i = 0; i < list.count && rc == 0; i++)
+        rc = ct_pack_sync_object(list.keys[i]);
+
+    for (int i = 0; i < list.count; i++)
+        free(list.keys[i]);
+    free(list.keys);
+
+    if (rc == 0) {
+        sync_last = ct_now();
+        tlog_info("synced %d pack index objects", list.count);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+
+    return rc;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/lustre/lustre_fid.h>
+#include <lustre/lustreapi.h>
+
+#include "libs3.h"
+
+// small file packing
+// archives of small files are appended to an in-memory pack, the pack is
+// stored as one S3 object once it is full or old enough, and only then
+// the archive actions packed into it are completed
+// a local index maps every packed FID to (pack key, offset, length), a
+// restore is a single ranged GET into the pack object
+// the records of every pack and every tombstone are also stored as index
+// objects next to the packs, a FID missing from the local index is looked
+// up there
+
+#define CT_PACK_KEY_MAX 96
+
+#define CT_PACK_THRESHOLD_DEFAULT (64 * 1024)
+#define CT_PACK_SIZE_DEFAULT (64 * 1024 * 1024)
+#define CT_PACK_WINDOW_DEFAULT 5
+#define CT_PACK_INDEX_DEFAULT "/var/lib/estuary/pack.idx"
+#define CT_PACK_PREFIX_DEFAULT ".packs/"
+
+// record of the index file and of the index objects, the index is append
+// only, a record of the same FID replaces one with an older or equal stamp
+struct ct_pack_rec {
+    uint32_t magic;
+    struct lu_fid fid;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t flags;
+    // time the record was written
+    uint64_t stamp;
+    char key[CT_PACK_KEY_MAX];
+};
+
+#define CT_PACK_REC_MAGIC 0x50434b52
+
+// record flags
+#define CT_PACK_REC_REMOVED 0x1
+#define CT_PACK_REC_FLAGS CT_PACK_REC_REMOVED
+
+struct ct_pack_params {
+    // files smaller than this are packed
+    size_t threshold;
+    // a pack is stored once it reaches this size
+    size_t pack_size;
+    // or once its oldest file waited this many seconds
+    int window;
+    const char *index_path;
+    // key prefix of pack objects
+    const char *prefix;
+};
+
+int ct_pack_init(const struct ct_pack_params *params,
+                 const S3BucketContext *bucket);
+
+// store the packs still open and stop the pack thread
+void ct_pack_destroy(void);
+
+bool ct_pack_enabled(void);
+
+// size below which a file is packed
+size_t ct_pack_threshold(void);
+
+// copy size bytes of src_fd into the open pack
+// on success the pack owns the action, it calls ct_action_done once the
+// pack is stored, the caller must not report the action itself
+// on error nothing is kept and the caller archives the file as usual
+int ct_pack_add(struct hsm_copyaction_private *hcp,
+                const struct hsm_action_item *hai, int src_fd, size_t size);
+
+// find the pack location of a FID, false when the FID is not packed
+bool ct_pack_lookup(const struct lu_fid *fid, struct ct_pack_rec *rec);
+
+// forget a packed FID, the bytes stay in the pack object
+// the tombstone is stored as an index object first
+int ct_pack_remove(const struct lu_fid *fid);
+
+// read the index objects stored since the last sync, by this agent or
+// others, into the local index, a no-op when the last sync is recent
+int ct_pack_sync(void);
@@ -0,0 +1,640 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "ct_pool.h"
+#include "tlog.h"
+
+// worker pool module used to dispatch HSM actions
+// a fixed number of worker threads is created once at startup and fed from
+// bounded multi-producer/multi-consumer queues, so no thread is created or
+// destroyed per action, and per worker state stays warm between actions
+//
+// every action class has its own queue, so a backlog of archives never
+// delays restores: restores are served first (strictly, or weighted when
+// restore_weight is set so archives still make progress), and
+// restore_reserve workers are kept for restores only
+//
+// archives are split in a small and a large lane by file size, the large
+// lane may use at most large_max workers so multi-TB transfers cannot hold
+// every worker for hours, and the small lane is served shortest job first
+//
+// queues are binary min-heaps on slot->key, FIFO lanes use the arrival
+// sequence as key
+//
+// on top of the worker count, an action is admitted by what it costs in
+// bytes on the wire, buffer memory and transfers, so many small files or
+// a few huge ones both fill the node without oversubscribing it, the head
+// of the class picked next waits until it fits and nothing overtakes it
+//
+// a worker sleeping before a retry parks, it gives back its slot and the
+// cost of its action and a spare worker thread takes its place, spares
+// exit once idle and no longer needed, the parked action resumes ahead of
+// the queued ones as soon as it fits again
+
+struct ct_pool_queue {
+    struct ct_pool_slot  *slots;
+    struct ct_pool_slot  *free;
+    struct ct_pool_slot **heap;
+    int                   count;
+    int                   running;
+    uint64_t              seq;
+};
+
+static struct ct_worker     *pool_workers;
+static int                   pool_nworkers;
+static ct_pool_fn            pool_process;
+static struct ct_pool_params pool_params;
+
+static struct ct_pool_queue  pool_queues[CT_CLASS_MAX];
+// restores served in a row while other classes were waiting
+static int                   pool_restore_streak;
+// next non-restore class to look at, archive lanes and remove take turns
+static int                   pool_other_next = CT_CLASS_ARCHIVE_SMALL;
+static bool                  pool_shutdown;
+// actions queued or running, the workers read it to exit on shutdown
+static int                   pool_pending;
+// actions allowed to run at once, 0 for every worker
+static int                   pool_limit;
+// summed cost of the admitted actions
+static struct ct_pool_cost   pool_admitted;
+// worker threads alive, spares included
+static int                   pool_threads;
+// workers parked, and parked ones waiting to resume
+static int                   pool_parked;
+static int                   pool_unparking;
+static int                   pool_spare_id;
+
+static pthread_mutex_t       pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t        pool_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t        pool_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t        pool_exited = PTHREAD_COND_INITIALIZER;
+
+static __thread struct ct_worker *worker_self;
+
+static const char *ct_pool_class_name[CT_CLASS_MAX] = {
+    "restore", "small archive", "large archive", "remove"
+};
+
+struct ct_worker *ct_worker_self(void)
+{
+    return worker_self;
+}
+
+static enum ct_pool_class ct_pool_classify(const struct hsm_action_item *hai,
+                                           size_t size)
+{
+    switch (hai->hai_action) {
+    case HSMA_RESTORE:
+    case HSMA_CANCEL:
+        return CT_CLASS_RESTORE;
+    case HSMA_ARCHIVE:
+        return (size >= pool_params.large_size) ?
+               CT_CLASS_ARCHIVE_LARGE : CT_CLASS_ARCHIVE_SMALL;
+    default:
+        return CT_CLASS_REMOVE;
+    }
+}
+
+// queue order key, shortest job first with aging for small archives,
+// arrival order for everything else
+// must hold pool_mutex
+static uint64_t ct_pool_key(struct ct_pool_queue *queue,
+                            enum ct_pool_class cls, size_t size)
+{
+    uint64_t seq = queue->seq++;
+
+    if (cls != CT_CLASS_ARCHIVE_SMALL)
+        return seq;
+
+    // power of two size class, so files of similar size stay in order
+    int size_class = 0;
+    while (size >>= 1)
+        size_class++;
+
+    return seq + (uint64_t)size_class * CT_POOL_SJF_AGING;
+}
+
+// must hold pool_mutex
+static void ct_pool_heap_push(struct ct_pool_queue *queue,
+                              struct ct_pool_slot *slot)
+{
+    int i = queue->count++;
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (queue->heap[parent]->key <= slot->key)
+            break;
+        queue->heap[i] = queue->heap[parent];
+        i = parent;
+    }
+    queue->heap[i] = slot;
+}
+
+// must hold pool_mutex
+static struct ct_pool_slot *ct_pool_heap_pop(struct ct_pool_queue *queue)
+{
+    struct ct_pool_slot *top = queue->heap[0];
+    struct ct_pool_slot *last = queue->heap[--queue->count];
+    int i = 0;
+
+    while (true) {
+        int child = 2 * i + 1;
+        if (child >= queue->count)
+            break;
+        if (child + 1 < queue->count &&
+            queue->heap[child + 1]->key < queue->heap[child]->key)
+            child++;
+        if (last->key <= queue->heap[child]->key)
+            break;
+        queue->heap[i] = queue->heap[child];
+        i = child;
+    }
+    queue->heap[i] = last;
+
+    return top;
+}
+
+// whether cost fits next to the admitted actions, a resource nothing
+// holds takes any cost so an action above a limit still runs alone
+// must hold pool_mutex
+static bool ct_pool_admits(const struct ct_pool_cost *cost)
+{
+    if (pool_params.admit_bytes && pool_admitted.bytes &&
+        pool_admitted.bytes + cost->bytes > pool_params.admit_bytes)
+        return false;
+    if (pool_params.admit_memory && pool_admitted.memory &&
+        pool_admitted.memory + cost->memory > pool_params.admit_memory)
+        return false;
+    if (pool_params.admit_transfers && pool_admitted.transfers &&
+        pool_admitted.transfers + cost->transfers > pool_params.admit_transfers)
+        return false;
+    return true;
+}
+
+// must hold pool_mutex
+static void ct_pool_admit(const struct ct_pool_cost *cost, int sign)
+{
+    pool_admitted.bytes += sign * cost->bytes;
+    pool_admitted.memory += sign * cost->memory;
+    pool_admitted.transfers += sign * cost->transfers;
+}
+
+// must hold pool_mutex
+static bool ct_pool_head_admits(int cls)
+{
+    return ct_pool_admits(&pool_queues[cls].heap[0]->cost);
+}
+
+// workers allowed to run actions now
+// must hold pool_mutex
+static int ct_pool_limit(void)
+{
+    if (pool_limit > 0 && pool_limit < pool_params.nworkers)
+        return pool_limit;
+    return pool_params.nworkers;
+}
+
+// must hold pool_mutex
+static bool ct_pool_other_eligible(int cls)
+{
+    int others_running = 0;
+    int limit = ct_pool_limit();
+    // the reserve shrinks with the limit, other classes keep one worker
+    int reserve = (pool_params.restore_reserve < limit) ?
+                  pool_params.restore_reserve : limit - 1;
+
+    for (int i = CT_CLASS_RESTORE + 1; i < CT_CLASS_MAX; i++)
+        others_running += pool_queues[i].running;
+
+    if (pool_queues[cls].count == 0)
+        return false;
+
+    if (cls == CT_CLASS_ARCHIVE_LARGE &&
+        pool_queues[cls].running >= pool_params.large_max)
+        return false;
+
+    return others_running + pool_queues[CT_CLASS_RESTORE].running < limit &&
+           others_running < limit - reserve;
+}
+
+// must hold pool_mutex
+static int ct_pool_running(void)
+{
+    int running = 0;
+
+    for (int i = 0; i < CT_CLASS_MAX; i++)
+        running += pool_queues[i].running;
+
+    return running;
+}
+
+// pick the class the next worker serves, -1 when nothing can run
+// must hold pool_mutex
+static int ct_pool_pick(void)
+{
+    const int nothers = CT_CLASS_MAX - 1;
+    int other = -1;
+
+    for (int i = 0; i < nothers; i++) {
+        int cls = 1 + (pool_other_next - 1 + i) % nothers;
+        if (ct_pool_other_eligible(cls)) {
+            other = cls;
+            break;
+        }
+    }
+
+    if (pool_queues[CT_CLASS_RESTORE].count > 0 && ct_pool_running() < ct_pool_limit()) {
+        if (other < 0 || pool_params.restore_weight == 0 ||
+            pool_restore_streak < pool_params.restore_weight) {
+            if (!ct_pool_head_admits(CT_CLASS_RESTORE))
+                return -1;
+            if (other >= 0)
+                pool_restore_streak++;
+            return CT_CLASS_RESTORE;
+        }
+    }
+
+    // the lane stays next until its head fits
+    if (other >= 0 && !ct_pool_head_admits(other))
+        return -1;
+
+    if (other >= 0) {
+        pool_restore_streak = 0;
+        pool_other_next = 1 + other % nothers;
+    }
+
+    return other;
+}
+
+int ct_pool_pending(void)
+{
+    return __atomic_load_n(&pool_pending, __ATOMIC_SEQ_CST);
+}
+
+void ct_pool_set_limit(int limit)
+{
+    pthread_mutex_lock(&pool_mutex);
+    pool_limit = limit;
+    pthread_mutex_unlock(&pool_mutex);
+
+    // workers may be allowed to run more actions now
+    pthread_cond_broadcast(&pool_not_empty);
+}
+
+static void *ct_pool_worker(void *data);
+
+// start a spare worker in place of a parked one, at most nworkers spares
+// must hold pool_mutex
+static void ct_pool_spare_start(void)
+{
+    if (pool_shutdown || pool_threads - pool_parked >= pool_params.nworkers ||
+        pool_threads >= 2 * pool_params.nworkers)
+        return;
+
+    struct ct_worker *worker = calloc(1, sizeof(*worker));
+    if (worker == NULL)
+        return;
+    worker->id = pool_spare_id++;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&worker->thread, &attr, ct_pool_worker, worker);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        tlog_warn("cannot create spare worker thread: %s", strerror(rc));
+        free(worker);
+        return;
+    }
+    pool_threads++;
+}
+
+void ct_pool_park(void)
+{
+    if (worker_self == NULL)
+        return;
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_queues[worker_self->cls].running--;
+    ct_pool_admit(&worker_self->cost, -1);
+    pool_parked++;
+    ct_pool_spare_start();
+    pthread_mutex_unlock(&pool_mutex);
+
+    pthread_cond_broadcast(&pool_not_empty);
+}
+
+void ct_pool_unpark(void)
+{
+    if (worker_self == NULL)
+        return;
+
+    // the action is half done already, it goes before the queued ones,
+    // but within the limit and the admission limits
+    pthread_mutex_lock(&pool_mutex);
+    pool_unparking++;
+    while (ct_pool_running() >= ct_pool_limit() || !ct_pool_admits(&worker_self->cost))
+        pthread_cond_wait(&pool_not_empty, &pool_mutex);
+    pool_unparking--;
+    pool_parked--;
+    pool_queues[worker_self->cls].running++;
+    ct_pool_admit(&worker_self->cost, 1);
+    pthread_mutex_unlock(&pool_mutex);
+
+    // the next parked worker or an idle one may go on
+    pthread_cond_broadcast(&pool_not_empty);
+}
+
+static void ct_pool_slot_release(struct ct_pool_slot *slot)
+{
+    struct ct_pool_queue *queue = &pool_queues[slot->cls];
+
+    if (slot->hai != (struct hsm_action_item *)slot->hai_buf)
+        free(slot->hai);
+    slot->hai = NULL;
+
+    pthread_mutex_lock(&pool_mutex);
+    slot->next_free = queue->free;
+    queue->free = slot;
+    pthread_mutex_unlock(&pool_mutex);
+    pthread_cond_broadcast(&pool_not_full);
+}
+
+static void *ct_pool_worker(void *data)
+{
+    struct ct_worker *worker = data;
+    worker_self = worker;
+
+    if (pool_params.buffer_size) {
+        worker->buffer = malloc(pool_params.buffer_size);
+        if (worker->buffer)
+            worker->buffer_size = pool_params.buffer_size;
+        else
+            tlog_warn("worker %d cannot allocate its bounce buffer", worker->id);
+    }
+
+    tlog_debug("worker %d started", worker->id);
+
+    bool spare = worker->id >= pool_params.nworkers;
+    pthread_mutex_lock(&pool_mutex);
+    while (true) {
+        // enough workers are not parked without this spare
+        if (spare && pool_threads - pool_parked > pool_params.nworkers)
+            break;
+
+        // parked actions resuming go first
+        int cls = pool_unparking ? -1 : ct_pool_pick();
+        if (cls < 0) {
+            if (pool_shutdown && ct_pool_pending() == 0)
+                break;
+            pthread_cond_wait(&pool_not_empty, &pool_mutex);
+            continue;
+        }
+
+        struct ct_pool_queue *queue = &pool_queues[cls];
+        struct ct_pool_slot *slot = ct_pool_heap_pop(queue);
+        queue->running++;
+        ct_pool_admit(&slot->cost, 1);
+        worker->cls = cls;
+        worker->cost = slot->cost;
+        pthread_mutex_unlock(&pool_mutex);
+
+        pool_process(slot->hai, slot->hal_flags);
+
+        pthread_mutex_lock(&pool_mutex);
+        queue->running--;
+        ct_pool_admit(&slot->cost, -1);
+        __atomic_sub_fetch(&pool_pending, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool_mutex);
+
+        ct_pool_slot_release(slot);
+
+        // a finished action may make a limited class eligible again,
+        // or allow the last workers to exit on shutdown
+        pthread_cond_broadcast(&pool_not_empty);
+        pthread_mutex_lock(&pool_mutex);
+    }
+    pool_threads--;
+    pthread_cond_broadcast(&pool_exited);
+    pthread_mutex_unlock(&pool_mutex);
+
+    free(worker->buffer);
+    worker->buffer = NULL;
+    worker->buffer_size = 0;
+
+    tlog_debug("worker %d exit", worker->id);
+    // spares are detached and own their state
+    if (spare)
+        free(worker);
+    return NULL;
+}
+
+static void ct_pool_free_queues(void)
+{
+    for (int cls = 0; cls < CT_CLASS_MAX; cls++) {
+        free(pool_queues[cls].slots);
+        free(pool_queues[cls].heap);
+        memset(&pool_queues[cls], 0, sizeof(pool_queues[cls]));
+    }
+}
+
+int ct_pool_init(const struct ct_pool_params *params, ct_pool_fn process)
+{
+    int rc;
+
+    assert(params && process);
+    assert(params->nworkers > 0 && params->depth > 0);
+
+    pool_params = *params;
+    if (pool_params.restore_reserve >= pool_params.nworkers) {
+        // archives must be able to run at all
+        pool_params.restore_reserve = pool_params.nworkers - 1;
+    }
+    if (pool_params.restore_reserve < 0)
+        pool_params.restore_reserve = 0;
+    if (pool_params.large_max <= 0)
+        pool_params.large_max = 1;
+
+    for (int cls = 0; cls < CT_CLASS_MAX; cls++) {
+        struct ct_pool_queue *queue = &pool_queues[cls];
+        queue->slots = calloc(params->depth, sizeof(*queue->slots));
+        queue->heap = calloc(params->depth, sizeof(*queue->heap));
+        if (queue->slots == NULL || queue->heap == NULL) {
+            ct_pool_free_queues();
+            return -ENOMEM;
+        }
+
+        queue->free = NULL;
+        for (int i = params->depth - 1; i >= 0; i--) {
+            queue->slots[i].cls = cls;
+            queue->slots[i].next_free = queue->free;
+            queue->free = &queue->slots[i];
+        }
+    }
+
+    pool_workers = calloc(params->nworkers, sizeof(*pool_workers));
+    if (pool_workers == NULL) {
+        ct_pool_free_queues();
+        return -ENOMEM;
+    }
+
+    pool_restore_streak = 0;
+    memset(&pool_admitted, 0, sizeof(pool_admitted));
+    pool_shutdown = false;
+    pool_process = process;
+    pool_threads = 0;
+    pool_parked = 0;
+    pool_unparking = 0;
+    pool_spare_id = params->nworkers;
+
+    for (pool_nworkers = 0; pool_nworkers < params->nworkers; pool_nworkers++) {
+        struct ct_worker *worker = &pool_workers[pool_nworkers];
+        worker->id = pool_nworkers;
+        pthread_mutex_lock(&pool_mutex);
+        pool_threads++;
+        pthread_mutex_unlock(&pool_mutex);
+        rc = pthread_create(&worker->thread, NULL, ct_pool_worker, worker);
+        if (rc != 0) {
+            pthread_mutex_lock(&pool_mutex);
+            pool_threads--;
+            pthread_mutex_unlock(&pool_mutex);
+            tlog_error("cannot create worker thread %d with error %s",
+                       pool_nworkers, strerror(rc));
+            ct_pool_destroy();
+            return -rc;
+        }
+    }
+
+    tlog_info("worker pool started with %d workers, queue depth %d, "
+              "%d workers reserved for restore, restore weight %d, "
+              "%d workers at most for archives of %zu bytes or more",
+              pool_nworkers, pool_params.depth, pool_params.restore_reserve,
+              pool_params.restore_weight, pool_params.large_max,
+              pool_params.large_size);
+    if (pool_params.admit_bytes || pool_params.admit_memory ||
+        pool_params.admit_transfers)
+        tlog_info("actions admitted up to %" PRIu64 " bytes in flight, %" PRIu64
+                  " bytes of buffers and %d transfers (0 for no limit)",
+                  pool_params.admit_bytes, pool_params.admit_memory,
+                  pool_params.admit_transfers);
+    return 0;
+}
+
+int ct_pool_submit(const struct hsm_action_item *hai, long hal_flags,
+                   size_t size, const struct ct_pool_cost *cost)
+{
+    enum ct_pool_class cls;
+    struct ct_pool_queue *queue;
+    struct ct_pool_slot *slot;
+
+    assert(hai);
+
+    cls = ct_pool_classify(hai, size);
+    queue = &pool_queues[cls];
+
+    pthread_mutex_lock(&pool_mutex);
+    if (queue->free == NULL && !pool_shutdown)
+        tlog_debug("%s queue is full, wait ......", ct_pool_class_name[cls]);
+    while (queue->free == NULL && !pool_shutdown)
+        pthread_cond_wait(&pool_not_full, &pool_mutex);
+
+    if (pool_shutdown) {
+        pthread_mutex_unlock(&pool_mutex);
+        return -ESHUTDOWN;
+    }
+
+    slot = queue->free;
+    queue->free = slot->next_free;
+    pthread_mutex_unlock(&pool_mutex);
+
+    // copy the action once, into the slot itself when it fits
+    if (hai->hai_len <= CT_POOL_HAI_SIZE) {
+        slot->hai = (struct hsm_action_item *)slot->hai_buf;
+    } else {
+        slot->hai = malloc(hai->hai_len);
+        if (slot->hai == NULL) {
+            slot->hai = (struct hsm_action_item *)slot->hai_buf;
+            ct_pool_slot_release(slot);
+            return -ENOMEM;
+        }
+    }
+    memcpy(slot->hai, hai, hai->hai_len);
+    slot->hal_flags = hal_flags;
+    if (cost)
+        slot->cost = *cost;
+    else
+        memset(&slot->cost, 0, sizeof(slot->cost));
+
+    pthread_mutex_lock(&pool_mutex);
+    slot->key = ct_pool_key(queue, cls, size);
+    ct_pool_heap_push(queue, slot);
+    __atomic_add_fetch(&pool_pending, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool_mutex);
+
+    // a worker waiting may not be allowed to take this class, wake all
+    pthread_cond_broadcast(&pool_not_empty);
+
+    return 0;
+}
+
+void ct_pool_drop_queued(ct_pool_fn fn)
+{
+    struct ct_pool_slot *dropped = NULL;
+    int count = 0;
+
+    pthread_mutex_lock(&pool_mutex);
+    for (int cls = 0; cls < CT_CLASS_MAX; cls++) {
+        struct ct_pool_queue *queue = &pool_queues[cls];
+        while (queue->count > 0) {
+            struct ct_pool_slot *slot = ct_pool_heap_pop(queue);
+            slot->next_free = dropped;
+            dropped = slot;
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (count)
+        tlog_info("%d queued actions dropped", count);
+
+    while (dropped) {
+        struct ct_pool_slot *slot = dropped;
+        dropped = slot->next_free;
+
+        fn(slot->hai, slot->hal_flags);
+        __atomic_sub_fetch(&pool_pending, 1, __ATOMIC_SEQ_CST);
+        ct_pool_slot_release(slot);
+    }
+
+    pthread_cond_broadcast(&pool_not_empty);
+}
+
+void ct_pool_destroy(void)
+{
+    pthread_mutex_lock(&pool_mutex);
+    pool_shutdown = true;
+    pthread_mutex_unlock(&pool_mutex);
+    pthread_cond_broadcast(&pool_not_empty);
+    pthread_cond_broadcast(&pool_not_full);
+
+    for (int i = 0; i < pool_nworkers; i++)
+        pthread_join(pool_workers[i].thread, NULL);
+
+    // spares are detached, wait for them to go
+    pthread_mutex_lock(&pool_mutex);
+    while (pool_threads > 0)
+        pthread_cond_wait(&pool_exited, &pool_mutex);
+    pthread_mutex_unlock(&pool_mutex);
+
+    free(pool_workers);
+    pool_workers = NULL;
+    pool_nworkers = 0;
+    ct_pool_free_queues();
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/lustre/lustre_fid.h>
+#include <lustre/lustreapi.h>
+
+// hsm_action_item copies up to this size live inside the preallocated queue
+// slot, bigger ones (rare, only with large hai_data) fall back to malloc
+#define CT_POOL_HAI_SIZE 1024
+
+// default worker bounce buffer size
+#define CT_BOUNCE_BUFFER_SIZE (4 * 1024 * 1024)
+
+typedef int (*ct_pool_fn)(struct hsm_action_item *hai, long hal_flags);
+
+// resources an action holds while it runs, an action is only started once
+// its cost fits the admission limits next to the actions already running
+struct ct_pool_cost {
+    // bytes the action keeps on the wire at once
+    uint64_t bytes;
+    // buffer memory of the action
+    uint64_t memory;
+    // S3 transfers the action runs at once
+    int transfers;
+};
+
+// scheduling classes, each one has its own queue
+// cancel is cheap and latency sensitive, it is queued with restore
+// archives are split by file size into two lanes
+enum ct_pool_class {
+    CT_CLASS_RESTORE = 0,
+    CT_CLASS_ARCHIVE_SMALL,
+    CT_CLASS_ARCHIVE_LARGE,
+    CT_CLASS_REMOVE,
+    CT_CLASS_MAX
+};
+
+// shortest job first aging for the small archive lane, a file is overtaken
+// by at most this many later arrivals per power of two it is bigger
+#define CT_POOL_SJF_AGING 256
+
+struct ct_pool_params {
+    // number of worker threads
+    int nworkers;
+    // queue depth of each class
+    int depth;
+    // workers only restores may use, other classes never take them
+    int restore_reserve;
+    // number of restores served in a row before a waiting archive/remove
+    // gets a worker, 0 means strict priority for restores
+    int restore_weight;
+    // archives of files with at least this size go to the large lane
+    size_t large_size;
+    // workers the large archive lane may use at most
+    int large_max;
+    // size of the bounce buffer each worker allocates once, 0 for none
+    size_t buffer_size;
+    // admission limits on the summed cost of the running actions, 0 for
+    // none, an action costing more than a limit runs when nothing else
+    // holds that resource
+    uint64_t admit_bytes;
+    uint64_t admit_memory;
+    int admit_transfers;
+};
+
+// per worker state, lives as long as the worker thread and is reused
+// between actions, so anything expensive to set up belongs here
+struct ct_worker {
+    int id;
+    pthread_t thread;
+    // bounce buffer for streaming transfers, owned by the worker
+    char *buffer;
+    size_t buffer_size;
+    // class and admitted cost of the action being processed
+    enum ct_pool_class cls;
+    struct ct_pool_cost cost;
+};
+
+// queue slot, an action is copied once into it by the dispatcher and
+// processed in place by the worker
+struct ct_pool_slot {
+    struct hsm_action_item *hai;
+    long hal_flags;
+    enum ct_pool_class cls;
+    // queue order, lowest first
+    uint64_t key;
+    struct ct_pool_cost cost;
+    char hai_buf[CT_POOL_HAI_SIZE];
+    struct ct_pool_slot *next_free;
+};
+
+// start the worker threads, each class queue holds params->depth actions
+int ct_pool_init(const struct ct_pool_params *params, ct_pool_fn process);
+
+// copy hai into a free slot of its class queue, blocks while that queue is
+// full, other classes are not affected
+// size is the file size for archives, it selects the lane and the order
+// inside the small lane, and is ignored for other actions
+// cost is checked against the admission limits, NULL for a free action
+int ct_pool_submit(const struct hsm_action_item *hai, long hal_flags,
+                   size_t size, const struct ct_pool_cost *cost);
+
+// number of actions queued or being processed
+int ct_pool_pending(void);
+
+// number of actions allowed to run at once, at most nworkers, restores
+// keep their reserve inside it, may be called at any time
+void ct_pool_set_limit(int limit);
+
+// take the actions not started yet out of the queues and hand each one to
+// fn, e.g. to give it back to the coordinator on shutdown
+void ct_pool_drop_queued(ct_pool_fn fn);
+
+// wake all workers, let them drain the queues and join them
+void ct_pool_destroy(void);
+
+// the calling worker waits (e.g. before a retry), its slot and the cost
+// of its action go to other actions until ct_pool_unpark, a spare worker
+// is started so the slot is used, no-op outside of a worker
+// ct_pool_unpark waits until the action fits again, before queued actions
+void ct_pool_park(void);
+void ct_pool_unpark(void);
+
+// worker state of the calling thread, NULL when not called from a worker
+struct ct_worker *ct_worker_self(void);
@@ -0,0 +1,184 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ct_retry.h"
+#include "ct_common.h"
+#include "ct_pool.h"
+#include "ct_cancel.h"
+#include "tlog.h"
+
+// retry policy module, see ct_retry.h
+
+static int             retry_max_delay_ms = CT_RETRY_MAX_DELAY_MS_DEFAULT;
+static double          retry_budget_max = CT_RETRY_BUDGET_DEFAULT;
+static double          retry_tokens = CT_RETRY_BUDGET_DEFAULT;
+static pthread_mutex_t retry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread unsigned int retry_seed;
+static __thread int          retry_hint_ms;
+
+void ct_retry_setup(int budget, int max_delay_ms)
+{
+    pthread_mutex_lock(&retry_mutex);
+    retry_budget_max = budget;
+    retry_tokens = budget;
+    retry_max_delay_ms = max_delay_ms;
+    pthread_mutex_unlock(&retry_mutex);
+
+    if (budget)
+        tlog_info("retry budget of %d, backoff up to %d ms", budget, max_delay_ms);
+    else
+        tlog_info("retry budget disabled, backoff up to %d ms", max_delay_ms);
+}
+
+void ct_retry_init(struct ct_retry *retry)
+{
+    retry->attempts = 0;
+    retry->delay_ms = 0;
+}
+
+enum ct_retry_class ct_retry_classify(S3Status status)
+{
+    switch (status) {
+    case S3StatusErrorSlowDown:
+    case S3StatusErrorServiceUnavailable:
+        return CT_RETRY_THROTTLE;
+    default:
+        return S3_status_is_retryable(status) ? CT_RETRY_TRANSIENT : CT_RETRY_FATAL;
+    }
+}
+
+static int ct_retry_rand(int low, int high)
+{
+    if (retry_seed == 0)
+        retry_seed = (unsigned int)(ct_now() * 1000000) ^ (unsigned int)pthread_self();
+    if (high <= low)
+        return low;
+    return low + rand_r(&retry_seed) % (high - low + 1);
+}
+
+static bool ct_retry_take_budget(void)
+{
+    bool ok = true;
+
+    pthread_mutex_lock(&retry_mutex);
+    if (retry_budget_max > 0) {
+        if (retry_tokens >= 1)
+            retry_tokens -= 1;
+        else
+            ok = false;
+    }
+    pthread_mutex_unlock(&retry_mutex);
+
+    return ok;
+}
+
+void ct_retry_success(void)
+{
+    pthread_mutex_lock(&retry_mutex);
+    if (retry_tokens < retry_budget_max) {
+        retry_tokens += CT_RETRY_REFILL;
+        if (retry_tokens > retry_budget_max)
+            retry_tokens = retry_budget_max;
+    }
+    pthread_mutex_unlock(&retry_mutex);
+}
+
+// decorrelated jitter, delay = random(base, 3 * previous delay)
+static int ct_retry_backoff(struct ct_retry *retry, int base_ms, int hint_ms)
+{
+    int prev = (retry->delay_ms > base_ms) ? retry->delay_ms : base_ms;
+    int high = (prev > retry_max_delay_ms / 3) ? retry_max_delay_ms : prev * 3;
+    int delay = ct_retry_rand(base_ms, high);
+
+    if (delay > retry_max_delay_ms)
+        delay = retry_max_delay_ms;
+    retry->delay_ms = delay;
+
+    // the server knows better, but is capped too
+    if (hint_ms > delay)
+        delay = (hint_ms < retry_max_delay_ms) ? hint_ms : retry_max_delay_ms;
+
+    return delay;
+}
+
+int ct_retry_next(struct ct_retry *retry, S3Status status, int hint_ms)
+{
+    enum ct_retry_class cls = ct_retry_classify(status);
+
+    if (cls == CT_RETRY_FATAL || retry->attempts >= CT_RETRY_ATTEMPTS)
+        return -1;
+
+    if (!ct_retry_take_budget()) {
+        tlog_warn("retry budget exhausted, give up on %s", S3_get_status_name(status));
+        return -1;
+    }
+
+    retry->attempts++;
+    return ct_retry_backoff(retry, (cls == CT_RETRY_THROTTLE) ?
+                           CT_RETRY_THROTTLE_BASE_MS : CT_RETRY_BASE_MS, hint_ms);
+}
+
+// sleep without holding a slot of the worker pool, a cancel of the
+// action cuts it short
+static void ct_retry_sleep(int delay_ms)
+{
+    ct_pool_park();
+    while (delay_ms > 0 && !ct_cancel_requested()) {
+        int slice = (delay_ms < CT_RETRY_SLICE_MS) ? delay_ms : CT_RETRY_SLICE_MS;
+        usleep(slice * 1000L);
+        delay_ms -= slice;
+    }
+    ct_pool_unpark();
+}
+
+bool ct_retry_should(struct ct_retry *retry, S3Status status)
+{
+    int hint_ms = retry_hint_ms;
+
+    retry_hint_ms = 0;
+    if (status == S3StatusOK || ct_cancel_requested())
+        return false;
+
+    int delay_ms = ct_retry_next(retry, status, hint_ms);
+    if (delay_ms < 0)
+        return false;
+
+    tlog_debug("retry %d after %s in %d ms", retry->attempts,
+               S3_get_status_name(status), delay_ms);
+    ct_retry_sleep(delay_ms);
+    return !ct_cancel_requested();
+}
+
+bool ct_retry_should_errno(struct ct_retry *retry, int rc)
+{
+    switch (rc) {
+    case 0:
+    case -ECANCELED:
+    case -ENOENT:
+    case -EINVAL:
+    case -EPERM:
+    case -EACCES:
+        return false;
+    default:
+        break;
+    }
+
+    if (retry->attempts >= CT_RETRY_ATTEMPTS || ct_cancel_requested())
+        return false;
+
+    retry->attempts++;
+    ct_retry_sleep(ct_retry_backoff(retry, CT_RETRY_BASE_MS, 0));
+    return true;
+}
+
+void ct_retry_set_hint(int hint_ms)
+{
+    retry_hint_ms = hint_ms;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+
+#include "libs3.h"
+
+// retry policy shared by every S3 and llapi retry loop
+// - errors are classified, permanent ones are never retried, throttling
+//   backs off from a longer base delay than other transient errors
+// - the delay grows exponentially with decorrelated jitter, so the threads
+//   retrying after a brownout do not come back in lockstep
+// - a delay hinted by the server (RetryAfter in the error details) is
+//   honoured as a lower bound
+// - S3 retries are paid from a process wide budget refilled by successful
+//   requests, an outage makes actions fail and go back to the coordinator
+//   instead of multiplying the load with retries
+// - a worker sleeping before a retry does not count against the pool limit
+
+#define CT_RETRY_ATTEMPTS 5
+#define CT_RETRY_BASE_MS 100
+#define CT_RETRY_THROTTLE_BASE_MS 1000
+#define CT_RETRY_MAX_DELAY_MS_DEFAULT 20000
+#define CT_RETRY_BUDGET_DEFAULT 100
+// budget tokens earned back by one successful request
+#define CT_RETRY_REFILL 0.1
+// a sleeping retry looks for a cancel of its action this often
+#define CT_RETRY_SLICE_MS 100
+
+enum ct_retry_class {
+    CT_RETRY_FATAL = 0,
+    CT_RETRY_TRANSIENT,
+    CT_RETRY_THROTTLE,
+};
+
+// retry state of one operation
+struct ct_retry {
+    int attempts;
+    int delay_ms;
+};
+
+// budget is the number of retries that may run back to back, 0 disables
+// the budget, max_delay_ms caps one backoff
+void ct_retry_setup(int budget, int max_delay_ms);
+
+void ct_retry_init(struct ct_retry *retry);
+
+enum ct_retry_class ct_retry_classify(S3Status status);
+
+// delay in ms before retrying an operation that ended with status, -1 when
+// it must not be retried, hint_ms is the server hint or 0
+int ct_retry_next(struct ct_retry *retry, S3Status status, int hint_ms);
+
+// for synchronous loops: false when status is final, otherwise sleep the
+// backoff and return true
+// the hint of the last ct_s3_engine_run of the calling thread is used
+bool ct_retry_should(struct ct_retry *retry, S3Status status);
+
+// same for llapi calls returning a negative errno
+bool ct_retry_should_errno(struct ct_retry *retry, int rc);
+
+// server hint of the last request of the calling thread
+void ct_retry_set_hint(int hint_ms);
+
+// account a successful S3 request, refills the budget
+void ct_retry_success(void);
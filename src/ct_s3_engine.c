@@ -0,0 +1,746 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <curl/curl.h>
+
+#include "ct_s3_engine.h"
+#include "ct_common.h"
+#include "ct_adapt.h"
+#include "ct_retry.h"
+#include "ct_breaker.h"
+#include "ct_endpoint.h"
+#include "ct_cancel.h"
+#include "tlog.h"
+
+// longest time an engine thread sleeps in curl_multi_wait while requests are
+// running, libs3/curl timers are honoured as well
+#define CT_S3_ENGINE_POLL_MS 100
+
+// deadlines assume a transfer may run this many times slower than the
+// recent average, and never plan for less than the floor rate
+#define CT_S3_RATE_SLACK 4
+#define CT_S3_RATE_FLOOR (256 * 1024)
+// only transfers of at least this size feed the throughput average
+#define CT_S3_RATE_MIN_BYTES (1024 * 1024)
+#define CT_S3_RATE_ALPHA 0.1
+// completing a multipart upload makes the server assemble the parts
+#define CT_S3_COMMIT_TIMEOUT_FACTOR 10
+
+struct ct_s3_engine {
+    int id;
+    pthread_t thread;
+    S3RequestContext *ctx;
+    // curl multi handle of ctx, known once libs3 set up the first request
+    CURLM *multi;
+    // wakes the engine thread up from its wait on new submissions
+    int wake_fd;
+    pthread_mutex_t mutex;
+    // submitted requests not issued yet, newest first
+    struct ct_s3_req *submitted;
+    // requests waiting for their retry delay, earliest due first
+    struct ct_s3_req *delayed;
+    bool stop;
+};
+
+static struct ct_s3_engine *engines;
+static int                  engine_count;
+static unsigned int         engine_next;
+
+static int                  engine_timeout_base_ms = CT_S3_TIMEOUT_BASE_MS_DEFAULT;
+static int                  engine_stall_timeout = CT_S3_STALL_TIMEOUT_DEFAULT;
+// bytes per second of recent transfers, 0 until the first sample
+static double               engine_rate;
+static pthread_mutex_t      engine_rate_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// request being issued by this engine thread, libs3 gives the curl setup
+// callback its context only
+static __thread struct ct_s3_req *engine_issuing;
+
+// seconds this engine thread spent blocked in file I/O of data callbacks
+static __thread double engine_io_time;
+static __thread double engine_io_start;
+
+void ct_s3_engine_io_begin(void)
+{
+    engine_io_start = ct_now();
+}
+
+void ct_s3_engine_io_end(void)
+{
+    engine_io_time += ct_now() - engine_io_start;
+}
+
+void ct_s3_engine_setup_timeouts(int timeout_base_ms, int stall_timeout)
+{
+    engine_timeout_base_ms = timeout_base_ms;
+    engine_stall_timeout = stall_timeout;
+
+    if (stall_timeout)
+        tlog_info("S3 request timeout %d ms plus transfer time, stall timeout %d s",
+                  timeout_base_ms, stall_timeout);
+    else
+        tlog_info("S3 request timeout %d ms plus transfer time, no stall timeout",
+                  timeout_base_ms);
+}
+
+static void ct_s3_rate_update(const struct ct_s3_req *req)
+{
+    double elapsed = ct_now() - req->start_time;
+
+    if (req->byte_count < CT_S3_RATE_MIN_BYTES || elapsed <= 0)
+        return;
+
+    double sample = req->byte_count / elapsed;
+    pthread_mutex_lock(&engine_rate_mutex);
+    if (engine_rate == 0)
+        engine_rate = sample;
+    else
+        engine_rate += CT_S3_RATE_ALPHA * (sample - engine_rate);
+    pthread_mutex_unlock(&engine_rate_mutex);
+}
+
+// timeout of a request sized at issue time, 0 for none
+static int ct_s3_timeout_ms(const struct ct_s3_req *req)
+{
+    if (req->timeout_ms != TIMEOUT_MS)
+        return req->timeout_ms;
+
+    switch (req->op) {
+    case CT_S3_HEAD:
+    case CT_S3_DELETE:
+    case CT_S3_MPU_INIT:
+    case CT_S3_MPU_ABORT:
+    case CT_S3_MPU_LIST:
+    case CT_S3_LIST:
+        return engine_timeout_base_ms;
+    case CT_S3_MPU_COMMIT:
+        return engine_timeout_base_ms * CT_S3_COMMIT_TIMEOUT_FACTOR;
+    default:
+        break;
+    }
+
+    // whole object get, the length is not known up front
+    if (req->byte_count == 0)
+        return 0;
+
+    pthread_mutex_lock(&engine_rate_mutex);
+    double rate = engine_rate / CT_S3_RATE_SLACK;
+    pthread_mutex_unlock(&engine_rate_mutex);
+    if (rate < CT_S3_RATE_FLOOR)
+        rate = CT_S3_RATE_FLOOR;
+
+    double timeout = engine_timeout_base_ms + req->byte_count * 1000.0 / rate;
+    return (timeout < INT_MAX) ? (int)timeout : INT_MAX;
+}
+
+// curl progress callback, aborts a transfer moving no byte for too long
+static int ct_s3_progress(void *data, curl_off_t dltotal, curl_off_t dlnow,
+                          curl_off_t ultotal, curl_off_t ulnow)
+{
+    struct ct_s3_req *req = data;
+    uint64_t bytes = dlnow + ulnow;
+    double now = ct_now();
+
+    if (req == NULL)
+        return 0;
+
+    if (ct_s3_req_aborted(req))
+        return 1;
+
+    if (engine_stall_timeout == 0 || req->op == CT_S3_MPU_COMMIT)
+        return 0;
+
+    if (bytes != req->progress_bytes) {
+        req->progress_bytes = bytes;
+        req->last_progress = now;
+        req->io_mark = engine_io_time;
+        return 0;
+    }
+
+    // the thread blocked in file I/O did not move this transfer either
+    if (now - req->last_progress - (engine_io_time - req->io_mark) <
+        engine_stall_timeout)
+        return 0;
+
+    tlog_warn("S3 request for '%s' stalled for %d s after %lu bytes, abort",
+              req->key ? req->key : "", engine_stall_timeout, bytes);
+    req->stalled = true;
+    return 1;
+}
+
+// called by libs3 for the curl handle of every request issued on an
+// engine context, handles are reused so the options are always set
+static S3Status ct_s3_setup_curl(void *curl_multi, void *curl_easy, void *data)
+{
+    struct ct_s3_engine *engine = data;
+    struct ct_s3_req *req = engine_issuing;
+
+    // waited on with poll semantics, no FD_SETSIZE bound on the sockets
+    engine->multi = curl_multi;
+
+    if (req) {
+        req->progress_bytes = 0;
+        req->last_progress = ct_now();
+        req->io_mark = engine_io_time;
+        req->stalled = false;
+    }
+
+    // watches for cancellation, and for stalls except on a multipart
+    // commit, the server may be silent for long while it assembles the parts
+    curl_easy_setopt(curl_easy, CURLOPT_XFERINFOFUNCTION, ct_s3_progress);
+    curl_easy_setopt(curl_easy, CURLOPT_XFERINFODATA, req);
+    curl_easy_setopt(curl_easy, CURLOPT_NOPROGRESS, req ? 0L : 1L);
+
+    return S3StatusOK;
+}
+
+// fail a request that is not issued through its own complete callback, so
+// its callback data sees the status, every handler starts with its
+// S3ResponseHandler
+static void ct_s3_interrupt(struct ct_s3_req *req)
+{
+    const S3ResponseHandler *handler = req->handler;
+    handler->completeCallback(S3StatusInterrupted, NULL, req->data);
+}
+
+// libs3 gives the callbacks of an abort no callback data, they are
+// forwarded to the handler of the request being issued
+static S3Status ct_s3_abort_properties(const S3ResponseProperties *properties,
+                                       void *data)
+{
+    const S3ResponseHandler *handler = engine_issuing->handler;
+    if (handler->propertiesCallback == NULL)
+        return S3StatusOK;
+    return handler->propertiesCallback(properties, engine_issuing->data);
+}
+
+static void ct_s3_abort_complete(S3Status status, const S3ErrorDetails *error,
+                                 void *data)
+{
+    const S3ResponseHandler *handler = engine_issuing->handler;
+    handler->completeCallback(status, error, engine_issuing->data);
+}
+
+static S3AbortMultipartUploadHandler engine_abort_handler = {
+    { &ct_s3_abort_properties, &ct_s3_abort_complete }
+};
+
+static void ct_s3_issue(struct ct_s3_req *req, S3RequestContext *ctx)
+{
+    if (ct_s3_req_aborted(req)) {
+        ct_s3_interrupt(req);
+        return;
+    }
+
+    const char *host;
+    req->endpoint = ct_endpoint_pick(&host);
+    if (req->endpoint >= 0)
+        req->bucket.hostName = host;
+
+    // endpoint down
+    if (!ct_breaker_allow(req->bucket.hostName)) {
+        ct_s3_interrupt(req);
+        return;
+    }
+
+    int timeout_ms = ct_s3_timeout_ms(req);
+    engine_issuing = req;
+
+    switch (req->op) {
+    case CT_S3_GET:
+        S3_get_object(&req->bucket, req->key, NULL, req->start_byte,
+                      req->byte_count, ctx, timeout_ms,
+                      (const S3GetObjectHandler *)req->handler, req->data);
+        break;
+    case CT_S3_HEAD:
+        S3_head_object(&req->bucket, req->key, ctx, timeout_ms,
+                       (const S3ResponseHandler *)req->handler, req->data);
+        break;
+    case CT_S3_PUT:
+        S3_put_object(&req->bucket, req->key, req->byte_count,
+                      req->put_properties, ctx, timeout_ms,
+                      (const S3PutObjectHandler *)req->handler, req->data);
+        break;
+    case CT_S3_DELETE:
+        S3_delete_object(&req->bucket, req->key, ctx, timeout_ms,
+                         (const S3ResponseHandler *)req->handler, req->data);
+        break;
+    case CT_S3_MPU_INIT:
+        S3_initiate_multipart(&req->bucket, req->key, req->put_properties,
+                              (S3MultipartInitialHandler *)req->handler,
+                              ctx, timeout_ms, req->data);
+        break;
+    case CT_S3_MPU_PART:
+        S3_upload_part(&req->bucket, req->key, req->put_properties,
+                       (S3PutObjectHandler *)req->handler, req->seq,
+                       req->upload_id, req->byte_count, ctx,
+                       timeout_ms, req->data);
+        break;
+    case CT_S3_MPU_COMMIT:
+        S3_complete_multipart_upload(&req->bucket, req->key,
+                                     (S3MultipartCommitHandler *)req->handler,
+                                     req->upload_id, req->byte_count, ctx,
+                                     timeout_ms, req->data);
+        break;
+    case CT_S3_MPU_ABORT:
+        S3_abort_multipart_upload(&req->bucket, req->key, req->upload_id,
+                                  timeout_ms, &engine_abort_handler);
+        break;
+    case CT_S3_MPU_LIST:
+        S3_list_multipart_uploads(&req->bucket, NULL, req->marker, req->upload_id,
+                                  NULL, NULL, req->max_keys, ctx, timeout_ms,
+                                  (const S3ListMultipartUploadsHandler *)req->handler,
+                                  req->data);
+        break;
+    case CT_S3_LIST:
+        S3_list_bucket(&req->bucket, req->key, req->marker, NULL,
+                       req->max_keys, ctx, timeout_ms,
+                       (const S3ListBucketHandler *)req->handler, req->data);
+        break;
+    default:
+        tlog_error("unknown S3 request op %d", req->op);
+        ct_s3_req_complete(req, S3StatusInternalError, NULL);
+    }
+
+    engine_issuing = NULL;
+}
+
+static struct ct_s3_engine *ct_s3_engine_next(void)
+{
+    unsigned int idx = __atomic_fetch_add(&engine_next, 1, __ATOMIC_RELAXED);
+    return &engines[idx % engine_count];
+}
+
+static void ct_s3_engine_wake(struct ct_s3_engine *engine)
+{
+    uint64_t one = 1;
+
+    if (write(engine->wake_fd, &one, sizeof(one)) != sizeof(one))
+        tlog_warn("failed to wake S3 engine %d: %s", engine->id, strerror(errno));
+}
+
+// issue every submitted request on the engine context
+// returns false when the engine was asked to stop
+static bool ct_s3_engine_issue_submitted(struct ct_s3_engine *engine)
+{
+    struct ct_s3_req *list, *fifo = NULL;
+    bool stop;
+
+    pthread_mutex_lock(&engine->mutex);
+    list = engine->submitted;
+    engine->submitted = NULL;
+    stop = engine->stop;
+    // delayed requests now due are issued with the submitted ones
+    double now = ct_now();
+    while (engine->delayed && engine->delayed->due <= now) {
+        struct ct_s3_req *req = engine->delayed;
+        engine->delayed = req->next;
+        req->next = list;
+        list = req;
+    }
+    // and the ones of cancelled actions, they fail when issued
+    for (struct ct_s3_req **pos = &engine->delayed; *pos; ) {
+        struct ct_s3_req *req = *pos;
+        if (!ct_cancel_flag_set(req->abort)) {
+            pos = &req->next;
+            continue;
+        }
+        *pos = req->next;
+        req->next = list;
+        list = req;
+    }
+    pthread_mutex_unlock(&engine->mutex);
+
+    // submitted list is newest first, issue in submission order
+    while (list) {
+        struct ct_s3_req *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+
+    while (fifo) {
+        struct ct_s3_req *req = fifo;
+        fifo = fifo->next;
+        req->next = NULL;
+        req->start_time = ct_now();
+        ct_s3_issue(req, engine->ctx);
+    }
+
+    return !stop;
+}
+
+static void *ct_s3_engine_thread(void *arg)
+{
+    struct ct_s3_engine *engine = arg;
+    int remaining = 0;
+
+    tlog_debug("S3 engine %d started", engine->id);
+
+    while (true) {
+        bool running = ct_s3_engine_issue_submitted(engine);
+
+        S3Status status = S3_runonce_request_context(engine->ctx, &remaining);
+        if (status != S3StatusOK)
+            tlog_error("S3 engine %d failed to run requests: %s", engine->id,
+                       S3_get_status_name(status));
+
+        if (!running && remaining == 0) {
+            pthread_mutex_lock(&engine->mutex);
+            bool idle = (engine->submitted == NULL && engine->delayed == NULL);
+            bool submitted = (engine->submitted != NULL);
+            pthread_mutex_unlock(&engine->mutex);
+            if (idle)
+                break;
+            // delayed retries still wait for their time
+            if (submitted)
+                continue;
+        }
+
+        // wait for socket activity, a curl timer or a new submission
+        int64_t timeout_ms = -1;
+        if (remaining) {
+            timeout_ms = S3_get_request_context_timeout(engine->ctx);
+            if (timeout_ms < 0 || timeout_ms > CT_S3_ENGINE_POLL_MS)
+                timeout_ms = CT_S3_ENGINE_POLL_MS;
+        }
+        pthread_mutex_lock(&engine->mutex);
+        if (engine->delayed) {
+            int64_t due_ms = (engine->delayed->due - ct_now()) * 1000 + 1;
+            if (due_ms < 0)
+                due_ms = 0;
+            if (timeout_ms < 0 || due_ms < timeout_ms)
+                timeout_ms = due_ms;
+        }
+        pthread_mutex_unlock(&engine->mutex);
+
+        bool woken = false;
+        if (remaining && engine->multi) {
+            struct curl_waitfd wake = {
+                .fd = engine->wake_fd,
+                .events = CURL_WAIT_POLLIN,
+            };
+            CURLMcode mc = curl_multi_wait(engine->multi, &wake, 1,
+                                           (int)timeout_ms, NULL);
+            if (mc != CURLM_OK)
+                tlog_error("S3 engine %d wait failed: %s", engine->id,
+                           curl_multi_strerror(mc));
+            woken = (wake.revents != 0);
+        } else {
+            struct pollfd wake = {
+                .fd = engine->wake_fd,
+                .events = POLLIN,
+            };
+            if (poll(&wake, 1, (int)timeout_ms) < 0 && errno != EINTR)
+                tlog_error("S3 engine %d poll failed: %s", engine->id,
+                           strerror(errno));
+            woken = (wake.revents & POLLIN) != 0;
+        }
+
+        if (woken) {
+            uint64_t count;
+            if (read(engine->wake_fd, &count, sizeof(count)) < 0 &&
+                errno != EAGAIN) {
+                tlog_warn("S3 engine %d failed to read wake fd: %s",
+                          engine->id, strerror(errno));
+            }
+        }
+    }
+
+    tlog_debug("S3 engine %d exit", engine->id);
+    return NULL;
+}
+
+int ct_s3_engine_init(int nthreads)
+{
+    int rc;
+
+    assert(nthreads > 0);
+
+    engines = calloc(nthreads, sizeof(*engines));
+    if (engines == NULL)
+        return -ENOMEM;
+
+    for (engine_count = 0; engine_count < nthreads; engine_count++) {
+        struct ct_s3_engine *engine = &engines[engine_count];
+        engine->id = engine_count;
+
+        S3Status status = S3_create_request_context_ex(&engine->ctx, NULL,
+                                                       ct_s3_setup_curl, engine);
+        if (status != S3StatusOK) {
+            tlog_error("cannot create S3 request context: %s",
+                       S3_get_status_name(status));
+            rc = -ENOMEM;
+            goto err_destroy;
+        }
+
+        engine->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (engine->wake_fd < 0) {
+            rc = -errno;
+            tlog_error("cannot create S3 engine wake fd: %s", strerror(errno));
+            S3_destroy_request_context(engine->ctx);
+            goto err_destroy;
+        }
+
+        pthread_mutex_init(&engine->mutex, NULL);
+        rc = pthread_create(&engine->thread, NULL, ct_s3_engine_thread, engine);
+        if (rc != 0) {
+            tlog_error("cannot create S3 engine thread: %s", strerror(rc));
+            rc = -rc;
+            pthread_mutex_destroy(&engine->mutex);
+            close(engine->wake_fd);
+            S3_destroy_request_context(engine->ctx);
+            goto err_destroy;
+        }
+    }
+
+    tlog_info("S3 engine started with %d threads", engine_count);
+    return 0;
+
+err_destroy:
+    ct_s3_engine_destroy();
+    return rc;
+}
+
+void ct_s3_engine_destroy(void)
+{
+    for (int i = 0; i < engine_count; i++) {
+        struct ct_s3_engine *engine = &engines[i];
+        pthread_mutex_lock(&engine->mutex);
+        engine->stop = true;
+        pthread_mutex_unlock(&engine->mutex);
+        ct_s3_engine_wake(engine);
+    }
+
+    for (int i = 0; i < engine_count; i++) {
+        struct ct_s3_engine *engine = &engines[i];
+        pthread_join(engine->thread, NULL);
+        pthread_mutex_destroy(&engine->mutex);
+        close(engine->wake_fd);
+        S3_destroy_request_context(engine->ctx);
+    }
+
+    free(engines);
+    engines = NULL;
+    engine_count = 0;
+}
+
+void ct_s3_req_init(struct ct_s3_req *req, enum ct_s3_op op,
+                    const S3BucketContext *bucket, const char *key,
+                    const void *handler, void *data)
+{
+    memset(req, 0, sizeof(*req));
+    req->op = op;
+    req->bucket = *bucket;
+    req->key = key;
+    req->handler = handler;
+    req->data = data;
+    req->timeout_ms = TIMEOUT_MS;
+    req->status = S3StatusOK;
+    req->endpoint = -1;
+    req->abort = ct_cancel_flag();
+}
+
+bool ct_s3_req_aborted(const struct ct_s3_req *req)
+{
+    return __atomic_load_n(&req->cancelled, __ATOMIC_RELAXED) ||
+           ct_cancel_flag_set(req->abort);
+}
+
+void ct_s3_engine_kick(void)
+{
+    for (int i = 0; i < engine_count; i++)
+        ct_s3_engine_wake(&engines[i]);
+}
+
+void ct_s3_engine_submit(struct ct_s3_req *req)
+{
+    struct ct_s3_engine *engine;
+
+    assert(req && engine_count > 0);
+
+    engine = ct_s3_engine_next();
+    req->engine = engine;
+
+    pthread_mutex_lock(&engine->mutex);
+    req->next = engine->submitted;
+    engine->submitted = req;
+    pthread_mutex_unlock(&engine->mutex);
+
+    ct_s3_engine_wake(engine);
+}
+
+void ct_s3_engine_submit_delayed(struct ct_s3_req *req, int delay_ms)
+{
+    struct ct_s3_engine *engine;
+    struct ct_s3_req **pos;
+
+    assert(req && engine_count > 0);
+
+    if (delay_ms <= 0) {
+        ct_s3_engine_submit(req);
+        return;
+    }
+
+    engine = ct_s3_engine_next();
+    req->engine = engine;
+    req->due = ct_now() + delay_ms / 1000.0;
+
+    pthread_mutex_lock(&engine->mutex);
+    for (pos = &engine->delayed; *pos && (*pos)->due <= req->due; pos = &(*pos)->next)
+        ;
+    req->next = *pos;
+    *pos = req;
+    pthread_mutex_unlock(&engine->mutex);
+
+    ct_s3_engine_wake(engine);
+}
+
+// must hold engine->mutex
+static bool ct_s3_engine_unlink(struct ct_s3_req **list, struct ct_s3_req *req)
+{
+    for (struct ct_s3_req **pos = list; *pos; pos = &(*pos)->next) {
+        if (*pos == req) {
+            *pos = req->next;
+            req->next = NULL;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ct_s3_engine_cancel(struct ct_s3_req *req)
+{
+    struct ct_s3_engine *engine = req->engine;
+    bool unlinked = false;
+
+    __atomic_store_n(&req->cancelled, true, __ATOMIC_RELAXED);
+    if (engine == NULL)
+        return false;
+
+    pthread_mutex_lock(&engine->mutex);
+    unlinked = ct_s3_engine_unlink(&engine->delayed, req) ||
+               ct_s3_engine_unlink(&engine->submitted, req);
+    pthread_mutex_unlock(&engine->mutex);
+
+    if (unlinked)
+        ct_s3_interrupt(req);
+
+    return unlinked;
+}
+
+S3Status ct_s3_engine_run(struct ct_s3_req *req)
+{
+    struct ct_s3_group group;
+
+    ct_s3_group_init(&group);
+    ct_s3_group_add(&group, req);
+    ct_s3_engine_submit(req);
+    ct_s3_group_wait(&group, 0);
+    ct_s3_group_destroy(&group);
+
+    // for ct_retry_should of the calling thread
+    ct_retry_set_hint(req->retry_after_ms);
+
+    return req->status;
+}
+
+// retry delay hinted in the error details, there is no access to the
+// Retry-After header through libs3, S3 compatible servers sending a hint
+// put it in the error document
+static int ct_s3_retry_hint(const S3ErrorDetails *error)
+{
+    if (error == NULL)
+        return 0;
+
+    for (int i = 0; i < error->extraDetailsCount; i++) {
+        const char *name = error->extraDetails[i].name;
+        if (name && (strcasecmp(name, "RetryAfter") == 0 ||
+                     strcasecmp(name, "RetryAfterSeconds") == 0)) {
+            int seconds = atoi(error->extraDetails[i].value);
+            return (seconds > 0) ? seconds * 1000 : 0;
+        }
+    }
+
+    return 0;
+}
+
+void ct_s3_req_complete(struct ct_s3_req *req, S3Status status,
+                        const S3ErrorDetails *error)
+{
+    // req may be freed by its owner once the group is signaled
+    struct ct_s3_group *group = req->group;
+
+    // an aborted stall is a timeout, an aborted cancel an interruption,
+    // whatever curl made of it
+    if (ct_s3_req_aborted(req) && status != S3StatusOK)
+        status = S3StatusInterrupted;
+    else if (req->stalled && status != S3StatusOK)
+        status = S3StatusErrorRequestTimeout;
+
+    ct_endpoint_done(req->endpoint);
+    req->endpoint = -1;
+
+    req->status = status;
+    req->retry_after_ms = ct_s3_retry_hint(error);
+    if (status == S3StatusOK) {
+        ct_retry_success();
+        ct_s3_rate_update(req);
+    }
+    ct_breaker_record(req->bucket.hostName, status);
+    // a request rejected by the breaker says nothing about latency
+    if (status != S3StatusInterrupted)
+        ct_adapt_observe(status, req->byte_count, ct_now() - req->start_time);
+    if (req->done && !req->done(req))
+        return;
+
+    if (group)
+        ct_s3_group_done(group);
+}
+
+void ct_s3_group_init(struct ct_s3_group *group)
+{
+    pthread_mutex_init(&group->mutex, NULL);
+    pthread_cond_init(&group->cond, NULL);
+    group->outstanding = 0;
+}
+
+void ct_s3_group_destroy(struct ct_s3_group *group)
+{
+    pthread_mutex_destroy(&group->mutex);
+    pthread_cond_destroy(&group->cond);
+}
+
+void ct_s3_group_add(struct ct_s3_group *group, struct ct_s3_req *req)
+{
+    req->group = group;
+    pthread_mutex_lock(&group->mutex);
+    group->outstanding++;
+    pthread_mutex_unlock(&group->mutex);
+}
+
+void ct_s3_group_done(struct ct_s3_group *group)
+{
+    pthread_mutex_lock(&group->mutex);
+    group->outstanding--;
+    pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&group->mutex);
+}
+
+void ct_s3_group_wait(struct ct_s3_group *group, int limit)
+{
+    pthread_mutex_lock(&group->mutex);
+    while (group->outstanding > limit)
+        pthread_cond_wait(&group->cond, &group->mutex);
+    pthread_mutex_unlock(&group->mutex);
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "libs3.h"
+
+// S3 transfer engine
+// a handful of engine threads each own a libs3 S3RequestContext (a curl
+// multi handle) and drive every request submitted to them with
+// S3_runonce_request_context, so in flight transfers do not pin a thread
+//
+// a request is described by a struct ct_s3_req, the libs3 callbackData of
+// the request must carry a pointer to it, and the complete callback of the
+// request must call ct_s3_req_complete, this is how completions flow back
+// to the HSM action waiting for them
+
+// the data callbacks of a transfer read and write the Lustre file with
+// pread/pwrite on the engine thread (libs3 cannot pause a transfer until a
+// worker filled a buffer), a slow OST therefore holds up every transfer of
+// that thread, the engine is sized from the worker count so few transfers
+// share a thread, and the time a thread spends in file I/O does not count
+// as a stall of the other transfers
+#define CT_S3_ENGINE_THREADS_MIN 4
+#define CT_S3_ENGINE_WORKERS_PER_THREAD 8
+
+// transfer deadlines
+// a request with a known length gets timeout_base_ms plus the time its bytes
+// take at a pessimistic fraction of the throughput seen lately, a request
+// moving no byte for stall_timeout seconds is aborted and fails with a
+// retryable status whatever its deadline, whole object reads of unknown
+// length only have the stall watchdog
+#define CT_S3_TIMEOUT_BASE_MS_DEFAULT 30000
+#define CT_S3_STALL_TIMEOUT_DEFAULT 60
+
+enum ct_s3_op {
+    CT_S3_GET = 0,
+    CT_S3_HEAD,
+    CT_S3_PUT,
+    CT_S3_DELETE,
+    CT_S3_MPU_INIT,
+    CT_S3_MPU_PART,
+    CT_S3_MPU_COMMIT,
+    // libs3 runs an abort synchronously on the engine thread, bounded by
+    // its deadline, neither the stall watchdog nor a cancel stop it
+    CT_S3_MPU_ABORT,
+    CT_S3_MPU_LIST,
+    CT_S3_LIST,
+};
+
+// completion counter for a set of requests, the action submitting them
+// waits on it
+struct ct_s3_group {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int outstanding;
+};
+
+struct ct_s3_req;
+struct ct_s3_engine;
+
+// called on the engine thread when the request completes, return false
+// when the request was submitted again (retry) and is not finished yet
+typedef bool (*ct_s3_done_fn)(struct ct_s3_req *req);
+
+struct ct_s3_req {
+    enum ct_s3_op op;
+    // private copy, so a request may be sent to its own host or bucket,
+    // the engine sets the host when endpoints are registered
+    S3BucketContext bucket;
+    const char *key;
+    // byte range for get, content length for put and part
+    uint64_t start_byte;
+    uint64_t byte_count;
+    // multipart upload part number and id, upload id marker of a listing
+    int seq;
+    const char *upload_id;
+    // listing, key is the prefix of CT_S3_LIST
+    const char *marker;
+    int max_keys;
+    S3PutProperties *put_properties;
+    // libs3 handler matching op, and its callbackData
+    const void *handler;
+    void *data;
+    // TIMEOUT_MS to derive it from the transfer size at issue time
+    int timeout_ms;
+
+    // completion
+    S3Status status;
+    // retry delay hinted by the server, 0 when none
+    int retry_after_ms;
+    // not issued before this time, delayed submissions only
+    double due;
+    ct_s3_done_fn done;
+    void *arg;
+    struct ct_s3_group *group;
+    double start_time;
+    // stall watchdog, engine thread only
+    uint64_t progress_bytes;
+    double last_progress;
+    // file I/O time of the engine thread at last_progress
+    double io_mark;
+    bool stalled;
+    // set by ct_s3_engine_cancel, an issued request is aborted by the engine
+    bool cancelled;
+    // cancellation flag of the action preparing the request, see ct_cancel.h
+    const bool *abort;
+    struct ct_s3_engine *engine;
+    // endpoint picked at issue time, -1 while not issued
+    int endpoint;
+    struct ct_s3_req *next;
+};
+
+// call before ct_s3_engine_init, stall_timeout 0 disables the watchdog
+void ct_s3_engine_setup_timeouts(int timeout_base_ms, int stall_timeout);
+
+// file I/O of a data callback, see CT_S3_ENGINE_THREADS_MIN
+void ct_s3_engine_io_begin(void);
+void ct_s3_engine_io_end(void);
+
+int ct_s3_engine_init(int nthreads);
+
+// let the engine threads finish every submitted request and stop them
+void ct_s3_engine_destroy(void);
+
+// prepare a request, the caller fills op specific fields afterwards
+void ct_s3_req_init(struct ct_s3_req *req, enum ct_s3_op op,
+                    const S3BucketContext *bucket, const char *key,
+                    const void *handler, void *data);
+
+// hand a request to an engine thread, returns immediately
+void ct_s3_engine_submit(struct ct_s3_req *req);
+
+// hand a request to an engine thread, issued once delay_ms elapsed, the
+// calling thread does not wait
+void ct_s3_engine_submit_delayed(struct ct_s3_req *req, int delay_ms);
+
+// cancel a submitted request, it completes with S3StatusInterrupted
+// returns true when it was not issued yet, its completion then ran on the
+// calling thread, otherwise the transfer is aborted by its engine thread
+// and completes there shortly, unless it completes on its own first
+bool ct_s3_engine_cancel(struct ct_s3_req *req);
+
+// submit a request and wait for its completion
+S3Status ct_s3_engine_run(struct ct_s3_req *req);
+
+// the request or its action was cancelled, it must not go on
+bool ct_s3_req_aborted(const struct ct_s3_req *req);
+
+// wake every engine thread, requests of cancelled actions waiting for a
+// delayed retry are then failed at once
+void ct_s3_engine_kick(void);
+
+// must be called by the libs3 complete callback of every engine request
+void ct_s3_req_complete(struct ct_s3_req *req, S3Status status,
+                        const S3ErrorDetails *error);
+
+void ct_s3_group_init(struct ct_s3_group *group);
+void ct_s3_group_destroy(struct ct_s3_group *group);
+
+// count req in group, call before ct_s3_engine_submit
+void ct_s3_group_add(struct ct_s3_group *group, struct ct_s3_req *req);
+
+// one request of the group finished, for a request whose done function
+// returned false and that is finished by other means
+void ct_s3_group_done(struct ct_s3_group *group);
+
+// wait until at most limit requests of the group are outstanding
+void ct_s3_group_wait(struct ct_s3_group *group, int limit);
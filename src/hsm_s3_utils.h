@@ -17,12 +17,19 @@ typedef struct UploadManager {
     char *upload_id;
 
     // used for upload part object
+    // parts complete out of order, etags[seq - 1] is set by the part itself
     char **etags;
-    int next_etags_pos;
+    int parts_total;
+    int parts_done;
 
     // used for commit Upload
     growbuffer *gb;
     int remaining;
+    // ETag of the committed object without quotes
+    char etag[ ETAG_ASCII ];
+
+    // engine request for initial and commit
+    struct ct_s3_req *req;
 } UploadManager;
 
 typedef struct MultipartPartData {
@@ -36,7 +43,7 @@ static S3ResponseHandler getResponseHandler = {
                          &s3_get_response_complete_callback };
 
 static S3ResponseHandler putResponseHandler = {
-                         &s3_response_properties_callback,
+                         &s3_response_put_object_properties_callback,
                          &s3_put_response_complete_callback };
 
 static S3ResponseHandler deleteResponseHandler = {
@@ -93,6 +100,15 @@ static S3MultipartCommitHandler commitMultipartHandler = {
     // --> Curl_client_write --> chop_write --> curl_write_func --> request_headers_done
     // --> commitMultipartPropertiesCallback --> multipart_response_complete_callback
     &multipart_commit_response_callback,
-    NULL
+    // called with the ETag of the whole object once the commit succeeded
+    &multipart_commit_etag_callback
+};
+
+// callback data is a del_object_callback_data, an abort is a delete
+static S3AbortMultipartUploadHandler abortMultipartHandler = {
+    {
+        &s3_response_properties_callback,
+        &s3_del_response_complete_callback
+    }
 };
 
@@ -62,6 +62,7 @@
 #include <errno.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <time.h>
 #include <unistd.h>
 #include <utime.h>
@@ -78,6 +79,7 @@
 #include <bsd/string.h> /* To get strlcpy */
 #include <sys/resource.h>
 #include <limits.h>
+#include <inttypes.h>
 
 #include "lhsmtool_s3.h"
 #include "ct_common.h"
@@ -85,13 +87,126 @@
 #include "growbuffer.h"
 #include "hsm_s3_utils.h"
 #include "mem_quota.h"
+#include "ct_s3_engine.h"
+#include "ct_pool.h"
+#include "ct_pack.h"
+#include "ct_mpu_journal.h"
+#include "ct_adapt.h"
+#include "ct_retry.h"
+#include "ct_breaker.h"
+#include "ct_hedge.h"
+#include "ct_endpoint.h"
+#include "ct_fid_cache.h"
+#include "ct_obj_index.h"
+#include "ct_delete_queue.h"
+#include "ct_mpu_reaper.h"
+#include "ct_cancel.h"
 
 char access_key[S3_MAX_KEY_SIZE];
 char secret_key[S3_MAX_KEY_SIZE];
 char host[S3_MAX_HOSTNAME_SIZE];
 char bucket_name[S3_MAX_BUCKET_NAME_SIZE];
+
+// objects are sharded over bucket_count buckets named <bucket_prefix>_<id>
+// by a hash of their lustre FID, bucket_name keeps the objects archived
+// before sharding (read from it when missing in the shard) and the packs
+static int bucket_count = 1;
+static char bucket_prefix[S3_MAX_BUCKET_NAME_SIZE - 16];
+static char (*bucket_shards)[S3_MAX_BUCKET_NAME_SIZE];
+static int bucket_dual_read = 1;
+
+// object keys, the path under path_prefix, or the FID so no action needs
+// a path lookup, FID keys may start with a hash to spread them over the
+// index partitions of the object store
+#define CT_KEY_MODE_PATH 0
+#define CT_KEY_MODE_FID 1
+static int object_key_mode = CT_KEY_MODE_PATH;
+static int key_hash_prefix = 1;
+// FID keyed objects and their path when archived, for humans, empty for none
+static char key_index_path[PATH_MAX];
+static int key_index_fd = -1;
 char path_prefix[PATH_MAX];
 
+// number of threads driving S3 requests, 0 sizes it from max_requests
+static int s3_engine_threads = 0;
+
+// multipart upload parts in flight, per object and for the whole copytool
+#define MPU_PARTS_PER_OBJECT 4
+#define MPU_PARTS_TOTAL 64
+static int mpu_parts_per_object = MPU_PARTS_PER_OBJECT;
+static int mpu_parts_total = MPU_PARTS_TOTAL;
+static sem_t mpu_part_sem;
+
+// parallel restore, ranged GETs in flight per object and restore bytes in
+// flight for the whole copytool, restore_streams of 1 restores sequentially
+#define RESTORE_STREAMS 4
+#define RESTORE_INFLIGHT_BYTES (256 * 1024 * 1024L)
+static int restore_streams = RESTORE_STREAMS;
+static long long restore_inflight_bytes = RESTORE_INFLIGHT_BYTES;
+static uint64_t restore_budget_used;
+static pthread_mutex_t restore_budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t restore_budget_cond = PTHREAD_COND_INITIALIZER;
+
+// memory quota of the pack buffers, mem_quota_timeout of 0 waits as long
+// as needed, a pack allocation timing out archives the file alone
+static long long mem_quota_size = CT_MEM_QUOTA_SIZE;
+static int mem_quota_timeout = 0;
+
+// small file packing, off by default
+static int pack_enabled;
+static struct ct_pack_params pack_params = {
+    .threshold = CT_PACK_THRESHOLD_DEFAULT,
+    .pack_size = CT_PACK_SIZE_DEFAULT,
+    .window = CT_PACK_WINDOW_DEFAULT,
+    .index_path = CT_PACK_INDEX_DEFAULT,
+    .prefix = CT_PACK_PREFIX_DEFAULT,
+};
+static char pack_index_path[PATH_MAX];
+static char pack_prefix[CT_PACK_KEY_MAX / 2];
+
+// retries of S3 requests in a row the copytool may do, and longest backoff
+static int retry_budget = CT_RETRY_BUDGET_DEFAULT;
+static int retry_max_delay_ms = CT_RETRY_MAX_DELAY_MS_DEFAULT;
+
+// circuit breaker of the S3 endpoint
+static int breaker_failures = CT_BREAKER_FAILURES_DEFAULT;
+static int breaker_open_ms = CT_BREAKER_OPEN_MS_DEFAULT;
+
+// S3 request deadlines
+static int request_timeout_base_ms = CT_S3_TIMEOUT_BASE_MS_DEFAULT;
+static int stall_timeout = CT_S3_STALL_TIMEOUT_DEFAULT;
+
+// hedged range GETs of parallel restores
+static int hedge_percentile = CT_HEDGE_PERCENTILE_DEFAULT;
+static int hedge_budget_percent = CT_HEDGE_BUDGET_PERCENT_DEFAULT;
+
+// adaptive concurrency, max_requests is the ceiling
+static int adaptive_concurrency = 1;
+static int adaptive_min_requests = 1;
+static double adaptive_latency_tolerance = CT_ADAPT_TOLERANCE_DEFAULT;
+
+// journal of multipart uploads in progress, empty to disable
+static char mpu_journal_dir[PATH_MAX] = CT_MPU_JOURNAL_DIR_DEFAULT;
+
+// stale multipart uploads, mpu_reap_age of 0 disables the reaper
+static int mpu_reap_age = CT_MPU_REAP_AGE_DEFAULT;
+static int mpu_reap_interval = CT_MPU_REAP_INTERVAL_DEFAULT;
+static int mpu_reap_rate = CT_MPU_REAP_RATE_DEFAULT;
+
+// FID to path cache, fid_cache_size of 0 disables it
+static int fid_cache_size = CT_FID_CACHE_SIZE_DEFAULT;
+static int fid_cache_ttl = CT_FID_CACHE_TTL_DEFAULT;
+static int fid_cache_negative_ttl = CT_FID_CACHE_NEGATIVE_TTL_DEFAULT;
+
+// local index of archived objects, an empty obj_index_path disables it
+static char obj_index_path[PATH_MAX] = CT_OBJ_INDEX_PATH_DEFAULT;
+static long long obj_index_capacity = CT_OBJ_INDEX_CAPACITY_DEFAULT;
+
+// deferred removes, an empty remove_spool_dir makes them synchronous
+static char remove_spool_dir[PATH_MAX] = CT_DELETE_QUEUE_DIR_DEFAULT;
+static int remove_batch_size = CT_DELETE_BATCH_DEFAULT;
+static int remove_batch_window = CT_DELETE_WINDOW_DEFAULT;
+
 S3BucketContext bucketContext = {
     host,
     bucket_name,
@@ -103,30 +218,55 @@ S3BucketContext bucketContext = {
 
 #define RANGE_GET_ENABLED 1
 
+// the ranges of a restore may be planned from the size rec recorded, the
+// ETag of the first range then tells whether the object is still that one
+static bool ct_obj_rec_usable(const struct ct_obj_rec *rec)
+{
+    return rec && rec->state == CT_OBJ_LIVE && rec->etag[0] != '\0' && rec->size > 0;
+}
+
+// the object GET from S3 is the one rec describes, the first 32 characters
+// of the ETag were kept by the GET
+static bool ct_obj_rec_matches(const struct ct_obj_rec *rec,
+                               const get_object_callback_data *data)
+{
+    return ct_obj_rec_usable(rec) && strncmp(rec->etag, data->md5, MD5_ASCII - 1) == 0;
+}
+
 #ifndef RANGE_GET_ENABLED
-static int get_s3_object(char *objectName, get_object_callback_data *data,
-                         S3GetObjectHandler *getObjectHandler) {
+static int get_s3_object(const char *bucket, char *objectName,
+                         get_object_callback_data *data,
+                         S3GetObjectHandler *getObjectHandler,
+                         const struct ct_obj_rec *rec) {
 
     assert(objectName && data && getObjectHandler);
 
     // Get a local copy of the general bucketContext than overwrite the
-    // pointer to the bucket_name
+    // pointer to the bucket name
     S3BucketContext localbucketContext;
     memcpy(&localbucketContext, &bucketContext, sizeof(S3BucketContext));
-    localbucketContext.bucketName = bucket_name;
+    localbucketContext.bucketName = bucket;
+
+    (void) rec;
 
     double before_s3_get = ct_now();
-    int retry_count = RETRYCOUNT;
+    struct ct_retry retry;
+    ct_retry_init(&retry);
     uint64_t startByte = 0, byteCount = 0;
 
     do {
-        // always seek to offset (0), otherwise retry will lead to data corruption
-        lseek(data->fd, 0, SEEK_SET);
-
-        S3_get_object(&localbucketContext, objectName, NULL, startByte, byteCount, NULL, 0,
-                      getObjectHandler, data);
-    } while (S3_status_is_retryable(data->status) &&
-             should_retry(&retry_count));
+        // always write from offset (0), otherwise retry will lead to data corruption
+        data->file_offset = 0;
+
+        struct ct_s3_req req;
+        ct_s3_req_init(&req, CT_S3_GET, &localbucketContext, objectName,
+                       getObjectHandler, data);
+        req.start_byte = startByte;
+        req.byte_count = byteCount;
+        data->req = &req;
+        ct_s3_engine_run(&req);
+        data->req = NULL;
+    } while (ct_retry_should(&retry, data->status));
 
     tlog_info("S3 get of %s took %fs", objectName, ct_now() - before_s3_get);
 
@@ -138,26 +278,47 @@ static int get_s3_object(char *objectName, get_object_callback_data *data,
     return 0;
 }
 #else
-static int get_s3_object(char *objectName, get_object_callback_data *data,
-                         S3GetObjectHandler *getObjectHandler) {
+static int get_s3_object(const char *bucket, char *objectName,
+                         get_object_callback_data *data,
+                         S3GetObjectHandler *getObjectHandler,
+                         const struct ct_obj_rec *rec) {
 
     assert(objectName && data && getObjectHandler);
 
     // Get a local copy of the general bucketContext than overwrite the
-    // pointer to the bucket_name
+    // pointer to the bucket name
     S3BucketContext localbucketContext;
     memcpy(&localbucketContext, &bucketContext, sizeof(S3BucketContext));
-    localbucketContext.bucketName = bucket_name;
+    localbucketContext.bucketName = bucket;
 
     double before_s3_get = ct_now();
-    int retry_count = RETRYCOUNT;
+    struct ct_retry retry;
+    ct_retry_init(&retry);
     uint64_t startByte = 0, byteCount = CHUNK_SIZE;
+    // size from the index, unknown once the first range showed another object
+    uint64_t known_size = ct_obj_rec_usable(rec) ? rec->size : UINT64_MAX;
 
     do {
-        lseek(data->fd, startByte, SEEK_SET);
-        S3_get_object(&localbucketContext, objectName, NULL, startByte, byteCount, NULL, 0,
-                      getObjectHandler, data);
+        data->file_offset = startByte;
+        byteCount = (known_size - startByte < CHUNK_SIZE) ? known_size - startByte :
+                                                            CHUNK_SIZE;
+
+        struct ct_s3_req req;
+        ct_s3_req_init(&req, CT_S3_GET, &localbucketContext, objectName,
+                       getObjectHandler, data);
+        req.start_byte = startByte;
+        req.byte_count = byteCount;
+        data->req = &req;
+        ct_s3_engine_run(&req);
+        data->req = NULL;
+
         if (data->status == S3StatusOK) {
+            if (startByte == 0 && known_size != UINT64_MAX &&
+                !ct_obj_rec_matches(rec, data)) {
+                tlog_info("'%s' is not the object of the index, get it to its end",
+                          objectName);
+                known_size = UINT64_MAX;
+            }
             data->totalLength += data->contentLength;
             if (byteCount != data->contentLength) {
                 tlog_debug("process file %s complete", data->file_path);
@@ -165,13 +326,18 @@ static int get_s3_object(char *objectName, get_object_callback_data *data,
             } else {
                 startByte += byteCount;
             }
+            // spare the GET answered with InvalidRange at the end
+            if (startByte >= known_size) {
+                tlog_debug("process file %s complete", data->file_path);
+                break;
+            }
         } else if (data->status == S3StatusErrorInvalidRange) {
             // startByte out of object size
             tlog_debug("process file %s complete", data->file_path);
             data->status = S3StatusOK;
             break;
         } else {
-            if (S3_status_is_retryable(data->status) && should_retry(&retry_count)) {
+            if (ct_retry_should(&retry, data->status)) {
                 continue;
             } else {
                 break;
@@ -190,6 +356,426 @@ static int get_s3_object(char *objectName, get_object_callback_data *data,
 }
 #endif
 
+// get byte_count bytes of an object at start_byte, written at offset 0 of
+// data->fd
+static int get_s3_range(char *objectName, uint64_t start_byte, uint64_t byte_count,
+                        get_object_callback_data *data,
+                        S3GetObjectHandler *getObjectHandler) {
+
+    assert(objectName && data && getObjectHandler);
+
+    S3BucketContext localbucketContext;
+    memcpy(&localbucketContext, &bucketContext, sizeof(S3BucketContext));
+    localbucketContext.bucketName = bucket_name;
+
+    double before_s3_get = ct_now();
+    struct ct_retry retry;
+    ct_retry_init(&retry);
+
+    do {
+        data->file_offset = 0;
+
+        struct ct_s3_req req;
+        ct_s3_req_init(&req, CT_S3_GET, &localbucketContext, objectName,
+                       getObjectHandler, data);
+        req.start_byte = start_byte;
+        req.byte_count = byte_count;
+        data->req = &req;
+        ct_s3_engine_run(&req);
+        data->req = NULL;
+    } while (ct_retry_should(&retry, data->status));
+
+    if (data->status == S3StatusOK && data->file_offset != byte_count) {
+        tlog_error("short get of '%s' range %lu+%lu, got %zu bytes", objectName,
+                   start_byte, byte_count, data->file_offset);
+        return -EIO;
+    }
+
+    tlog_info("S3 get of %s range %lu+%lu took %fs", objectName, start_byte,
+              byte_count, ct_now() - before_s3_get);
+
+    if (data->status != S3StatusOK) {
+        tlog_error("S3Error %s", S3_get_status_name(data->status));
+        return -EIO;
+    }
+
+    data->contentLength = byte_count;
+    return 0;
+}
+
+// one range of a parallel restore in flight
+struct ct_get_range {
+    get_object_callback_data data;
+    struct ct_s3_req req;
+    uint64_t start;
+    struct ct_retry retry;
+    // set when any range of the object failed for good
+    bool *failed;
+    // duplicate request of a hedged range, it writes the same bytes at the
+    // same offsets
+    get_object_callback_data hedge_data;
+    struct ct_s3_req hedge_req;
+    bool hedged;
+    // requests of the range not completed yet, the range leaves the group
+    // when the last one completes
+    int inflight;
+    // outcome known, by the first request to succeed or the last to fail
+    bool resolved;
+    // ETag of the index record the ranges were planned from, NULL when the
+    // size was asked to S3
+    const char *etag;
+    // set when a range came from another object than the record
+    bool *stale;
+    struct ct_s3_group *group;
+};
+
+// state of hedged ranges, completions of both requests race on engine
+// threads
+static pthread_mutex_t range_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// wait a bit on cond, a cancel of the action is noticed in between
+static void ct_cond_wait_slice(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += CT_RETRY_SLICE_MS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+// process wide bound of restore bytes in flight, false when the action
+// was cancelled while waiting
+static bool ct_restore_budget_acquire(uint64_t bytes)
+{
+    pthread_mutex_lock(&restore_budget_mutex);
+    // a single range bigger than the budget still goes alone
+    while (restore_budget_used > 0 &&
+           restore_budget_used + bytes > (uint64_t)restore_inflight_bytes) {
+        if (ct_cancel_requested()) {
+            pthread_mutex_unlock(&restore_budget_mutex);
+            return false;
+        }
+        ct_cond_wait_slice(&restore_budget_cond, &restore_budget_mutex);
+    }
+    restore_budget_used += bytes;
+    pthread_mutex_unlock(&restore_budget_mutex);
+    return true;
+}
+
+static void ct_restore_budget_release(uint64_t bytes)
+{
+    pthread_mutex_lock(&restore_budget_mutex);
+    restore_budget_used -= bytes;
+    pthread_cond_broadcast(&restore_budget_cond);
+    pthread_mutex_unlock(&restore_budget_mutex);
+}
+
+static bool ct_get_range_complete(struct ct_get_range *range, struct ct_s3_req *req,
+                                  get_object_callback_data *data)
+{
+    if (req->status != S3StatusOK ||
+        data->file_offset != range->start + req->byte_count)
+        return false;
+
+    // the object was replaced since it was indexed, no range of it is
+    // worth a retry
+    if (range->etag && strncmp(range->etag, data->md5, MD5_ASCII - 1) != 0) {
+        pthread_mutex_lock(&range_mutex);
+        *range->stale = true;
+        *range->failed = true;
+        pthread_mutex_unlock(&range_mutex);
+        return false;
+    }
+
+    return true;
+}
+
+// one request of the range is done, true when it was the last
+// the request finishing counts in inflight until here, so the range stays
+// alive while it cancels the other one
+static bool ct_get_range_put(struct ct_get_range *range)
+{
+    pthread_mutex_lock(&range_mutex);
+    bool last = (--range->inflight == 0);
+    if (last && !range->resolved) {
+        // neither request succeeded
+        range->resolved = true;
+        *range->failed = true;
+    }
+    pthread_mutex_unlock(&range_mutex);
+
+    if (last)
+        ct_restore_budget_release(range->req.byte_count);
+    return last;
+}
+
+// engine completion of a range, runs on an engine thread
+static bool ct_get_range_done(struct ct_s3_req *req)
+{
+    struct ct_get_range *range = req->arg;
+    bool ok = ct_get_range_complete(range, req, &range->data);
+
+    pthread_mutex_lock(&range_mutex);
+    bool resolved = range->resolved;
+    if (ok && !resolved)
+        range->resolved = true;
+    bool hedged = range->hedged;
+    pthread_mutex_unlock(&range_mutex);
+
+    if (ok || resolved) {
+        if (ok && !resolved) {
+            if (req->byte_count == CHUNK_SIZE)
+                ct_hedge_observe(ct_now() - req->start_time);
+            // the hedge lost, or was not sent yet
+            if (hedged && ct_s3_engine_cancel(&range->hedge_req))
+                ct_hedge_refund();
+        }
+        return ct_get_range_put(range);
+    }
+
+    tlog_error("failed to get range %lu+%lu of '%s' with rc '%d'",
+               range->start, req->byte_count, req->key, req->status);
+
+    // a short range is retried, even if the status looks fine
+    S3Status status = (req->status == S3StatusOK) ? S3StatusErrorRequestTimeout :
+                                                    req->status;
+    int delay_ms = *range->failed ? -1 :
+                   ct_retry_next(&range->retry, status, req->retry_after_ms);
+    if (delay_ms >= 0) {
+        // rewrite the whole range at its own offset
+        range->data.file_offset = range->start;
+        range->data.status = S3StatusOK;
+        ct_s3_engine_submit_delayed(req, delay_ms);
+        return false;
+    }
+
+    // a hedge still in flight may save the range
+    return ct_get_range_put(range);
+}
+
+// engine completion of a hedge, it is not retried
+static bool ct_get_hedge_done(struct ct_s3_req *req)
+{
+    struct ct_get_range *range = req->arg;
+    bool ok = ct_get_range_complete(range, req, &range->hedge_data);
+
+    pthread_mutex_lock(&range_mutex);
+    bool won = ok && !range->resolved;
+    if (won)
+        range->resolved = true;
+    pthread_mutex_unlock(&range_mutex);
+
+    if (won) {
+        tlog_info("hedge of range %lu+%lu of '%s' won", range->start,
+                  req->byte_count, req->key);
+        ct_s3_engine_cancel(&range->req);
+    }
+
+    // the primary is not in flight any more, the range leaves the group here
+    if (ct_get_range_put(range))
+        ct_s3_group_done(range->group);
+    return true;
+}
+
+// arm a hedge of a range about to be submitted, it is sent unless the range
+// completes before the hedge delay
+static void ct_get_range_hedge(struct ct_get_range *range)
+{
+    int delay_ms = ct_hedge_delay_ms();
+    if (delay_ms < 0)
+        return;
+
+    range->hedge_data.fd = range->data.fd;
+    range->hedge_data.file_path = range->data.file_path;
+    range->hedge_data.file_offset = range->start;
+    range->hedge_data.req = &range->hedge_req;
+
+    ct_s3_req_init(&range->hedge_req, CT_S3_GET, &range->req.bucket,
+                   range->req.key, range->req.handler, &range->hedge_data);
+    range->hedge_req.start_byte = range->req.start_byte;
+    range->hedge_req.byte_count = range->req.byte_count;
+    range->hedge_req.done = ct_get_hedge_done;
+    range->hedge_req.arg = range;
+
+    pthread_mutex_lock(&range_mutex);
+    range->hedged = true;
+    range->inflight++;
+    pthread_mutex_unlock(&range_mutex);
+
+    // round robin puts it on another engine context than the primary when
+    // there are several, so on another connection, and the primary counts
+    // against its own endpoint when the hedge picks one
+    ct_s3_engine_submit_delayed(&range->hedge_req, delay_ms);
+}
+
+// restore an object with up to restore_streams ranged GETs in flight, each
+// range is written with pwrite at its own offset of data->fd
+static int get_s3_object_parallel(const char *bucket, char *objectName,
+                                  get_object_callback_data *data,
+                                  S3GetObjectHandler *getObjectHandler,
+                                  const struct ct_obj_rec *rec) {
+
+    assert(objectName && data && getObjectHandler);
+
+    // Get a local copy of the general bucketContext than overwrite the
+    // pointer to the bucket name
+    S3BucketContext localbucketContext;
+    memcpy(&localbucketContext, &bucketContext, sizeof(S3BucketContext));
+    localbucketContext.bucketName = bucket;
+
+    double before_s3_get = ct_now();
+    struct ct_retry retry;
+    ct_retry_init(&retry);
+    struct ct_s3_req req;
+
+    // object size for planning the ranges, and offset of the first range
+    // still to get
+    uint64_t object_size;
+    uint64_t first_start;
+
+    if (ct_obj_rec_usable(rec)) {
+        // every range at once, the first one to complete checks the ETag
+        object_size = rec->size;
+        first_start = 0;
+    } else {
+        // the first range alone, a small object is then restored with one
+        // GET and without asking for its size
+        do {
+            data->file_offset = 0;
+            ct_s3_req_init(&req, CT_S3_GET, &localbucketContext, objectName,
+                           getObjectHandler, data);
+            req.start_byte = 0;
+            req.byte_count = CHUNK_SIZE;
+            data->req = &req;
+            ct_s3_engine_run(&req);
+            data->req = NULL;
+        } while (ct_retry_should(&retry, data->status));
+
+        if (data->status == S3StatusErrorInvalidRange) {
+            // empty object
+            data->status = S3StatusOK;
+            data->contentLength = 0;
+            return 0;
+        }
+
+        if (data->status != S3StatusOK) {
+            tlog_error("S3Error %s", S3_get_status_name(data->status));
+            return -EIO;
+        }
+
+        data->totalLength = data->contentLength;
+        if (data->contentLength < CHUNK_SIZE) {
+            tlog_info("S3 get of %s took %fs", objectName, ct_now() - before_s3_get);
+            return 0;
+        }
+
+        get_object_callback_data head_data;
+        memset(&head_data, 0, sizeof(head_data));
+        ct_retry_init(&retry);
+        do {
+            ct_s3_req_init(&req, CT_S3_HEAD, &localbucketContext, objectName,
+                           &getObjectHandler->responseHandler, &head_data);
+            head_data.req = &req;
+            ct_s3_engine_run(&req);
+            head_data.req = NULL;
+        } while (ct_retry_should(&retry, head_data.status));
+
+        if (head_data.status != S3StatusOK) {
+            tlog_error("failed to get size of '%s', S3Error %s", objectName,
+                       S3_get_status_name(head_data.status));
+            return -EIO;
+        }
+
+        object_size = head_data.contentLength;
+        first_start = CHUNK_SIZE;
+    }
+    size_t nranges = (object_size - first_start + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    struct ct_get_range *ranges = calloc(nranges, sizeof(*ranges));
+    if (ranges == NULL)
+        return -ENOMEM;
+
+    struct ct_s3_group group;
+    ct_s3_group_init(&group);
+    bool range_failed = false;
+    bool range_stale = false;
+
+    for (size_t i = 0; i < nranges && !range_failed; i++) {
+        struct ct_get_range *range = &ranges[i];
+        uint64_t start = first_start + CHUNK_SIZE * i;
+        uint64_t count = (object_size - start > CHUNK_SIZE) ? CHUNK_SIZE :
+                                                              object_size - start;
+
+        range->data.fd = data->fd;
+        range->data.file_path = data->file_path;
+        range->data.file_offset = start;
+        range->data.req = &range->req;
+        range->start = start;
+        ct_retry_init(&range->retry);
+        range->failed = &range_failed;
+        range->etag = first_start == 0 ? rec->etag : NULL;
+        range->stale = &range_stale;
+        range->inflight = 1;
+        range->group = &group;
+
+        ct_s3_req_init(&range->req, CT_S3_GET, &localbucketContext, objectName,
+                       getObjectHandler, &range->data);
+        range->req.start_byte = start;
+        range->req.byte_count = count;
+        range->req.done = ct_get_range_done;
+        range->req.arg = range;
+
+        // per object streams, then process wide bytes in flight
+        ct_s3_group_wait(&group, restore_streams - 1);
+        if (!ct_restore_budget_acquire(count))
+            break;
+
+        ct_s3_group_add(&group, &range->req);
+        // armed first, the range must not complete before it counts the hedge
+        ct_get_range_hedge(range);
+        ct_s3_engine_submit(&range->req);
+    }
+
+    ct_s3_group_wait(&group, 0);
+    ct_s3_group_destroy(&group);
+    free(ranges);
+
+    tlog_info("S3 parallel get of %s (%lu bytes, %zu ranges) took %fs", objectName,
+              object_size, nranges + (first_start ? 1 : 0), ct_now() - before_s3_get);
+
+    if (ct_cancel_requested()) {
+        tlog_info("get of '%s' cancelled", objectName);
+        data->status = S3StatusInterrupted;
+        return -ECANCELED;
+    }
+
+    if (range_stale) {
+        tlog_info("'%s' is not the object of the index, get it without the index",
+                  objectName);
+        // the ranges already written may reach past the end of the object
+        if (ftruncate(data->fd, 0) < 0) {
+            tlog_error("cannot truncate '%s': %s", data->file_path, strerror(errno));
+            return -errno;
+        }
+        data->file_offset = 0;
+        data->status = S3StatusOK;
+        return get_s3_object_parallel(bucket, objectName, data, getObjectHandler, NULL);
+    }
+
+    if (range_failed) {
+        tlog_error("failed to get all ranges of '%s'", objectName);
+        data->status = S3StatusErrorRequestTimeout;
+        return -EIO;
+    }
+
+    data->totalLength = object_size;
+    data->contentLength = object_size;
+    return 0;
+}
+
 static void ct_opt_setup(struct ct_options *opt_ptr)
 {
     memset(opt_ptr, 0, sizeof(struct ct_options));
@@ -326,8 +912,36 @@ static int ct_parseopts(int argc, char *const *argv) {
         return -EINVAL;
     }
 
+    // several gateways serving the same buckets, host is then optional and
+    // the first one is the default host of libs3
+    config_setting_t *hosts = config_lookup(&cfg, "hosts");
+    if (hosts) {
+        config_setting_t *weights = config_lookup(&cfg, "host_weights");
+        int nhosts = config_setting_length(hosts);
+
+        if (weights && config_setting_length(weights) != nhosts) {
+            tlog_error("host_weights must have one weight per entry of hosts");
+            return -EINVAL;
+        }
+
+        for (int i = 0; i < nhosts; i++) {
+            const char *name = config_setting_get_string_elem(hosts, i);
+            int weight = weights ? config_setting_get_int_elem(weights, i) : 1;
+            rc = ct_endpoint_add(name, weight);
+            if (rc)
+                return rc;
+        }
+    }
+
     if (config_lookup_string(&cfg, "host", &config_str)) {
         strncpy(host, config_str, sizeof(host));
+        if (ct_endpoint_count() == 0) {
+            rc = ct_endpoint_add(host, 1);
+            if (rc)
+                return rc;
+        }
+    } else if (ct_endpoint_count() > 0) {
+        strncpy(host, ct_endpoint_first(), sizeof(host));
     } else {
         tlog_error("could not find host");
         return -EINVAL;
@@ -341,6 +955,61 @@ static int ct_parseopts(int argc, char *const *argv) {
         return -EINVAL;
     }
 
+    if (config_lookup_string(&cfg, "object_key_mode", &config_str)) {
+        if (strcmp(config_str, "path") == 0)
+            object_key_mode = CT_KEY_MODE_PATH;
+        else if (strcmp(config_str, "fid") == 0)
+            object_key_mode = CT_KEY_MODE_FID;
+        else {
+            tlog_error("invalid object_key_mode '%s' in config file, "
+                       "must be 'path' or 'fid'", config_str);
+            return -EINVAL;
+        }
+        tlog_debug("use object_key_mode of %s", config_str);
+    }
+
+    if (config_lookup_bool(&cfg, "key_hash_prefix", &key_hash_prefix)) {
+        tlog_debug("key hash prefix %s", key_hash_prefix ? "on" : "off");
+    }
+
+    if (config_lookup_string(&cfg, "key_index_path", &config_str)) {
+        strncpy(key_index_path, config_str, sizeof(key_index_path) - 1);
+        tlog_debug("use key_index_path of '%s'", key_index_path);
+    }
+
+    if (config_lookup_int(&cfg, "bucket_count", &bucket_count)) {
+        if (bucket_count > 0)
+            tlog_debug("use bucket_count of %d", bucket_count);
+        else {
+            tlog_error("invalid bucket_count value %d in config file", bucket_count);
+            return -EINVAL;
+        }
+    }
+
+    if (bucket_count > 1) {
+        if (config_lookup_string(&cfg, "bucket_prefix", &config_str) &&
+            strlen(config_str) < sizeof(bucket_prefix)) {
+            strncpy(bucket_prefix, config_str, sizeof(bucket_prefix) - 1);
+            tlog_debug("use bucket_prefix of %s", bucket_prefix);
+        } else {
+            tlog_error("bucket_count of %d needs a valid bucket_prefix", bucket_count);
+            return -EINVAL;
+        }
+
+        bucket_shards = calloc(bucket_count, sizeof(*bucket_shards));
+        if (bucket_shards == NULL)
+            return -ENOMEM;
+        for (int i = 0; i < bucket_count; i++)
+            snprintf(bucket_shards[i], sizeof(bucket_shards[i]), "%s_%d",
+                     bucket_prefix, i);
+
+        if (config_lookup_bool(&cfg, "bucket_dual_read", &bucket_dual_read))
+            tlog_debug("bucket dual read %s", bucket_dual_read ? "on" : "off");
+
+        tlog_info("objects sharded over %d buckets '%s_<id>'%s", bucket_count,
+                  bucket_prefix, bucket_dual_read ? ", falling back to bucket_name" : "");
+    }
+
     if (config_lookup_string(&cfg, "path_prefix", &config_str)) {
         strncpy(path_prefix, config_str, sizeof(path_prefix));
         tlog_debug("use path_prefix of %s", path_prefix);
@@ -373,52 +1042,418 @@ static int ct_parseopts(int argc, char *const *argv) {
         max_requests = MAX_HSM_REQUESTS;
     }
 
-    return 0;
-}
+    if (config_lookup_int(&cfg, "s3_engine_threads", &s3_engine_threads)) {
+        if (s3_engine_threads > 0)
+            tlog_debug("use s3_engine_threads of %d", s3_engine_threads);
+        else {
+            tlog_error("invalid s3_engine_threads value %d in config file",
+                       s3_engine_threads);
+            return -EINVAL;
+        }
+    }
 
-static void ct_dumpopts(int argc, char *const *argv) {
-    char opts_cmd[PATH_MAX];
+    if (config_lookup_int(&cfg, "mpu_parts_per_object", &mpu_parts_per_object)) {
+        if (mpu_parts_per_object > 0)
+            tlog_debug("use mpu_parts_per_object of %d", mpu_parts_per_object);
+        else {
+            tlog_error("invalid mpu_parts_per_object value %d in config file",
+                       mpu_parts_per_object);
+            return -EINVAL;
+        }
+    }
 
-    memset(opts_cmd, 0, sizeof(opts_cmd));
-    for (int i = 0; i < argc; i++)
-    {
-        sprintf(opts_cmd, "%s%s ", opts_cmd, argv[i]);
+    if (config_lookup_int(&cfg, "mpu_parts_total", &mpu_parts_total)) {
+        if (mpu_parts_total > 0)
+            tlog_debug("use mpu_parts_total of %d", mpu_parts_total);
+        else {
+            tlog_error("invalid mpu_parts_total value %d in config file",
+                       mpu_parts_total);
+            return -EINVAL;
+        }
     }
-    tlog_debug("dump command line\n %s", opts_cmd);
-}
 
-static int fid_parent(const char *mnt, const lustre_fid *fid, char *parent,
-              size_t parent_len)
-{
-    int         rc;
-    int         linkno = 0;
-    long long   recno = -1;
-    char        file[PATH_MAX];
-    char        strfid[FID_NOBRACE_LEN + 1];
-    char        *ptr;
+    if (config_lookup_int(&cfg, "restore_streams", &restore_streams)) {
+        if (restore_streams > 0)
+            tlog_debug("use restore_streams of %d", restore_streams);
+        else {
+            tlog_error("invalid restore_streams value %d in config file",
+                       restore_streams);
+            return -EINVAL;
+        }
+    }
 
-    snprintf(strfid, sizeof(strfid), DFID_NOBRACE, PFID(fid));
+    if (config_lookup_int64(&cfg, "restore_inflight_bytes", &restore_inflight_bytes)) {
+        if (restore_inflight_bytes > 0)
+            tlog_debug("use restore_inflight_bytes of %lld", restore_inflight_bytes);
+        else {
+            tlog_error("invalid restore_inflight_bytes value %lld in config file",
+                       restore_inflight_bytes);
+            return -EINVAL;
+        }
+    }
 
-    rc = llapi_fid2path(mnt, strfid, file, sizeof(file),
-                &recno, &linkno);
-    if (rc < 0)
-        return rc;
+    if (config_lookup_int(&cfg, "queue_depth", &queue_depth)) {
+        if (queue_depth > 0)
+            tlog_debug("use queue_depth of %d", queue_depth);
+        else {
+            tlog_error("invalid queue_depth value %d in config file", queue_depth);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "restore_reserve", &restore_reserve)) {
+        if (restore_reserve >= 0 && restore_reserve < max_requests)
+            tlog_debug("use restore_reserve of %d", restore_reserve);
+        else {
+            tlog_error("invalid restore_reserve value %d in config file, "
+                       "must be lower than max_requests", restore_reserve);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "large_max_requests", &large_max_requests)) {
+        if (large_max_requests > 0)
+            tlog_debug("use large_max_requests of %d", large_max_requests);
+        else {
+            tlog_error("invalid large_max_requests value %d in config file",
+                       large_max_requests);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "restore_weight", &restore_weight)) {
+        if (restore_weight >= 0)
+            tlog_debug("use restore_weight of %d", restore_weight);
+        else {
+            tlog_error("invalid restore_weight value %d in config file", restore_weight);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int64(&cfg, "admit_bytes", &admit_bytes)) {
+        if (admit_bytes >= 0)
+            tlog_debug("use admit_bytes of %lld", admit_bytes);
+        else {
+            tlog_error("invalid admit_bytes value %lld in config file", admit_bytes);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int64(&cfg, "admit_memory", &admit_memory)) {
+        if (admit_memory >= 0)
+            tlog_debug("use admit_memory of %lld", admit_memory);
+        else {
+            tlog_error("invalid admit_memory value %lld in config file", admit_memory);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "admit_transfers", &admit_transfers)) {
+        if (admit_transfers >= 0)
+            tlog_debug("use admit_transfers of %d", admit_transfers);
+        else {
+            tlog_error("invalid admit_transfers value %d in config file",
+                       admit_transfers);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "retry_budget", &retry_budget)) {
+        if (retry_budget >= 0)
+            tlog_debug("use retry_budget of %d", retry_budget);
+        else {
+            tlog_error("invalid retry_budget value %d in config file", retry_budget);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "retry_max_delay_ms", &retry_max_delay_ms)) {
+        if (retry_max_delay_ms >= CT_RETRY_THROTTLE_BASE_MS)
+            tlog_debug("use retry_max_delay_ms of %d", retry_max_delay_ms);
+        else {
+            tlog_error("invalid retry_max_delay_ms value %d in config file, "
+                       "must be at least %d", retry_max_delay_ms,
+                       CT_RETRY_THROTTLE_BASE_MS);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "breaker_failures", &breaker_failures)) {
+        if (breaker_failures >= 0)
+            tlog_debug("use breaker_failures of %d", breaker_failures);
+        else {
+            tlog_error("invalid breaker_failures value %d in config file",
+                       breaker_failures);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "breaker_open_ms", &breaker_open_ms)) {
+        if (breaker_open_ms > 0)
+            tlog_debug("use breaker_open_ms of %d", breaker_open_ms);
+        else {
+            tlog_error("invalid breaker_open_ms value %d in config file",
+                       breaker_open_ms);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "request_timeout_base_ms", &request_timeout_base_ms)) {
+        if (request_timeout_base_ms > 0)
+            tlog_debug("use request_timeout_base_ms of %d", request_timeout_base_ms);
+        else {
+            tlog_error("invalid request_timeout_base_ms value %d in config file",
+                       request_timeout_base_ms);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "stall_timeout", &stall_timeout)) {
+        if (stall_timeout >= 0)
+            tlog_debug("use stall_timeout of %d", stall_timeout);
+        else {
+            tlog_error("invalid stall_timeout value %d in config file",
+                       stall_timeout);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "hedge_percentile", &hedge_percentile)) {
+        if (hedge_percentile >= 0 && hedge_percentile < 100)
+            tlog_debug("use hedge_percentile of %d", hedge_percentile);
+        else {
+            tlog_error("invalid hedge_percentile value %d in config file",
+                       hedge_percentile);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "hedge_budget_percent", &hedge_budget_percent)) {
+        if (hedge_budget_percent > 0 && hedge_budget_percent <= 100)
+            tlog_debug("use hedge_budget_percent of %d", hedge_budget_percent);
+        else {
+            tlog_error("invalid hedge_budget_percent value %d in config file",
+                       hedge_budget_percent);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_bool(&cfg, "adaptive_concurrency", &adaptive_concurrency)) {
+        tlog_debug("adaptive concurrency %s", adaptive_concurrency ? "on" : "off");
+    }
+
+    if (config_lookup_int(&cfg, "adaptive_min_requests", &adaptive_min_requests)) {
+        if (adaptive_min_requests > 0 && adaptive_min_requests <= max_requests)
+            tlog_debug("use adaptive_min_requests of %d", adaptive_min_requests);
+        else {
+            tlog_error("invalid adaptive_min_requests value %d in config file, "
+                       "must be between 1 and max_requests", adaptive_min_requests);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_float(&cfg, "adaptive_latency_tolerance",
+                            &adaptive_latency_tolerance)) {
+        if (adaptive_latency_tolerance > 1.0)
+            tlog_debug("use adaptive_latency_tolerance of %f",
+                       adaptive_latency_tolerance);
+        else {
+            tlog_error("invalid adaptive_latency_tolerance value %f in config file, "
+                       "must be greater than 1", adaptive_latency_tolerance);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_string(&cfg, "mpu_journal_dir", &config_str)) {
+        strncpy(mpu_journal_dir, config_str, sizeof(mpu_journal_dir) - 1);
+        tlog_debug("use mpu_journal_dir of '%s'", mpu_journal_dir);
+    }
+
+    if (config_lookup_int(&cfg, "mpu_reap_age", &mpu_reap_age)) {
+        if (mpu_reap_age >= 0)
+            tlog_debug("use mpu_reap_age of %d", mpu_reap_age);
+        else {
+            tlog_error("invalid mpu_reap_age value %d in config file", mpu_reap_age);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "mpu_reap_interval", &mpu_reap_interval)) {
+        if (mpu_reap_interval > 0)
+            tlog_debug("use mpu_reap_interval of %d", mpu_reap_interval);
+        else {
+            tlog_error("invalid mpu_reap_interval value %d in config file",
+                       mpu_reap_interval);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "mpu_reap_rate", &mpu_reap_rate)) {
+        if (mpu_reap_rate > 0)
+            tlog_debug("use mpu_reap_rate of %d", mpu_reap_rate);
+        else {
+            tlog_error("invalid mpu_reap_rate value %d in config file", mpu_reap_rate);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "fid_cache_size", &fid_cache_size)) {
+        if (fid_cache_size >= 0)
+            tlog_debug("use fid_cache_size of %d", fid_cache_size);
+        else {
+            tlog_error("invalid fid_cache_size value %d in config file", fid_cache_size);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "fid_cache_ttl", &fid_cache_ttl)) {
+        if (fid_cache_ttl > 0)
+            tlog_debug("use fid_cache_ttl of %d", fid_cache_ttl);
+        else {
+            tlog_error("invalid fid_cache_ttl value %d in config file", fid_cache_ttl);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "fid_cache_negative_ttl", &fid_cache_negative_ttl)) {
+        if (fid_cache_negative_ttl >= 0)
+            tlog_debug("use fid_cache_negative_ttl of %d", fid_cache_negative_ttl);
+        else {
+            tlog_error("invalid fid_cache_negative_ttl value %d in config file",
+                       fid_cache_negative_ttl);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_string(&cfg, "obj_index_path", &config_str)) {
+        strncpy(obj_index_path, config_str, sizeof(obj_index_path) - 1);
+        tlog_debug("use obj_index_path of '%s'", obj_index_path);
+    }
+
+    if (config_lookup_int64(&cfg, "obj_index_capacity", &obj_index_capacity)) {
+        if (obj_index_capacity > 0)
+            tlog_debug("use obj_index_capacity of %lld", obj_index_capacity);
+        else {
+            tlog_error("invalid obj_index_capacity value %lld in config file",
+                       obj_index_capacity);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_string(&cfg, "remove_spool_dir", &config_str)) {
+        strncpy(remove_spool_dir, config_str, sizeof(remove_spool_dir) - 1);
+        tlog_debug("use remove_spool_dir of '%s'", remove_spool_dir);
+    }
+
+    if (config_lookup_int(&cfg, "remove_batch_size", &remove_batch_size)) {
+        if (remove_batch_size > 0 && remove_batch_size <= CT_DELETE_BATCH_MAX)
+            tlog_debug("use remove_batch_size of %d", remove_batch_size);
+        else {
+            tlog_error("invalid remove_batch_size value %d in config file, must be "
+                       "between 1 and %d", remove_batch_size, CT_DELETE_BATCH_MAX);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "remove_batch_window", &remove_batch_window)) {
+        if (remove_batch_window > 0)
+            tlog_debug("use remove_batch_window of %d", remove_batch_window);
+        else {
+            tlog_error("invalid remove_batch_window value %d in config file",
+                       remove_batch_window);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_bool(&cfg, "pack_enabled", &pack_enabled)) {
+        tlog_debug("small file packing %s", pack_enabled ? "on" : "off");
+    }
+
+    long long pack_value;
+    if (config_lookup_int64(&cfg, "pack_threshold", &pack_value)) {
+        if (pack_value > 0 && pack_value <= MAX_OBJ_SIZE_LEVEL) {
+            pack_params.threshold = pack_value;
+            tlog_debug("use pack_threshold of %lld", pack_value);
+        } else {
+            tlog_error("invalid pack_threshold value %lld in config file, "
+                       "must be between 1 and %ld", pack_value,
+                       (long)MAX_OBJ_SIZE_LEVEL);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int64(&cfg, "pack_size", &pack_value)) {
+        if (pack_value >= pack_params.threshold && pack_value <= MAX_OBJ_SIZE_LEVEL) {
+            pack_params.pack_size = pack_value;
+            tlog_debug("use pack_size of %lld", pack_value);
+        } else {
+            tlog_error("invalid pack_size value %lld in config file, must be "
+                       "between pack_threshold and %ld", pack_value,
+                       (long)MAX_OBJ_SIZE_LEVEL);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int64(&cfg, "mem_quota_size", &mem_quota_size)) {
+        if (mem_quota_size >= (long long)pack_params.pack_size)
+            tlog_debug("use mem_quota_size of %lld", mem_quota_size);
+        else {
+            tlog_error("invalid mem_quota_size value %lld in config file, must be "
+                       "at least pack_size %zu", mem_quota_size, pack_params.pack_size);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "mem_quota_timeout", &mem_quota_timeout)) {
+        if (mem_quota_timeout >= 0)
+            tlog_debug("use mem_quota_timeout of %d", mem_quota_timeout);
+        else {
+            tlog_error("invalid mem_quota_timeout value %d in config file",
+                       mem_quota_timeout);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_int(&cfg, "pack_window", &pack_params.window)) {
+        if (pack_params.window > 0)
+            tlog_debug("use pack_window of %d", pack_params.window);
+        else {
+            tlog_error("invalid pack_window value %d in config file",
+                       pack_params.window);
+            return -EINVAL;
+        }
+    }
+
+    if (config_lookup_string(&cfg, "pack_index", &config_str)) {
+        strncpy(pack_index_path, config_str, sizeof(pack_index_path) - 1);
+        pack_params.index_path = pack_index_path;
+        tlog_debug("use pack_index of %s", pack_index_path);
+    }
+
+    if (config_lookup_string(&cfg, "pack_prefix", &config_str)) {
+        if (strlen(config_str) < sizeof(pack_prefix)) {
+            strcpy(pack_prefix, config_str);
+            pack_params.prefix = pack_prefix;
+            tlog_debug("use pack_prefix of %s", pack_prefix);
+        } else {
+            tlog_error("pack_prefix '%s' too long, at most %zu characters",
+                       config_str, sizeof(pack_prefix) - 1);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
 
-    /* fid2path returns a relative path */
-    rc = snprintf(parent, parent_len, "%s/%s", mnt, file);
-    if (rc >= parent_len)
-        return -ENAMETOOLONG;
+static void ct_dumpopts(int argc, char *const *argv) {
+    char opts_cmd[PATH_MAX];
 
-    /* remove file name */
-    ptr = strrchr(parent, '/');
-    if (ptr == NULL || ptr == parent) {
-        rc = -EINVAL;
-    } else {
-        *ptr = '\0';
-        rc = 0;
+    memset(opts_cmd, 0, sizeof(opts_cmd));
+    for (int i = 0; i < argc; i++)
+    {
+        sprintf(opts_cmd, "%s%s ", opts_cmd, argv[i]);
     }
-
-    return rc;
+    tlog_debug("dump command line\n %s", opts_cmd);
 }
 
 static bool ct_archive_check(const struct hsm_action_item *hai, const char *src,
@@ -450,7 +1485,18 @@ static bool ct_archive_check(const struct hsm_action_item *hai, const char *src,
     return rc;
 }
 
-static void ct_mk_put_properties(S3PutProperties *obj_put_properties)
+// metadata of an archived object, restore does not need it, it lets a
+// copytool without local state tell an object is up to date
+struct ct_put_meta {
+    char data_version[24];
+    char size[24];
+    S3NameValue values[2];
+};
+
+// meta is NULL or holds the metadata until the request completes
+static void ct_mk_put_properties(S3PutProperties *obj_put_properties,
+                                 struct ct_put_meta *meta,
+                                 uint64_t data_version, uint64_t size)
 {
     static char octet_mime_string[] = "binary/octet-stream";
 
@@ -458,6 +1504,34 @@ static void ct_mk_put_properties(S3PutProperties *obj_put_properties)
     obj_put_properties->contentType = octet_mime_string;
     // object never expires
     obj_put_properties->expires = -1;
+
+    if (meta == NULL || data_version == 0)
+        return;
+
+    snprintf(meta->data_version, sizeof(meta->data_version), "%" PRIu64, data_version);
+    snprintf(meta->size, sizeof(meta->size), "%" PRIu64, size);
+    meta->values[0].name = CT_META_DATA_VERSION;
+    meta->values[0].value = meta->data_version;
+    meta->values[1].name = CT_META_SIZE;
+    meta->values[1].value = meta->size;
+    obj_put_properties->metaDataCount = 2;
+    obj_put_properties->metaData = meta->values;
+}
+
+// bucket of the object archived for fid, the hash must never change, it
+// is how restore and remove find objects again
+static const char *ct_bucket(const struct lu_fid *fid)
+{
+    if (bucket_count <= 1)
+        return bucket_name;
+
+    return bucket_shards[ct_fid_hash(fid) % bucket_count];
+}
+
+// objects of fid may also be in the bucket used before sharding
+static bool ct_bucket_dual(const struct lu_fid *fid)
+{
+    return bucket_dual_read && ct_bucket(fid) != bucket_name;
 }
 
 static char* ct_target(const char *full_path)
@@ -476,12 +1550,122 @@ static char* ct_target(const char *full_path)
     return action_target;
 }
 
+// object key of the file of an action, NULL when the file is outside
+// path_prefix and is not archived
+static const char *ct_object_key(const struct hsm_action_item *hai,
+                                 const char *file_path, char *key, size_t size)
+{
+    if (object_key_mode == CT_KEY_MODE_FID) {
+        char fid_key[64];
+        ct_path_archive(fid_key, sizeof(fid_key), &hai->hai_fid);
+        // top bits, the low ones pick the bucket
+        if (key_hash_prefix)
+            snprintf(key, size, "%04x/%s",
+                     (unsigned int)(ct_fid_hash(&hai->hai_fid) >> 48), fid_key);
+        else
+            snprintf(key, size, "%s", fid_key);
+        return key;
+    }
+
+    char full_path[PATH_MAX];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ct_opt.o_mnt, file_path);
+    char *target = ct_target(full_path);
+    if (target == NULL) {
+        tlog_warn("archive file path '%s' not match with config path_prefix '%s'",
+                  full_path, path_prefix);
+        return NULL;
+    }
+
+    snprintf(key, size, "%s", target);
+    return key;
+}
+
+// record an archived FID keyed object in the side index
+static void ct_key_index_add(const char *key, const char *file_path)
+{
+    char line[PATH_MAX * 2];
+
+    if (key_index_fd < 0)
+        return;
+
+    // one append per line, lines of concurrent archives do not mix
+    int len = snprintf(line, sizeof(line), "%s\t%s\n", key, file_path);
+    if (len >= (int)sizeof(line))
+        return;
+    if (write(key_index_fd, line, len) != len)
+        tlog_warn("cannot add '%s' to key index '%s': %s", key, key_index_path,
+                  strerror(errno));
+}
+
+// remember what a successful archive stored, only whole files are recorded
+static void ct_obj_index_record(const struct hsm_action_item *hai, const char *key,
+                                uint64_t size, uint64_t data_version, const char *etag)
+{
+    struct ct_obj_rec rec;
+
+    if (!ct_obj_index_enabled() || hai->hai_extent.offset != 0 ||
+        hai->hai_extent.length < size || strlen(key) >= sizeof(rec.key))
+        return;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.fid = hai->hai_fid;
+    rec.state = CT_OBJ_LIVE;
+    rec.size = size;
+    rec.data_version = data_version;
+    rec.mtime = time(NULL);
+    snprintf(rec.etag, sizeof(rec.etag), "%s", etag);
+    snprintf(rec.key, sizeof(rec.key), "%s", key);
+
+    if (ct_obj_index_put(&rec) < 0)
+        tlog_warn("cannot index object '%s' of " DFID, key, PFID(&hai->hai_fid));
+}
+
+// record of the object stored under key for fid, NULL when unknown or
+// stored under another key
+static const struct ct_obj_rec *ct_obj_index_find(const struct lu_fid *fid,
+                                                  const char *key,
+                                                  struct ct_obj_rec *rec)
+{
+    if (!ct_obj_index_enabled() || !ct_obj_index_lookup(fid, rec))
+        return NULL;
+
+    if (strcmp(rec->key, key) != 0)
+        return NULL;
+
+    return rec;
+}
+
+// record of the object a remove deletes, the key the file was archived
+// under, whatever became of its path since
+static bool ct_remove_rec(const struct hsm_action_item *hai, struct ct_obj_rec *rec)
+{
+    return ct_obj_index_enabled() && ct_obj_index_lookup(&hai->hai_fid, rec) &&
+           (rec->state == CT_OBJ_LIVE || rec->state == CT_OBJ_REMOVED);
+}
+
+bool ct_needs_path(const struct hsm_action_item *hai)
+{
+    struct ct_obj_rec rec;
+
+    // the file of a remove is usually unlinked already, fid2path fails
+    if (hai->hai_action == HSMA_REMOVE && ct_remove_rec(hai, &rec))
+        return false;
+
+    if (object_key_mode == CT_KEY_MODE_PATH)
+        return true;
+
+    // the side index records the path of archived files
+    return hai->hai_action == HSMA_ARCHIVE && key_index_fd >= 0;
+}
+
 static int ct_archive_data(struct hsm_copyaction_private *hcp, const char *src,
 						   const char *object_name, int src_fd, struct stat *src_st,
-                           const struct hsm_action_item *hai, long hal_flags) {
+                           const struct hsm_action_item *hai, long hal_flags,
+                           uint64_t data_version, char *etag) {
     struct hsm_extent he;
     time_t last_report_time;
     char *dbuf = NULL;
+    struct ct_worker *worker = ct_worker_self();
     __u64 length = hai->hai_extent.length;
     int rc = 0;
     double start_ct_now = ct_now();
@@ -511,73 +1695,82 @@ static int ct_archive_data(struct hsm_copyaction_private *hcp, const char *src,
         tlog_warn("progress ioctl for copy '%s'->'%s' failed", src, object_name);
     }
 
-    #ifdef CT_MEM_QUOTA_ENABLED
-    dbuf = quota_mem_alloc(src_st->st_size);
-    #else
-    dbuf = malloc(src_st->st_size);
-    #endif
-    if (dbuf == NULL) {
-        rc = -ENOMEM;
-        goto out;
+    // stream the file through a small bounce buffer instead of reading it
+    // whole into memory, the worker keeps its buffer between actions
+    size_t dbuf_size;
+    if (worker && worker->buffer) {
+        dbuf = worker->buffer;
+        dbuf_size = worker->buffer_size;
+    } else {
+        dbuf_size = CT_BOUNCE_BUFFER_SIZE;
+        dbuf = malloc(dbuf_size);
+        if (dbuf == NULL) {
+            rc = -ENOMEM;
+            goto out;
+        }
     }
 
-    // setup properities for put object
+    // setup properities for put object, a partial archive does not get
+    // the version of the whole file
     S3PutProperties putProperties;
-    ct_mk_put_properties(&putProperties);
+    struct ct_put_meta put_meta;
+    ct_mk_put_properties(&putProperties, &put_meta,
+                         length == src_st->st_size ? data_version : 0, length);
 
     put_object_callback_data data;
     memset(&data, 0, sizeof(put_object_callback_data));
 
-    double before_lustre_read = ct_now();
-    ssize_t rc_read = read(src_fd, dbuf, length);
-    if (rc_read != (ssize_t)length)
-    {
-        tlog_debug("HSM request file %s with size %u from offset %u",
-                    object_name, src_st->st_size, hai->hai_extent.offset);
-        tlog_error("failed to read data from %s, request size %ld, get size %ld",
-                    object_name, (ssize_t)length, rc_read);
-
-        rc = -EIO;
-        goto out;
-    } else {
-        tlog_info("Reading data from %s of %llu bytes took %fs", src, length,
-                  ct_now() - before_lustre_read);
-    }
-
     data.buffer = dbuf;
-    data.contentLength = length;
+    data.buffer_size = dbuf_size;
+    data.fd = src_fd;
     data.file_name = (char *)object_name;
 
     S3PutObjectHandler putObjectHandler = { putResponseHandler,
-                                            &put_objectdata_callback
+                                            &put_objectdata_stream_callback
                                           };
 
     // Get a local copy of the general bucketContext than overwrite the
-    // pointer to the bucket_name
+    // pointer to the bucket name
     S3BucketContext localbucketContext;
     memcpy(&localbucketContext, &bucketContext, sizeof(S3BucketContext));
 
-    localbucketContext.bucketName = bucket_name;
+    localbucketContext.bucketName = ct_bucket(&hai->hai_fid);
 
     double before_s3_put = ct_now();
-    int retry_count = RETRYCOUNT;
+    struct ct_retry retry;
+    ct_retry_init(&retry);
     while (true)
     {
-        tlog_debug("begin put '%s' to bucket '%s'", object_name, bucket_name);
-        S3_put_object(&localbucketContext, object_name, length,
-                      &putProperties, NULL, 0, &putObjectHandler, &data);
+        tlog_debug("begin put '%s' to bucket '%s'", object_name, localbucketContext.bucketName);
+
+        // every attempt streams the file again from the start
+        data.contentLength = length;
+        data.file_offset = hai->hai_extent.offset;
+        data.buffer_len = 0;
+        data.buffer_offset = 0;
+
+        struct ct_s3_req req;
+        ct_s3_req_init(&req, CT_S3_PUT, &localbucketContext, object_name,
+                       &putObjectHandler, &data);
+        req.byte_count = length;
+        req.put_properties = &putProperties;
+        data.req = &req;
+        ct_s3_engine_run(&req);
+        data.req = NULL;
+
         if (data.status != S3StatusOK)
         {
             tlog_debug("failed to put '%s' to bucket '%s' with error code '%d'",
-                        object_name, bucket_name, data.status);
-            if (S3_status_is_retryable(data.status) && should_retry(&retry_count))
+                        object_name, localbucketContext.bucketName, data.status);
+            if (ct_retry_should(&retry, data.status))
             {
                 continue;
             } else {
                 break;
             }
         } else {
-            tlog_debug("put '%s' to bucket '%s' took %fs", object_name, bucket_name, ct_now() - before_s3_put);
+            tlog_debug("put '%s' to bucket '%s' took %fs", object_name,
+                       localbucketContext.bucketName, ct_now() - before_s3_put);
             break;
         }
     }
@@ -588,14 +1781,11 @@ static int ct_archive_data(struct hsm_copyaction_private *hcp, const char *src,
         goto out;
     }
 
+    snprintf(etag, ETAG_ASCII, "%s", data.etag);
     rc = 0;
 out:
-    if (dbuf != NULL)
-    #ifdef CT_MEM_QUOTA_ENABLED
-        quota_mem_free(dbuf, src_st->st_size);
-    #else
+    if (dbuf != NULL && !(worker && dbuf == worker->buffer))
         free(dbuf);
-    #endif
 
     tlog_info("copied %ju bytes in %f seconds", length, ct_now() - start_ct_now);
 
@@ -623,9 +1813,91 @@ static void ct_get_chunksize(size_t s3_obj_size, size_t *s3_chunk_sz, size_t *s3
     *s3_seq_total = total_seq;
 }
 
+// one part of a multipart upload in flight
+struct ct_mpu_part {
+    MultipartPartData part_data;
+    struct ct_s3_req req;
+    const char *object_name;
+    size_t offset;
+    struct ct_retry retry;
+    // set when any part of the object failed for good
+    bool *failed;
+    // set when the upload is gone on the S3 side
+    bool *stale;
+    struct ct_mpu_journal *journal;
+};
+
+// process wide slot of a part in flight, false when the action was
+// cancelled while waiting
+static bool ct_mpu_part_slot(void)
+{
+    while (true) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += CT_RETRY_SLICE_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (sem_timedwait(&mpu_part_sem, &ts) == 0)
+            return true;
+        if (ct_cancel_requested())
+            return false;
+    }
+}
+
+// engine completion of a part, runs on an engine thread
+static bool ct_mpu_part_done(struct ct_s3_req *req)
+{
+    struct ct_mpu_part *part = req->arg;
+    put_object_callback_data *data = &part->part_data.put_object_data;
+    UploadManager *manager = part->part_data.manager;
+    int seq = part->part_data.seq;
+    double t_cost = ct_now() - req->start_time;
+
+    if (req->status == S3StatusOK && manager->etags[seq - 1] != NULL) {
+        if (t_cost > SLOW_IO_TIME) {
+            tlog_warn("slow put Part Seq of %d, for object '%s' with time '%f' seconds",
+                      seq, part->object_name, t_cost);
+        }
+        tlog_info("%s Part Seq %d, length=%lu finish in %fs", part->object_name,
+                  seq, req->byte_count, t_cost);
+        // a part not journaled is uploaded again after a restart, that is all
+        if (part->journal)
+            ct_mpu_journal_part(part->journal, seq, manager->etags[seq - 1]);
+        __atomic_add_fetch(&manager->parts_done, 1, __ATOMIC_RELAXED);
+        sem_post(&mpu_part_sem);
+        return true;
+    }
+
+    tlog_error("failed to put Part Seq of %d, for object '%s' with rc '%d'",
+               seq, part->object_name, req->status);
+
+    // a part without etag is retried, even if the status looks fine
+    S3Status status = (req->status == S3StatusOK) ? S3StatusErrorRequestTimeout :
+                                                    req->status;
+    int delay_ms = *part->failed ? -1 :
+                   ct_retry_next(&part->retry, status, req->retry_after_ms);
+    if (delay_ms >= 0) {
+        // rewind the part, it is read again from its own offset
+        data->file_offset = part->offset;
+        data->contentLength = req->byte_count;
+        data->totalContentLength = req->byte_count;
+        ct_s3_engine_submit_delayed(req, delay_ms);
+        return false;
+    }
+
+    if (req->status == S3StatusErrorNoSuchUpload)
+        *part->stale = true;
+    *part->failed = true;
+    sem_post(&mpu_part_sem);
+    return true;
+}
+
 static int ct_archive_data_big (struct hsm_copyaction_private *hcp, const char *src,
                                 const char *object_name, int src_fd, struct stat *src_st,
-                                const struct hsm_action_item *hai, long hal_flags) {
+                                const struct hsm_action_item *hai, long hal_flags,
+                                uint64_t data_version, char *etag) {
     struct hsm_extent he;
     time_t last_report_time;
     __u64 file_offset = hai->hai_extent.offset;
@@ -634,6 +1906,10 @@ static int ct_archive_data_big (struct hsm_copyaction_private *hcp, const char *
     double start_ct_now = ct_now();
     time_t now;
 
+    S3BucketContext localbucketContext;
+    memcpy(&localbucketContext, &bucketContext, sizeof(S3BucketContext));
+    localbucketContext.bucketName = ct_bucket(&hai->hai_fid);
+
     // TODO: current code has not put striping info into object meta part
     // if we need it, or use default striping setting in lustre directory when restore data ?
     strippingInfo stripping_params;
@@ -658,181 +1934,265 @@ static int ct_archive_data_big (struct hsm_copyaction_private *hcp, const char *
         tlog_warn("progress ioctl for archive '%s'", object_name);
     }
 
-    // setup properities for put object
-    S3PutProperties putProperties;
-    ct_mk_put_properties(&putProperties);
+    // setup properities for put object, the metadata goes with the
+    // initiate request, S3 ignores it on parts
+    S3PutProperties putProperties, initProperties;
+    struct ct_put_meta put_meta;
+    ct_mk_put_properties(&putProperties, NULL, 0, 0);
+    ct_mk_put_properties(&initProperties, &put_meta, data_version, src_st->st_size);
 
     put_object_callback_data data;
     memset(&data, 0, sizeof(put_object_callback_data));
 
-    double    before_lustre_read = ct_now();
     size_t    contentLength	     = src_st->st_size;
     size_t    totalContentLength = src_st->st_size;
-    size_t    todoContentLength  = src_st->st_size;
     size_t    s3_chunk_size;
     size_t    total_seq;
 
     UploadManager manager;
     manager.upload_id = NULL;
     manager.gb	      = NULL;
+    manager.req       = NULL;
+    manager.etag[0]   = '\0';
 
     // get multipart upload chunk size and total part number
     ct_get_chunksize(totalContentLength, &s3_chunk_size, &total_seq);
 
     manager.etags = (char **)calloc(total_seq, sizeof(char *));
-    manager.next_etags_pos = 0;
+    manager.parts_total = total_seq;
+    manager.parts_done = 0;
+
+    // resume an upload of the same file version interrupted by a restart
+    struct ct_mpu_journal journal_data, *journal = NULL;
+    struct ct_mpu_header journal_hdr;
+    bool upload_stale = false;
+    memset(&journal_hdr, 0, sizeof(journal_hdr));
+    journal_hdr.size = totalContentLength;
+    journal_hdr.chunk_size = s3_chunk_size;
+    journal_hdr.parts_total = total_seq;
+    strncpy(journal_hdr.object_name, object_name, sizeof(journal_hdr.object_name) - 1);
+
+    journal_hdr.data_version = data_version;
+    if (ct_mpu_journal_enabled() && data_version != 0) {
+        int rc_journal = ct_mpu_journal_open(&journal_data, &hai->hai_fid, &journal_hdr,
+                                             &manager.upload_id, manager.etags);
+        if (rc_journal >= 0) {
+            journal = &journal_data;
+            for (int i = 0; i < total_seq; i++) {
+                if (manager.etags[i])
+                    manager.parts_done++;
+            }
+        } else {
+            // upload without journal
+            ct_mpu_journal_close(&journal_data, false);
+        }
+    }
 
     rc = -EIO;
-    int retry_count = RETRYCOUNT;
-    bool is_retryable;
-    do {
-        S3_initiate_multipart(&bucketContext, object_name, 0, &initMultipartHandler,
-                              NULL, TIMEOUT_MS, &manager);
-        S3Status rc_init = (manager.upload_id == NULL) ? S3StatusErrorInternalError : 0;
-        is_retryable = S3_status_is_retryable(rc_init);
-    } while (is_retryable && should_retry(&retry_count));
+    struct ct_retry retry;
+    ct_retry_init(&retry);
+    while (manager.upload_id == NULL) {
+        struct ct_s3_req req;
+        ct_s3_req_init(&req, CT_S3_MPU_INIT, &localbucketContext, object_name,
+                       &initMultipartHandler, &manager);
+        req.put_properties = &initProperties;
+        manager.req = &req;
+        ct_s3_engine_run(&req);
+        manager.req = NULL;
+
+        S3Status rc_init = S3StatusOK;
+        if (manager.upload_id == NULL)
+            rc_init = (req.status != S3StatusOK) ? req.status : S3StatusErrorInternalError;
+        if (manager.upload_id == NULL && !ct_retry_should(&retry, rc_init))
+            break;
+
+        if (manager.upload_id && journal) {
+            strncpy(journal_hdr.upload_id, manager.upload_id,
+                    sizeof(journal_hdr.upload_id) - 1);
+            if (ct_mpu_journal_begin(journal, &journal_hdr) < 0) {
+                ct_mpu_journal_close(journal, true);
+                journal = NULL;
+            }
+        }
+    }
 
     // TODO: read AWS API DOC, if upload_id always not 0 when where have no error happed
     if (manager.upload_id == NULL) {
         tlog_error( "failed to initiate multipart upload for object '%s' on bucket '%s'",
-                    object_name, bucket_name);
+                    object_name, localbucketContext.bucketName);
         goto clean;
     }
 
     assert(manager.gb == NULL);
 
     // prepare file handle for multi part upload
+    // parts read the file with pread at their own offset, so any number of
+    // them can be in flight at the same time
     data.file_name = (char *)src;
     data.fd = src_fd;
 
-    // multi part upload start
-    int partContentLength = 0;
-    MultipartPartData part_data;
-    memset(&part_data, 0, sizeof(MultipartPartData));
-
-    todoContentLength -= s3_chunk_size * manager.next_etags_pos;
-    part_data.manager = &manager;
-    for (int seq = manager.next_etags_pos + 1; seq <= total_seq; seq++) {
-        part_data.seq = seq;
-        if (part_data.put_object_data.gb == NULL) {
-            part_data.put_object_data = data;
-        }
-        partContentLength = ((contentLength > s3_chunk_size) ? s3_chunk_size : contentLength);
-        tlog_info("%s Part Seq %d, length=%d start", object_name, seq, partContentLength);
-        part_data.put_object_data.contentLength = partContentLength;
-        part_data.put_object_data.originalContentLength = partContentLength;
-        part_data.put_object_data.totalContentLength = todoContentLength;
-        part_data.put_object_data.totalOriginalContentLength = totalContentLength;
-        putProperties.md5 = 0;
-        int retry_count	= RETRYCOUNT;
-
-        do {
-            time_t t_begin, t_end;
-            double t_cost;
-
-            t_begin = time(NULL);
-            // retry must reset file pointer position, because it may have beeen changed
-            // in callback function when prepare data for upload
-            lseek(data.fd, (seq - 1) * s3_chunk_size, SEEK_SET);
-            part_data.put_object_data.status = 0;
+    struct ct_mpu_part *parts = calloc(total_seq, sizeof(struct ct_mpu_part));
+    if (parts == NULL) {
+        rc = -ENOMEM;
+        goto clean;
+    }
 
-            S3_upload_part(&bucketContext, object_name, &putProperties,
-                           &uploadMultipartHandler, seq,
-                           manager.upload_id, partContentLength, NULL,
-                           TIMEOUT_MS, &part_data);
+    struct ct_s3_group group;
+    ct_s3_group_init(&group);
+    bool part_failed = false;
+    int window = (mpu_parts_per_object < total_seq) ? mpu_parts_per_object : total_seq;
 
-            t_end = time(NULL);
+    // multi part upload start
+    for (int seq = 1; seq <= total_seq && !part_failed; seq++) {
+        struct ct_mpu_part *part = &parts[seq - 1];
+
+        // part already uploaded before a restart
+        if (manager.etags[seq - 1])
+            continue;
+
+        size_t part_offset = (seq - 1) * s3_chunk_size;
+        size_t partContentLength = ((contentLength - part_offset > s3_chunk_size) ?
+                                    s3_chunk_size : contentLength - part_offset);
+
+        part->part_data.put_object_data = data;
+        part->part_data.put_object_data.file_offset = part_offset;
+        part->part_data.put_object_data.contentLength = partContentLength;
+        part->part_data.put_object_data.originalContentLength = partContentLength;
+        part->part_data.put_object_data.totalContentLength = partContentLength;
+        part->part_data.put_object_data.totalOriginalContentLength = totalContentLength;
+        part->part_data.put_object_data.req = &part->req;
+        part->part_data.seq = seq;
+        part->part_data.manager = &manager;
+        part->object_name = object_name;
+        part->offset = part_offset;
+        ct_retry_init(&part->retry);
+        part->failed = &part_failed;
+        part->stale = &upload_stale;
+        part->journal = journal;
+
+        ct_s3_req_init(&part->req, CT_S3_MPU_PART, &localbucketContext, object_name,
+                       &uploadMultipartHandler, &part->part_data);
+        part->req.put_properties = &putProperties;
+        part->req.seq = seq;
+        part->req.upload_id = manager.upload_id;
+        part->req.byte_count = partContentLength;
+        part->req.done = ct_mpu_part_done;
+        part->req.arg = part;
+
+        // per object, then process wide limit of parts in flight
+        ct_s3_group_wait(&group, window - 1);
+        if (!ct_mpu_part_slot())
+            break;
 
-            // when chunk upload success, next_etags_pos will be updated
-            // mark status as S3StatusErrorRequestTimeout for retry
-            if (manager.next_etags_pos != seq)
-            {
-                tlog_error("failed to put Part Seq of %d, for object '%s' with rc '%d'",
-                            seq, object_name, part_data.put_object_data.status);
-                part_data.put_object_data.status = S3StatusErrorRequestTimeout;
+        tlog_info("%s Part Seq %d, length=%zu start", object_name, seq, partContentLength);
+        ct_s3_group_add(&group, &part->req);
+        ct_s3_engine_submit(&part->req);
+
+        // report progress to HSM coordinator
+        now = time(NULL);
+        if (difftime(now, last_report_time) >= ct_opt.o_report_int) {
+            he.offset = file_offset;
+            he.length = (__u64)__atomic_load_n(&manager.parts_done, __ATOMIC_RELAXED) *
+                        s3_chunk_size;
+            tlog_debug("report for archive '%s' progress with offset '%lu' len='%lu'",
+                        object_name, he.offset, he.length);
+            int rc_report = llapi_hsm_action_progress_ex(hcp, &he, length, 0);
+            if (rc_report < 0) {
+                // not treat progress report message failed to send as
+                // failure continue process next file part, only log
+                // warning message
+                tlog_warn("progress ioctl for archive '%s' failed with rc=%d",
+                            object_name, rc_report);
             } else {
-                // check slow operation
-                t_cost = difftime(t_end, t_begin);
-                if (t_cost > SLOW_IO_TIME) {
-                    tlog_warn("slow put Part Seq of %d, for object '%s' with time '%f' seconds",
-                                seq, object_name, t_cost);
-                }
-
-                // report progress to HSM coordinator
-                if (difftime(t_end, last_report_time) >= ct_opt.o_report_int) {
-                    he.offset = (seq - 1) * s3_chunk_size;
-                    he.length = partContentLength;
-                    tlog_debug("report for archive '%s' progress with offset '%lu' len='%lu'",
-                                object_name, he.offset, he.length);
-                    int rc_report = llapi_hsm_action_progress_ex(hcp, &he, length, 0);
-                    if (rc_report < 0) {
-                        // not treat progress report message failed to send as
-                        // failure continue process next file part, only log
-                        // warning message
-                        tlog_warn("progress ioctl for archive '%s' failed with rc=%d",
-                                    object_name, rc_report);
-                    } else {
-                        // update progress
-                        last_report_time = time(NULL);
-                    }
-                }
+                // update progress
+                last_report_time = time(NULL);
             }
-        } while (S3_status_is_retryable(part_data.put_object_data.status) &&
-                 should_retry(&retry_count));
-
-        if (part_data.put_object_data.status != S3StatusOK) {
-            tlog_error("failed to put Part Seq of %d, for object '%s'", seq, object_name);
-            goto clean;
         }
-
-		tlog_info("%s Part Seq %d, length=%d finish with code %d",
-				object_name, seq, partContentLength, part_data.put_object_data.status);
-		contentLength -= partContentLength;
-		todoContentLength -= partContentLength;
-        assert(manager.gb == NULL);
     }
 
-    // multipart upload success, commit it
-    int size = 0;
-    size += growbuffer_append(&(manager.gb), "<CompleteMultipartUpload>",
-                              strlen("<CompleteMultipartUpload>"));
+    // wait for the parts still in flight
+    ct_s3_group_wait(&group, 0);
+    ct_s3_group_destroy(&group);
+    free(parts);
 
-    for (int i = 0, n = 0; i < total_seq; i++) {
-        char buf[256];
-        n = snprintf(buf, sizeof(buf), "<Part><PartNumber>%d</PartNumber>" \
-                     "<ETag>%s</ETag></Part>", i + 1, manager.etags[ i ]);
+    // nothing of the upload is kept, not even its journal
+    if (ct_cancel_requested()) {
+        ct_mpu_abort(&localbucketContext, object_name, manager.upload_id);
+        upload_stale = true;
+        rc = -ECANCELED;
+        goto clean;
+    }
 
-        size += growbuffer_append(&(manager.gb), buf, n);
+    if (part_failed || manager.parts_done != total_seq) {
+        tlog_error("failed to put all parts of object '%s', %d of %zu done",
+                   object_name, manager.parts_done, total_seq);
+        goto clean;
     }
+    assert(manager.gb == NULL);
+
+    // the server may reject the commit after reading the whole body, only
+    // its status and the ETag it returned tell the object exists
+    S3Status commit_status;
+    ct_retry_init(&retry);
+    do {
+        // the body is consumed as it is sent, every attempt builds it again
+        growbuffer_destroy(manager.gb);
+        manager.gb = NULL;
+        int size = 0;
+        size += growbuffer_append(&(manager.gb), "<CompleteMultipartUpload>",
+                                  strlen("<CompleteMultipartUpload>"));
+
+        for (int i = 0, n = 0; i < total_seq; i++) {
+            char buf[256];
+            n = snprintf(buf, sizeof(buf), "<Part><PartNumber>%d</PartNumber>" \
+                         "<ETag>%s</ETag></Part>", i + 1, manager.etags[ i ]);
+
+            size += growbuffer_append(&(manager.gb), buf, n);
+        }
 
-    size += growbuffer_append(&(manager.gb), "</CompleteMultipartUpload>",
-                              strlen("</CompleteMultipartUpload>"));
+        size += growbuffer_append(&(manager.gb), "</CompleteMultipartUpload>",
+                                  strlen("</CompleteMultipartUpload>"));
 
-    manager.remaining = size;
+        manager.remaining = size;
 
-    retry_count = RETRYCOUNT;
-    do {
-        S3_complete_multipart_upload(&bucketContext, object_name,
-                                     &commitMultipartHandler, manager.upload_id,
-                                     manager.remaining, NULL, TIMEOUT_MS,
-                                     &manager);
+        struct ct_s3_req req;
+        ct_s3_req_init(&req, CT_S3_MPU_COMMIT, &localbucketContext, object_name,
+                       &commitMultipartHandler, &manager);
+        req.upload_id = manager.upload_id;
+        req.byte_count = manager.remaining;
+        manager.etag[0] = '\0';
+        manager.req = &req;
+        commit_status = ct_s3_engine_run(&req);
+        manager.req = NULL;
 
-    } while (S3_status_is_retryable(manager.remaining) &&
-             should_retry(&retry_count));
+    } while (ct_retry_should(&retry, commit_status));
 
-    if (manager.remaining) {
-        tlog_error("failed to complete multipart upload of %d, for object '%s'",
-                   manager.upload_id, object_name);
+    if (commit_status != S3StatusOK || manager.etag[0] == '\0') {
+        tlog_error("failed to complete multipart upload %s of object '%s', S3Error %s",
+                   manager.upload_id, object_name, S3_get_status_name(commit_status));
+        if (commit_status == S3StatusErrorNoSuchUpload)
+            upload_stale = true;
         goto clean;
     }
+    snprintf(etag, ETAG_ASCII, "%s", manager.etag);
 	rc = 0;
 
 clean:
+    // a failed upload no journal resumes only costs storage, drop its parts
+    // now, a journaled one is left to the reaper once it goes stale
+    if (rc != 0 && manager.upload_id && !upload_stale && journal == NULL)
+        ct_mpu_abort(&localbucketContext, object_name, manager.upload_id);
+
+    // keep the journal of a failed upload for the next attempt, unless the
+    // upload itself is gone
+    if (journal)
+        ct_mpu_journal_close(journal, rc == 0 || upload_stale);
+
     if (manager.upload_id) {
         free(manager.upload_id);
     }
 
-    for (int i = 0; i < manager.next_etags_pos; i++) {
+    for (int i = 0; i < total_seq; i++) {
         free(manager.etags[ i ]);
     }
 
@@ -849,6 +2209,23 @@ out:
     return rc;
 }
 
+// a packed file is one range of its pack object
+static int ct_restore_packed(struct ct_pack_rec *pack_rec, int dst_fd, char *file_path,
+                             S3GetObjectHandler *getObjectHandler)
+{
+    get_object_callback_data data;
+
+    // a byte count of 0 would be the whole pack
+    if (pack_rec->length == 0)
+        return 0;
+
+    memset(&data, 0, sizeof(data));
+    data.fd = dst_fd;
+    data.file_path = file_path;
+    return get_s3_range(pack_rec->key, pack_rec->offset, pack_rec->length,
+                        &data, getObjectHandler);
+}
+
 static int ct_restore_data(struct hsm_copyaction_private *hcp, const char *src,
                            const char *dst, int dst_fd,
                            const struct hsm_action_item *hai, long hal_flags, char *file_path) {
@@ -885,27 +2262,64 @@ static int ct_restore_data(struct hsm_copyaction_private *hcp, const char *src,
 
     last_report_time = time(NULL);
 
+    S3GetObjectHandler getObjectHandler = { getResponseHandler,
+                                            &get_objectdata_callback };
+
+    struct ct_pack_rec pack_rec;
+    if (ct_pack_lookup(&hai->hai_fid, &pack_rec)) {
+        rc = ct_restore_packed(&pack_rec, dst_fd, file_path, &getObjectHandler);
+        length = pack_rec.length;
+        goto out;
+    }
+
     // Downloading from the object store
-    char full_path[PATH_MAX];
-    sprintf(full_path, "%s/%s", ct_opt.o_mnt, file_path);
-    char *object_name = ct_target(full_path);
+    char key[PATH_MAX];
+    char *object_name = (char *)ct_object_key(hai, file_path, key, sizeof(key));
     if (object_name == NULL)
     {
-        tlog_warn("archive file path '%s' not match with config path_prefix '%s'", full_path, path_prefix);
         rc = 0;
         goto out;
     }
 
-    S3GetObjectHandler getObjectHandler = { getResponseHandler,
-                                            &get_objectdata_callback };
-
     if (length == -1) {
         if (file_offset == 0) {
             get_object_callback_data data;
-            memset(&data, 0, sizeof(data));
-            data.fd = dst_fd;
-            data.file_path = file_path;
-            rc = get_s3_object(object_name, &data, &getObjectHandler);
+            const char *bucket = ct_bucket(&hai->hai_fid);
+            bool dual = ct_bucket_dual(&hai->hai_fid);
+            struct ct_obj_rec rec_buf;
+            const struct ct_obj_rec *rec = ct_obj_index_find(&hai->hai_fid, object_name,
+                                                             &rec_buf);
+
+            while (true) {
+                memset(&data, 0, sizeof(data));
+                data.fd = dst_fd;
+                data.file_path = file_path;
+                if (restore_streams > 1)
+                    rc = get_s3_object_parallel(bucket, object_name, &data,
+                                                &getObjectHandler, rec);
+                else
+                    rc = get_s3_object(bucket, object_name, &data, &getObjectHandler,
+                                       rec);
+
+                // archived before sharding
+                if (rc < 0 && dual && data.status == S3StatusErrorNoSuchKey) {
+                    tlog_info("'%s' not in bucket '%s', read it from '%s'",
+                              object_name, bucket, bucket_name);
+                    bucket = bucket_name;
+                    dual = false;
+                    continue;
+                }
+                break;
+            }
+            // packed by another agent, or the local pack index was lost
+            if (rc < 0 && data.status == S3StatusErrorNoSuchKey && ct_pack_enabled() &&
+                ct_pack_sync() == 0 && ct_pack_lookup(&hai->hai_fid, &pack_rec)) {
+                tlog_info("'%s' found in pack '%s' of the pack index objects",
+                          object_name, pack_rec.key);
+                rc = ct_restore_packed(&pack_rec, dst_fd, file_path, &getObjectHandler);
+                length = pack_rec.length;
+                goto out;
+            }
             if (rc < 0) {
                 goto out;
             }
@@ -937,6 +2351,65 @@ out:
     return rc;
 }
 
+// coordinator flags of a failed action, an action failing while the
+// endpoint is down is handed back to be retried later
+static int ct_hp_flags(int rc)
+{
+    // a cancelled action is not wanted any more
+    if (rc == -ECANCELED)
+        return 0;
+
+    if (rc && (ct_is_retryable(rc) || rc == -EAGAIN || ct_endpoint_degraded()))
+        return HP_FLAG_RETRY;
+
+    return 0;
+}
+
+// a whole file archive of data already stored under key: the metadata of
+// the object tells the version, the index only rules out changed files
+static bool ct_archive_unchanged(const struct hsm_action_item *hai, const char *key,
+                                 const struct stat *src_st, uint64_t data_version)
+{
+    struct ct_obj_rec rec;
+
+    if (data_version == 0 || hai->hai_extent.offset != 0 ||
+        hai->hai_extent.length < (__u64)src_st->st_size)
+        return false;
+
+    // the index spares the HEAD of a changed file, but a matching record
+    // does not prove the object is still there
+    if (ct_obj_index_enabled() &&
+        !(ct_obj_index_find(&hai->hai_fid, key, &rec) &&
+          rec.state == CT_OBJ_LIVE && rec.data_version == data_version &&
+          rec.size == (uint64_t)src_st->st_size))
+        return false;
+
+    // a small file goes to a pack, its key is never an object
+    if (ct_pack_enabled() && src_st->st_size < ct_pack_threshold())
+        return false;
+
+    S3BucketContext localbucketContext;
+    memcpy(&localbucketContext, &bucketContext, sizeof(S3BucketContext));
+    localbucketContext.bucketName = ct_bucket(&hai->hai_fid);
+
+    get_object_callback_data head_data;
+    struct ct_retry retry;
+    memset(&head_data, 0, sizeof(head_data));
+    ct_retry_init(&retry);
+    do {
+        struct ct_s3_req req;
+        ct_s3_req_init(&req, CT_S3_HEAD, &localbucketContext, key,
+                       &getResponseHandler, &head_data);
+        head_data.req = &req;
+        ct_s3_engine_run(&req);
+        head_data.req = NULL;
+    } while (ct_retry_should(&retry, head_data.status));
+
+    // a missing object or any failure means archiving it again
+    return head_data.status == S3StatusOK && head_data.data_version == data_version &&
+           head_data.contentLength == (size_t)src_st->st_size;
+}
+
 int ct_archive(const struct hsm_action_item *hai, const long hal_flags, char *file_path) {
     struct hsm_copyaction_private *hcp = NULL;
     char src[PATH_MAX];
@@ -945,6 +2418,11 @@ int ct_archive(const struct hsm_action_item *hai, const long hal_flags, char *fi
     int hp_flags = 0;
     int src_fd = -1;
 
+    if (ct_endpoint_rejecting()) {
+        rc = -EAGAIN;
+        goto end_ct_archive;
+    }
+
     rc = ct_begin(&hcp, hai);
     if (rc < 0)
         goto end_ct_archive;
@@ -955,10 +2433,6 @@ int ct_archive(const struct hsm_action_item *hai, const long hal_flags, char *fi
      */
     ct_path_lustre(src, sizeof(src), ct_opt.o_mnt, &hai->hai_dfid);
 
-    char  parent[PATH_MAX];
-    memset(parent, sizeof(parent), 0);
-    rc = fid_parent(ct_opt.o_mnt, &hai->hai_fid, parent, PATH_MAX);
-
     if (ct_opt.o_dry_run) {
         rc = 0;
         goto end_ct_archive;
@@ -986,30 +2460,69 @@ int ct_archive(const struct hsm_action_item *hai, const long hal_flags, char *fi
     }
     else
     {
-        char full_path[PATH_MAX];
-        sprintf(full_path, "%s/%s", ct_opt.o_mnt, file_path);
-        char *obj_name = ct_target(full_path);
+        char key[PATH_MAX];
+        const char *obj_name = ct_object_key(hai, file_path, key, sizeof(key));
         if (obj_name == NULL) {
-            tlog_warn("archive file path '%s' not match with config path_prefix '%s'", full_path, path_prefix);
             rc = 0;
             goto end_ct_archive;
         }
 
+        // version of the data about to be read, flushed from the clients
+        __u64 data_version = 0;
+        if (llapi_get_data_version(src_fd, &data_version, LL_DV_RD_FLUSH) < 0)
+            data_version = 0;
+
+        if (ct_archive_unchanged(hai, obj_name, &src_st, data_version)) {
+            tlog_info("'%s' unchanged since archived as '%s', version %llu",
+                      src, obj_name, (unsigned long long)data_version);
+            rc = 0;
+            goto end_ct_archive;
+        }
+
+        if (ct_pack_enabled() && hai->hai_extent.offset == 0 &&
+            src_st.st_size < ct_pack_threshold())
+        {
+            rc = ct_pack_add(hcp, hai, src_fd, src_st.st_size);
+            if (rc == 0) {
+                // the pack completes the action once it is stored
+                close(src_fd);
+                return 0;
+            }
+            tlog_warn("cannot pack '%s' (rc=%d), archive it alone", src, rc);
+        }
+
+        char etag[ETAG_ASCII] = "";
         if (src_st.st_size >= MAX_OBJ_SIZE_LEVEL)
         {
-	    rc = ct_archive_data_big(hcp, src, obj_name, src_fd, &src_st, hai, hal_flags);
+	    rc = ct_archive_data_big(hcp, src, obj_name, src_fd, &src_st, hai, hal_flags,
+                                     data_version, etag);
         }
         else
         {
-	    rc = ct_archive_data(hcp, src, obj_name, src_fd, &src_st, hai, hal_flags);
+	    rc = ct_archive_data(hcp, src, obj_name, src_fd, &src_st, hai, hal_flags,
+                                 data_version, etag);
+        }
+
+        if (rc < 0 && ct_cancel_requested())
+            rc = -ECANCELED;
+        if (rc == 0 && object_key_mode == CT_KEY_MODE_FID)
+            ct_key_index_add(obj_name, file_path);
+        if (rc == 0)
+            ct_obj_index_record(hai, obj_name, src_st.st_size, data_version, etag);
+        // a restore must not read an older copy of the file from a pack
+        if (rc == 0) {
+            int rc_pack = ct_pack_remove(&hai->hai_fid);
+            if (rc_pack != 0 && rc_pack != -ENOENT) {
+                tlog_error("cannot drop '%s' from the pack index (rc=%d)", src, rc_pack);
+                rc = -EAGAIN;
+            }
         }
     }
 
 end_ct_archive:
     err_major++;
 
-    if (rc && ct_is_retryable(rc))
-        hp_flags |= HP_FLAG_RETRY;
+    hp_flags |= ct_hp_flags(rc);
 
     rcf = rc;
 
@@ -1045,6 +2558,12 @@ int ct_restore(const struct hsm_action_item *hai, const long hal_flags, char *fi
     /* build backend file name from released file FID */
     ct_path_archive(src, sizeof(src), &hai->hai_fid);
 
+    if (ct_endpoint_rejecting()) {
+        rc = -EAGAIN;
+        hp_flags |= ct_hp_flags(rc);
+        goto end_ct_restore;
+    }
+
     rc = llapi_get_mdt_index_by_fid(ct_opt.o_mnt_fd, &hai->hai_fid, &mdt_index);
     if (rc < 0) {
         tlog_error("cannot get mdt index " DFID "", PFID(&hai->hai_fid));
@@ -1079,11 +2598,12 @@ int ct_restore(const struct hsm_action_item *hai, const long hal_flags, char *fi
     }
 
     rc = ct_restore_data(hcp, src, dst, dst_fd, hai, hal_flags, file_path);
+    if (rc < 0 && ct_cancel_requested())
+        rc = -ECANCELED;
     if (rc < 0) {
         tlog_error("cannot restore '%s'", file_path);
         err_major++;
-        if (ct_is_retryable(rc))
-            hp_flags |= HP_FLAG_RETRY;
+        hp_flags |= ct_hp_flags(rc);
         goto end_ct_restore;
     }
 
@@ -1103,8 +2623,13 @@ int ct_remove(const struct hsm_action_item *hai, const long hal_flags, char *fil
     struct hsm_copyaction_private *hcp = NULL;
     char dst[PATH_MAX];
     int rc;
-    int retry_count;
-    char *object_name = file_path;
+    struct ct_retry retry;
+    char key[PATH_MAX];
+
+    if (ct_endpoint_rejecting()) {
+        rc = -EAGAIN;
+        goto end_ct_remove;
+    }
 
     rc = ct_begin(&hcp, hai);
     if (rc < 0)
@@ -1115,48 +2640,161 @@ int ct_remove(const struct hsm_action_item *hai, const long hal_flags, char *fil
         goto end_ct_remove;
     }
 
-    retry_count = RETRYCOUNT;
+    // a packed file only leaves the pack index, its bytes stay in the pack,
+    // an object archived before or after it was packed is deleted too
+    rc = ct_pack_remove(&hai->hai_fid);
+    if (rc != 0 && rc != -ENOENT)
+        goto end_ct_remove;
+    rc = 0;
+
+    // the key comes from the path only for a file the index does not know
+    struct ct_obj_rec rec;
+    const char *object_name;
+    if (ct_remove_rec(hai, &rec)) {
+        object_name = rec.key;
+        if (rec.state == CT_OBJ_REMOVED) {
+            tlog_debug("'%s' already removed", object_name);
+            goto end_ct_remove;
+        }
+    } else {
+        object_name = ct_object_key(hai, file_path, key, sizeof(key));
+        if (object_name == NULL)
+            goto end_ct_remove;
+    }
+
+    // an object archived before sharding may still be in bucket_name, a
+    // delete of a missing key succeeds
+    const char *buckets[2] = { ct_bucket(&hai->hai_fid), bucket_name };
+    int nbuckets = ct_bucket_dual(&hai->hai_fid) ? 2 : 1;
+
+    // spooled, the object is deleted later with a batch
+    if (ct_delete_queue_enabled()) {
+        for (int i = 0; i < nbuckets && rc == 0; i++)
+            rc = ct_delete_queue_add(&hai->hai_fid, buckets[i], object_name);
+        if (rc == 0) {
+            ct_obj_index_remove(&hai->hai_fid);
+            goto end_ct_remove;
+        }
+        // a key spooled twice is deleted twice, harmless
+        tlog_warn("cannot spool delete of '%s' (rc=%d), delete it now", object_name, rc);
+        rc = 0;
+    }
+
+    ct_retry_init(&retry);
     del_object_callback_data delete_data;
+    memset(&delete_data, 0, sizeof(delete_data));
 
     // Get a local copy of the general bucketContext than overwrite the
-    // pointer to the bucket_name
+    // pointer to the bucket name
     S3BucketContext localbucketContext;
     memcpy(&localbucketContext, &bucketContext, sizeof(S3BucketContext));
-    localbucketContext.bucketName = bucket_name;
 
-    retry_count = RETRYCOUNT;
-    do {
-        S3_delete_object(&localbucketContext, object_name, NULL, 0,
-                         &deleteResponseHandler, &delete_data);
-    } while (S3_status_is_retryable(delete_data.status) &&
-             should_retry(&retry_count));
-
-    if (delete_data.status != S3StatusOK) {
-        rc = -EIO;
-        tlog_error("S3Error %s", S3_get_status_name(delete_data.status));
-        goto end_ct_remove;
+    for (int i = 0; i < nbuckets; i++) {
+        localbucketContext.bucketName = buckets[i];
+        ct_retry_init(&retry);
+        do {
+            struct ct_s3_req req;
+            ct_s3_req_init(&req, CT_S3_DELETE, &localbucketContext, object_name,
+                           &deleteResponseHandler, &delete_data);
+            delete_data.req = &req;
+            ct_s3_engine_run(&req);
+            delete_data.req = NULL;
+        } while (ct_retry_should(&retry, delete_data.status));
+
+        if (delete_data.status != S3StatusOK) {
+            rc = -EIO;
+            tlog_error("S3Error %s", S3_get_status_name(delete_data.status));
+            goto end_ct_remove;
+        }
     }
+    ct_obj_index_remove(&hai->hai_fid);
 
 end_ct_remove:
-    rc |= ct_action_done(&hcp, hai, 0, rc);
+    rc |= ct_action_done(&hcp, hai, ct_hp_flags(rc), rc);
 
     return rc;
 }
 
 int ct_cancel(const struct hsm_action_item *hai, const long hal_flags) {
-    tlog_info("cancel not implemented for file system '%s'", ct_opt.o_mnt);
     /* Don't report progress to coordinator for this cookie:
-     * the copy function will get ECANCELED when reporting
-     * progress. */
+     * the action cancelled ends itself with ECANCELED. */
+    if (!ct_cancel_request(hai->hai_cookie))
+        tlog_info("no running action to cancel for cookie=%#jx",
+                  (uintmax_t)hai->hai_cookie);
     return 0;
 }
 
+// libcurl buffers of one transfer, counted in the memory of an action
+#define CT_XFER_MEMORY (64 * 1024)
+
+void ct_action_cost(const struct hsm_action_item *hai, size_t size,
+                    struct ct_pool_cost *cost) {
+    memset(cost, 0, sizeof(*cost));
+
+    switch (hai->hai_action) {
+    case HSMA_ARCHIVE:
+        if (ct_pack_enabled() && size < ct_pack_threshold()) {
+            // copied into the pack buffer, sent with the pack
+            cost->memory = size;
+        } else if (size >= MAX_OBJ_SIZE_LEVEL) {
+            // parts are read from the file by libcurl
+            size_t chunk_size, total_seq;
+            ct_get_chunksize(size, &chunk_size, &total_seq);
+            int window = (mpu_parts_per_object < total_seq) ?
+                         mpu_parts_per_object : total_seq;
+            cost->transfers = window;
+            cost->bytes = (uint64_t)window * chunk_size;
+            cost->memory = (uint64_t)window * CT_XFER_MEMORY;
+        } else {
+            // streamed through the worker bounce buffer
+            cost->transfers = 1;
+            cost->bytes = size;
+            cost->memory = ((size < CT_BOUNCE_BUFFER_SIZE) ? size : CT_BOUNCE_BUFFER_SIZE) +
+                           CT_XFER_MEMORY;
+        }
+        break;
+    case HSMA_RESTORE: {
+        // ranges of CHUNK_SIZE are written to the file as they arrive
+        uint64_t ranges = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        int streams = (restore_streams > 1 && ranges > 1) ?
+                      ((ranges < restore_streams) ? ranges : restore_streams) : 1;
+        uint64_t bytes = (uint64_t)streams * CHUNK_SIZE;
+        cost->transfers = streams;
+        cost->bytes = (size && size < bytes) ? size : bytes;
+        cost->memory = (uint64_t)streams * CT_XFER_MEMORY;
+        break;
+    }
+    case HSMA_REMOVE:
+        // a spooled remove is deleted later by the delete queue
+        if (!ct_delete_queue_enabled()) {
+            cost->transfers = 1;
+            cost->memory = CT_XFER_MEMORY;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// archives held in a pack are stored with it
+void ct_deferred_flush(void) {
+    ct_pack_destroy();
+}
+
 static int ct_s3_cleanup(void) {
     int rc = 0;
 
     tlog_info("copytool cleanup on file system '%s'", ct_opt.o_mnt);
     rc = ct_cleanup();
     if (rc == 0) {
+        ct_pack_destroy();
+        ct_delete_queue_destroy();
+        ct_mpu_reaper_destroy();
+        ct_s3_engine_destroy();
+        ct_fid_cache_destroy();
+        ct_obj_index_destroy();
+        if (key_index_fd >= 0)
+            close(key_index_fd);
         S3_deinitialize();
     }
 
@@ -1172,6 +2810,9 @@ int main(int argc, char **argv) {
     // because found following message in log:
     // [Auto enable multi-process write mode, log may be lost,
     // please enable multi-process write mode manually]
+    // signals only reach the main thread, see ct_signals_block
+    ct_signals_block();
+
     unsigned int tlog_flag = 0;
     tlog_flag |= TLOG_MULTI_WRITE;
     rc = tlog_init("/var/log/hsm_s3copytool.log", log_size_max, log_max, 0, 0);
@@ -1203,10 +2844,110 @@ int main(int argc, char **argv) {
         goto error_cleanup;
     }
 
+    ct_retry_setup(retry_budget, retry_max_delay_ms);
+    ct_breaker_setup(breaker_failures, breaker_open_ms);
+    ct_s3_engine_setup_timeouts(request_timeout_base_ms, stall_timeout);
+
+    rc = ct_hedge_setup(hedge_percentile, hedge_budget_percent);
+    if (rc != 0)
+        goto error_cleanup;
+
+    // file I/O runs on the engine threads, see CT_S3_ENGINE_THREADS_MIN
+    if (s3_engine_threads == 0) {
+        s3_engine_threads = max_requests / CT_S3_ENGINE_WORKERS_PER_THREAD;
+        if (s3_engine_threads < CT_S3_ENGINE_THREADS_MIN)
+            s3_engine_threads = CT_S3_ENGINE_THREADS_MIN;
+    }
+    rc = ct_s3_engine_init(s3_engine_threads);
+    if (rc != 0) {
+        tlog_error("Error in S3 engine init");
+        goto error_cleanup;
+    }
+
+    rc = sem_init(&mpu_part_sem, 0, mpu_parts_total);
+    if (rc != 0) {
+        tlog_error("cannot call sem_init");
+        goto error_cleanup;
+    }
+
     #ifdef CT_MEM_QUOTA_ENABLED
-    quota_mem_init(CT_MEM_QUOTA_SIZE);
+    quota_mem_init(mem_quota_size, mem_quota_timeout);
     #endif
 
+    if (adaptive_concurrency) {
+        struct ct_adapt_params adapt_params = {
+            .min = adaptive_min_requests,
+            .max = max_requests,
+            .tolerance = adaptive_latency_tolerance,
+        };
+        rc = ct_adapt_init(&adapt_params, ct_pool_set_limit);
+        if (rc != 0) {
+            tlog_error("Error in adaptive concurrency init");
+            goto error_cleanup;
+        }
+    }
+
+    rc = ct_fid_cache_init(fid_cache_size, fid_cache_ttl, fid_cache_negative_ttl);
+    if (rc != 0) {
+        tlog_error("Error in FID to path cache init");
+        goto error_cleanup;
+    }
+
+    if (object_key_mode == CT_KEY_MODE_FID && key_index_path[0] != '\0') {
+        key_index_fd = open(key_index_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                            0644);
+        if (key_index_fd < 0) {
+            rc = -errno;
+            tlog_error("cannot open key index '%s': %s", key_index_path,
+                       strerror(errno));
+            goto error_cleanup;
+        }
+    }
+
+    rc = ct_mpu_journal_init(mpu_journal_dir);
+    if (rc != 0) {
+        tlog_error("Error in multipart upload journal init");
+        goto error_cleanup;
+    }
+
+    rc = ct_obj_index_init(obj_index_path, obj_index_capacity);
+    if (rc != 0) {
+        tlog_error("Error in object index init");
+        goto error_cleanup;
+    }
+
+    rc = ct_delete_queue_init(remove_spool_dir, remove_batch_size, remove_batch_window,
+                              &bucketContext);
+    if (rc != 0) {
+        tlog_error("Error in delete queue init");
+        goto error_cleanup;
+    }
+
+    const char **reap_buckets = calloc(bucket_count + 1, sizeof(*reap_buckets));
+    if (reap_buckets == NULL) {
+        rc = -ENOMEM;
+        goto error_cleanup;
+    }
+    int reap_nbuckets = 0;
+    reap_buckets[reap_nbuckets++] = bucket_name;
+    for (int i = 0; bucket_count > 1 && i < bucket_count; i++)
+        reap_buckets[reap_nbuckets++] = bucket_shards[i];
+    rc = ct_mpu_reaper_init(mpu_reap_age, mpu_reap_interval, mpu_reap_rate,
+                            &bucketContext, reap_buckets, reap_nbuckets);
+    free(reap_buckets);
+    if (rc != 0) {
+        tlog_error("Error in multipart upload reaper init");
+        goto error_cleanup;
+    }
+
+    if (pack_enabled) {
+        rc = ct_pack_init(&pack_params, &bucketContext);
+        if (rc != 0) {
+            tlog_error("Error in pack init");
+            goto error_cleanup;
+        }
+    }
+
     rc = ct_run();
 
 error_cleanup:
@@ -57,8 +57,6 @@
 #include "growbuffer.h"
 #include "hsm_s3_utils.h"
 
-#define RETRYCOUNT 5
-
 #define MD5_ASCII 32 + 1
 
 extern char access_key[ S3_MAX_KEY_SIZE ];
@@ -74,13 +72,14 @@ static int ct_parseopts(int argc, char *const *argv);
 
 static int ct_archive_data(struct hsm_copyaction_private *hcp, const char *src,
                            const char *dst, int src_fd, struct stat *src_st,
-                           const struct hsm_action_item *hai, long hal_flags);
+                           const struct hsm_action_item *hai, long hal_flags,
+                           uint64_t data_version, char *etag);
 
 static int ct_archive_data_big(struct hsm_copyaction_private *hcp,
                                const char *src, const char *dst, int src_fd,
                                struct stat *src_st,
                                const struct hsm_action_item *hai,
-                               long hal_flags);
+                               long hal_flags, uint64_t data_version, char *etag);
 
 static int ct_restore_data(struct hsm_copyaction_private *hcp, const char *src,
                            const char *dst, int dst_fd,
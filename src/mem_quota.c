@@ -1,68 +1,218 @@
+#include <errno.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
 
+#include "mem_quota.h"
+#include "tlog.h"
+
 // memory quota module used to limit copytool memory usage
 // in current code, most of memory used by small file (no more than MAX_OBJ_SIZE_LEVEL)
 // we can start by only control memory usage by those files
+//
+// callers that do not fit queue in arrival order, each on its own
+// condition, a free grants the quota to the head of the queue only, and
+// to the ones after it as long as they fit, so nobody is woken for nothing
+// and a large allocation is not overtaken by the small ones behind it
+
+struct quota_waiter {
+    size_t size;
+    pthread_cond_t cond;
+    // set by the granting thread, quota already taken for the waiter
+    bool granted;
+    struct quota_waiter *next;
+};
 
 static  size_t quota_total;
-static  size_t quota_left;
-static  size_t quota_waiters;
-static  pthread_mutex_t  quota_mutex;
-static  pthread_cond_t    quota_cond;
+static  size_t quota_used;
+static  int    quota_timeout_ms;
+static  struct quota_waiter *quota_head;
+static  struct quota_waiter *quota_tail;
+static  struct quota_mem_stats quota_stats;
+static  pthread_mutex_t  quota_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// must hold quota_mutex
+static bool quota_fits(size_t size)
+{
+    return size <= quota_total - quota_used;
+}
+
+// must hold quota_mutex
+static void quota_take(size_t size)
+{
+    quota_used += size;
+    if (quota_used > quota_stats.peak)
+        quota_stats.peak = quota_used;
+    quota_stats.allocs++;
+}
+
+// must hold quota_mutex
+static void quota_unlink(struct quota_waiter *waiter)
+{
+    struct quota_waiter **prev = &quota_head;
+
+    while (*prev && *prev != waiter)
+        prev = &(*prev)->next;
+    if (*prev == NULL)
+        return;
+
+    *prev = waiter->next;
+    if (quota_tail == waiter) {
+        quota_tail = NULL;
+        for (struct quota_waiter *w = quota_head; w; w = w->next)
+            quota_tail = w;
+    }
+    quota_stats.waiters--;
+}
 
-void quota_mem_init(size_t quota_size)
+// serve the head of the queue while it fits
+// must hold quota_mutex
+static void quota_grant(void)
 {
+    while (quota_head && quota_fits(quota_head->size)) {
+        struct quota_waiter *waiter = quota_head;
+
+        quota_take(waiter->size);
+        waiter->granted = true;
+        quota_unlink(waiter);
+        pthread_cond_signal(&waiter->cond);
+    }
+}
+
+void quota_mem_init(size_t quota_size, int timeout_ms)
+{
+    pthread_mutex_lock(&quota_mutex);
     quota_total = quota_size;
-    quota_left = quota_size;
-    quota_waiters = 0;
-    pthread_mutex_init (&quota_mutex, NULL);
-    pthread_cond_init (&quota_cond, NULL);
+    quota_used = 0;
+    quota_timeout_ms = timeout_ms;
+    quota_head = quota_tail = NULL;
+    memset(&quota_stats, 0, sizeof(quota_stats));
+    pthread_mutex_unlock(&quota_mutex);
+
+    if (timeout_ms > 0)
+        tlog_info("memory quota of %zu bytes, wait up to %d ms", quota_size, timeout_ms);
+    else
+        tlog_info("memory quota of %zu bytes", quota_size);
 }
 
 void quota_mem_destroy()
 {
-    pthread_mutex_destroy(&quota_mutex);
-    pthread_cond_destroy (&quota_cond);
+    struct quota_mem_stats stats;
+
+    quota_mem_stats(&stats);
+    tlog_info("memory quota: %lu allocations, %lu waited %.3f s in total, "
+              "%lu timed out, %lu failed, peak %zu of %zu bytes",
+              (unsigned long)stats.allocs, (unsigned long)stats.waits,
+              stats.wait_seconds, (unsigned long)stats.timeouts,
+              (unsigned long)stats.failures, stats.peak, stats.total);
 }
 
 void quota_mem_free(void *mem_ptr, size_t mem_size)
 {
-    bool notify_waiter = false;
-retry:
+    free(mem_ptr);
+
     pthread_mutex_lock(&quota_mutex);
-    quota_left += mem_size;
-    if (quota_waiters)  notify_waiter = true;
+    quota_used -= mem_size;
+    quota_grant();
     pthread_mutex_unlock(&quota_mutex);
-    free(mem_ptr);
-    if (notify_waiter)
-        pthread_cond_signal(&quota_cond);
+}
+
+static double quota_elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
 }
 
 void *quota_mem_alloc(size_t alloc_size)
 {
-    bool alloc_it = false;
-retry:
+    struct quota_waiter waiter = { .size = alloc_size };
+    struct timespec start, deadline;
+    int rc = 0;
+
     pthread_mutex_lock(&quota_mutex);
-    if (alloc_size <= quota_left)
-    {
-        alloc_it = true;
-        quota_left -= alloc_size;
+    if (alloc_size > quota_total) {
+        quota_stats.failures++;
+        pthread_mutex_unlock(&quota_mutex);
+        tlog_error("allocation of %zu bytes above the memory quota of %zu bytes",
+                   alloc_size, quota_total);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // nobody queued ahead, no need to wait
+    if (quota_head == NULL && quota_fits(alloc_size)) {
+        quota_take(alloc_size);
+        goto alloc;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waiter.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (quota_tail)
+        quota_tail->next = &waiter;
+    else
+        quota_head = &waiter;
+    quota_tail = &waiter;
+    quota_stats.waiters++;
+    quota_stats.waits++;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    deadline.tv_sec += quota_timeout_ms / 1000;
+    deadline.tv_nsec += (quota_timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (!waiter.granted && rc != ETIMEDOUT) {
+        if (quota_timeout_ms > 0)
+            rc = pthread_cond_timedwait(&waiter.cond, &quota_mutex, &deadline);
+        else
+            pthread_cond_wait(&waiter.cond, &quota_mutex);
+    }
+    quota_stats.wait_seconds += quota_elapsed(&start);
+
+    if (!waiter.granted) {
+        // leaving the head may let the next ones in
+        quota_stats.timeouts++;
+        quota_unlink(&waiter);
+        quota_grant();
         pthread_mutex_unlock(&quota_mutex);
-        void *ptr = malloc(alloc_size);
-        if (ptr == NULL)  {
-            // return quota
-            pthread_mutex_lock(&quota_mutex);
-            quota_left += alloc_size;
-            pthread_mutex_unlock(&quota_mutex);
-        }
-        return ptr;
-    } else {
-        quota_waiters++;
-        int ret = pthread_cond_wait(&quota_cond, &quota_mutex);
-        quota_waiters--;
+        pthread_cond_destroy(&waiter.cond);
+        errno = ETIMEDOUT;
+        return NULL;
+    }
+    pthread_cond_destroy(&waiter.cond);
+
+alloc:
+    pthread_mutex_unlock(&quota_mutex);
+
+    void *ptr = malloc(alloc_size);
+    if (ptr == NULL) {
+        // return quota
+        pthread_mutex_lock(&quota_mutex);
+        quota_used -= alloc_size;
+        quota_stats.failures++;
+        quota_grant();
         pthread_mutex_unlock(&quota_mutex);
-        goto retry;
+        errno = ENOMEM;
     }
-}
\ No newline at end of file
+    return ptr;
+}
+
+void quota_mem_stats(struct quota_mem_stats *stats)
+{
+    pthread_mutex_lock(&quota_mutex);
+    *stats = quota_stats;
+    stats->total = quota_total;
+    stats->used = quota_used;
+    pthread_mutex_unlock(&quota_mutex);
+}
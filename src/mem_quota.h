@@ -1,15 +1,42 @@
+#pragma once
+
 #include <stddef.h>
+#include <stdint.h>
 
 #define CT_MEM_QUOTA_ENABLED 1
 
-// size must add L to define macro as long int
+// default quota, size must add L to define macro as long int
 // otherwise it will lead overflow
 #define CT_MEM_QUOTA_SIZE (8 * 1024 * 1024 * 1024L)
 
-void quota_mem_init(size_t quota_size);
+// accounting of the quota since init
+struct quota_mem_stats {
+    size_t total;
+    size_t used;
+    size_t peak;
+    // callers queued right now
+    size_t waiters;
+    uint64_t allocs;
+    // allocations that had to queue
+    uint64_t waits;
+    uint64_t timeouts;
+    // allocations larger than the quota or failed malloc
+    uint64_t failures;
+    // time spent queued by all callers
+    double wait_seconds;
+};
+
+// timeout_ms bounds the wait of quota_mem_alloc, 0 waits as long as needed
+void quota_mem_init(size_t quota_size, int timeout_ms);
 
 void quota_mem_destroy();
 
 void quota_mem_free(void *mem_ptr, size_t mem_size);
 
+// callers are served in arrival order, a caller that does not fit blocks
+// the ones behind it so large allocations are not starved by small ones
+// NULL with errno ETIMEDOUT when the wait timed out, ENOMEM when alloc_size
+// is larger than the quota or malloc failed
 void *quota_mem_alloc(size_t alloc_size);
+
+void quota_mem_stats(struct quota_mem_stats *stats);
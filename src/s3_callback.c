@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "hsm_s3_utils.h"
 #include "tlog.h"
@@ -31,10 +33,59 @@ int put_objectdata_callback(int bufferSize, char *buffer,
     return size;
 }
 
+// stream contentLength bytes of data->fd from data->file_offset through the
+// bounce buffer data->buffer, refilled with pread when it runs empty
+int put_objectdata_stream_callback(int bufferSize, char *buffer,
+                                   void *callbackData) {
+    put_object_callback_data *data = (put_object_callback_data *)callbackData;
+    int size = 0;
+    assert(data && buffer && data->buffer);
+
+    // action cancelled
+    if (data->req && ct_s3_req_aborted(data->req))
+        return -1;
+
+    if (data->contentLength == 0)
+        return 0;
+
+    if (data->buffer_offset == data->buffer_len) {
+        size_t to_read = (data->contentLength > data->buffer_size) ?
+                         data->buffer_size : data->contentLength;
+        ct_s3_engine_io_begin();
+        ssize_t rc_read = pread(data->fd, data->buffer, to_read, data->file_offset);
+        ct_s3_engine_io_end();
+        if (rc_read != (ssize_t)to_read) {
+            tlog_error("failed to read data from %s at offset %lu, request size %lu, get size %ld",
+                       data->file_name, data->file_offset, to_read, rc_read);
+            // abort the put, a short object must not be stored
+            return -1;
+        }
+        data->file_offset += rc_read;
+        data->buffer_len = rc_read;
+        data->buffer_offset = 0;
+
+        // start reading the next window while this one is sent
+        if (data->contentLength > to_read)
+            posix_fadvise(data->fd, data->file_offset, data->buffer_size,
+                          POSIX_FADV_WILLNEED);
+    }
+
+    size = data->buffer_len - data->buffer_offset;
+    if (size > bufferSize)
+        size = bufferSize;
+    memcpy(buffer, data->buffer + data->buffer_offset, size);
+    data->buffer_offset += size;
+    data->contentLength -= size;
+
+    return size;
+}
+
 void s3_get_response_complete_callback(S3Status status, const S3ErrorDetails *error,
                                    void *callbackData) {
     get_object_callback_data *data = (get_object_callback_data *)callbackData;
     data->status = status;
+    if (data->req)
+        ct_s3_req_complete(data->req, status, error);
     return;
 }
 
@@ -43,6 +94,8 @@ void s3_del_response_complete_callback(S3Status status,
                                        void *callbackData) {
     del_object_callback_data *data = (del_object_callback_data *)callbackData;
     data->status = status;
+    if (data->req)
+        ct_s3_req_complete(data->req, status, error);
     return;
 }
 
@@ -51,6 +104,8 @@ void s3_put_response_complete_callback(S3Status status,
                                        void *callbackData) {
     put_object_callback_data *data = (put_object_callback_data *)callbackData;
     data->status = status;
+    if (data->req)
+        ct_s3_req_complete(data->req, status, error);
     return;
 }
 
@@ -67,8 +122,36 @@ S3Status s3_response_get_object_properties_callback(const S3ResponseProperties *
         strncpy(data->md5, properties->eTag + 1, MD5_ASCII - 1);
     }
 
-    // TODO: need collect what lustre meta data we want to use when put object's meta data
+    for (int i = 0; i < properties->metaDataCount; i++) {
+        if (strcmp(properties->metaData[i].name, CT_META_DATA_VERSION) == 0)
+            data->data_version = strtoull(properties->metaData[i].value, NULL, 10);
+    }
+
+    return S3StatusOK;
+}
+
+// etag as sent by S3, quoted
+static void s3_copy_etag(char *dst, size_t size, const char *etag)
+{
+    if (etag == NULL) {
+        dst[0] = '\0';
+        return;
+    }
+
+    if (*etag == '"')
+        etag++;
+    snprintf(dst, size, "%s", etag);
+    size_t len = strlen(dst);
+    if (len && dst[len - 1] == '"')
+        dst[len - 1] = '\0';
+}
+
+S3Status s3_response_put_object_properties_callback(const S3ResponseProperties *properties,
+                                                    void *callbackData) {
+    put_object_callback_data *data = (put_object_callback_data *)callbackData;
 
+    s3_response_properties_callback(properties, callbackData);
+    s3_copy_etag(data->etag, sizeof(data->etag), properties->eTag);
     return S3StatusOK;
 }
 
@@ -79,7 +162,16 @@ S3Status get_objectdata_callback(int bufferSize, const char *buffer, void *callb
     {
         abort();
     }
-    ssize_t wrote = write(data->fd, buffer, bufferSize);
+    // action cancelled
+    if (data->req && ct_s3_req_aborted(data->req))
+    {
+        data->status = S3StatusAbortedByCallback;
+        return S3StatusAbortedByCallback;
+    }
+    // positional write, ranges of the same file are written concurrently
+    ct_s3_engine_io_begin();
+    ssize_t wrote = pwrite(data->fd, buffer, bufferSize, data->file_offset);
+    ct_s3_engine_io_end();
 
     if (wrote < bufferSize)
     {
@@ -120,8 +212,9 @@ S3Status multipart_put_part_response_properies_callback
     MultipartPartData *data = (MultipartPartData *) callbackData;
     int seq = data->seq;
     const char *etag = properties->eTag;
-    data->manager->etags[seq - 1] = strdup(etag);
-    data->manager->next_etags_pos = seq;
+    // a retried part may already have an etag from a failed attempt
+    free(data->manager->etags[seq - 1]);
+    data->manager->etags[seq - 1] = etag ? strdup(etag) : NULL;
     tlog_info("callback for put_part seq of %d for upload_id %s,", seq, data->manager->upload_id);
     return S3StatusOK;
 }
@@ -133,12 +226,19 @@ int multipart_put_objectdata_callback(int bufferSize, char *buffer,
     put_object_callback_data *data =
         (put_object_callback_data *) callbackData;
 
+    // action cancelled
+    if (data->req && ct_s3_req_aborted(data->req))
+        return -1;
+
     int ret = 0;
     if (data->contentLength) {
         int toRead = ((data->contentLength > (unsigned) bufferSize) ?
                       (unsigned) bufferSize : data->contentLength);
         if (data->fd) {
-            ret = read(data->fd, buffer, toRead);
+            // positional read, parts of the same file are read concurrently
+            ct_s3_engine_io_begin();
+            ret = pread(data->fd, buffer, toRead, data->file_offset);
+            ct_s3_engine_io_end();
             if (ret != toRead)
             {
                 tlog_error("failed to read file");
@@ -181,12 +281,22 @@ int multipart_commit_response_callback(int bufferSize, char *buffer, void *callb
     return ret;
 }
 
+S3Status multipart_commit_etag_callback(const char *location, const char *etag,
+                                        void *callbackData)
+{
+    UploadManager *manager = (UploadManager *)callbackData;
+
+    (void) location;
+    s3_copy_etag(manager->etag, sizeof(manager->etag), etag);
+    return S3StatusOK;
+}
+
 // response complete callback ------------------------------------------------
 void multipart_init_response_complete_callback(S3Status status,
                                      const S3ErrorDetails *error,
                                      void *callbackData)
 {
-    (void) callbackData;
+    UploadManager *manager = (UploadManager *)callbackData;
 
     if (error && error->message) {
         tlog_error("Message: %s", error->message);
@@ -203,6 +313,9 @@ void multipart_init_response_complete_callback(S3Status status,
             tlog_error("%s: %s", error->extraDetails[i].name, error->extraDetails[i].value);
         }
     }
+
+    if (manager->req)
+        ct_s3_req_complete(manager->req, status, error);
 }
 
 void multipart_put_response_complete_callback(S3Status status,
@@ -227,6 +340,9 @@ void multipart_put_response_complete_callback(S3Status status,
                        error->extraDetails[i].value);
         }
     }
+
+    if (part_data->put_object_data.req)
+        ct_s3_req_complete(part_data->put_object_data.req, status, error);
 }
 
 void multipart_commit_response_complete_callback(S3Status status,
@@ -254,6 +370,9 @@ void multipart_commit_response_complete_callback(S3Status status,
                        error->extraDetails[i].value);
         }
     }
+
+    if (manager->req)
+        ct_s3_req_complete(manager->req, status, error);
 }
 
 // This callback does the same thing for every request type: prints out the
@@ -10,11 +10,15 @@
 #include "libs3.h"
 #include "growbuffer.h"
 #include "ct_common.h"
+#include "ct_s3_engine.h"
 
 typedef struct put_object_callback_data {
     size_t buffer_offset;
     S3Status status;
     char *buffer;
+    // bounce buffer capacity and valid bytes, streaming put only
+    size_t buffer_size;
+    size_t buffer_len;
     growbuffer *gb;
     size_t contentLength;
     size_t originalContentLength;
@@ -24,24 +28,37 @@ typedef struct put_object_callback_data {
     int fd;
     char *file_name;
     size_t file_offset;
+    // ETag of the stored object without quotes
+    char etag[ ETAG_ASCII ];
+    struct ct_s3_req *req;
 } put_object_callback_data;
 
+// object metadata (x-amz-meta-*) written by archive
+#define CT_META_DATA_VERSION "data-version"
+#define CT_META_SIZE "size"
+
 typedef struct get_object_callback_data {
     size_t totalLength;
     size_t contentLength;
     S3Status status;
     char md5[ MD5_ASCII ];
+    // lustre data version the object was archived from, 0 when unknown
+    uint64_t data_version;
     int fd;
     char *file_path;
     size_t file_offset;
+    struct ct_s3_req *req;
 } get_object_callback_data;
 
 typedef struct del_object_callback_data {
     S3Status status;
+    struct ct_s3_req *req;
 } del_object_callback_data;
 
 int put_objectdata_callback(int bufferSize, char *buffer, void *callbackData);
 
+int put_objectdata_stream_callback(int bufferSize, char *buffer, void *callbackData);
+
 S3Status get_objectdata_callback(int bufferSize, const char *buffer,
                                  void *callbackData);
 
@@ -51,6 +68,9 @@ S3Status s3_response_properties_callback(const S3ResponseProperties *properties,
 S3Status s3_response_get_object_properties_callback(const S3ResponseProperties *properties,
                                                     void *callbackData);
 
+S3Status s3_response_put_object_properties_callback(const S3ResponseProperties *properties,
+                                                    void *callbackData);
+
 void s3_del_response_complete_callback(S3Status status, const S3ErrorDetails *error,
                                     void *callbackData);
 
@@ -70,6 +90,9 @@ S3Status multipart_put_part_response_properies_callback(const S3ResponseProperti
 
 int multipart_commit_response_callback(int bufferSize, char *buffer, void *callbackData);
 
+S3Status multipart_commit_etag_callback(const char *location, const char *etag,
+                                        void *callbackData);
+
 void multipart_init_response_complete_callback(S3Status status,
                                           const S3ErrorDetails *error,
                                           void *callbackData);